@@ -0,0 +1,704 @@
+/*
+ * Build archives
+ *
+ * Tar archives are a sequence of 512 byte headers each followed by the data
+ * of the member, so the offsets are found by walking the headers. Long names
+ * come as GNU 'L' or pax 'x' headers preceding the member. Zip archives have
+ * a central directory at the end listing the members, and each member's data
+ * follows a local header whose length must be read to find it. Zip64 records
+ * are followed for archives and members past 4 GiB.
+ */
+#include "archive.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+
+#include "logger.h"
+
+namespace archive {
+
+#define TAR_BLOCK 512
+/* Largest long name or pax header accepted */
+#define TAR_MAX_META (64 * 1024)
+
+#define ZIP_LOCAL_MAGIC 0x04034b50
+#define ZIP_CENTRAL_MAGIC 0x02014b50
+#define ZIP_EOCD_MAGIC 0x06054b50
+#define ZIP64_LOCATOR_MAGIC 0x07064b50
+#define ZIP64_EOCD_MAGIC 0x06064b50
+#define ZIP_EOCD_SIZE 22
+#define ZIP64_LOCATOR_SIZE 20
+#define ZIP64_EOCD_SIZE 56
+/* The end of central directory may be followed by a comment */
+#define ZIP_EOCD_SEARCH (ZIP_EOCD_SIZE + 65535)
+
+/* Compressed data handed to zlib at a time */
+#define INFLATE_CHUNK (1024 * 1024)
+
+static std::mutex lock;
+static std::map<std::string, std::shared_ptr<const Archive>> archives;
+
+static uint16_t le16(const unsigned char* p) {
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const unsigned char* p) {
+	return le16(p) | (uint32_t)le16(p + 2) << 16;
+}
+
+static uint64_t le64(const unsigned char* p) {
+	return le32(p) | (uint64_t)le32(p + 4) << 32;
+}
+
+static int read_at(int fd, void* buf, size_t len, uint64_t offset) {
+	size_t got = 0;
+	ssize_t n;
+
+	while (got < len) {
+		n = pread(fd, (char*)buf + got, len - got, offset + got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		if (n == 0)
+			return -EIO;
+		got += n;
+	}
+
+	return 0;
+}
+
+void Archive::add(Entry entry) {
+	size_t slash;
+
+	while (!entry.name.compare(0, 2, "./"))
+		entry.name.erase(0, 2);
+
+	slash = entry.name.rfind('/');
+	names.emplace(entry.name, members.size());
+	basenames.emplace(
+		slash == std::string::npos ? entry.name : entry.name.substr(slash + 1),
+		members.size());
+	members.push_back(std::move(entry));
+}
+
+/* Octal, or GNU base-256 for sizes past 8 GiB */
+static uint64_t tar_number(const unsigned char* field, size_t len) {
+	uint64_t value = 0;
+	size_t i;
+
+	if (field[0] & 0x80) {
+		value = field[0] & 0x7f;
+		for (i = 1; i < len; i++)
+			value = value << 8 | field[i];
+		return value;
+	}
+
+	for (i = 0; i < len && field[i] == ' '; i++)
+		;
+	for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+		value = value * 8 + field[i] - '0';
+
+	return value;
+}
+
+static bool tar_valid(const unsigned char* hdr) {
+	unsigned sum = 0;
+	unsigned i;
+
+	/* The checksum field counts as spaces */
+	for (i = 0; i < TAR_BLOCK; i++)
+		sum += i >= 148 && i < 156 ? ' ' : hdr[i];
+
+	return sum == tar_number(hdr + 148, 8);
+}
+
+/* Records of "<length> <key>=<value>\n" */
+static void pax_parse(const std::string& data,
+					  std::string& path,
+					  uint64_t* size) {
+	size_t pos = 0;
+	size_t len;
+	size_t eq;
+	char* end;
+
+	while (pos < data.size()) {
+		len = strtoul(data.c_str() + pos, &end, 10);
+		if (!len || *end != ' ' || pos + len > data.size())
+			break;
+
+		std::string record((const char*)end + 1, data.c_str() + pos + len - 1);
+		eq = record.find('=');
+		if (!record.compare(0, eq, "path"))
+			path = record.substr(eq + 1);
+		else if (!record.compare(0, eq, "size"))
+			*size = strtoull(record.c_str() + eq + 1, NULL, 10);
+
+		pos += len;
+	}
+}
+
+static int index_tar(Archive& archive,
+					 int fd,
+					 uint64_t file_size) {
+	unsigned char hdr[TAR_BLOCK];
+	uint64_t pax_size = UINT64_MAX;
+	std::string long_name;
+	std::string pax_path;
+	std::string data;
+	std::string name;
+	uint64_t pos = 0;
+	uint64_t size;
+	char type;
+	int ret;
+
+	while (pos + TAR_BLOCK <= file_size) {
+		ret = read_at(fd, hdr, TAR_BLOCK, pos);
+		if (ret < 0)
+			return ret;
+
+		/* Zero blocks end the archive */
+		if (!hdr[0])
+			break;
+		if (!tar_valid(hdr))
+			return -EINVAL;
+
+		size = tar_number(hdr + 124, 12);
+		type = hdr[156];
+		pos += TAR_BLOCK;
+
+		if (type == 'L' || type == 'x') {
+			if (size > TAR_MAX_META)
+				return -EINVAL;
+
+			data.resize(size);
+			ret = read_at(fd, &data[0], size, pos);
+			if (ret < 0)
+				return ret;
+
+			if (type == 'L')
+				long_name = data.c_str();
+			else
+				pax_parse(data, pax_path, &pax_size);
+		} else {
+			if (pax_size != UINT64_MAX)
+				size = pax_size;
+
+			if (!pax_path.empty()) {
+				name = pax_path;
+			} else if (!long_name.empty()) {
+				name = long_name;
+			} else {
+				name.assign((char*)hdr, strnlen((char*)hdr, 100));
+				/* ustar splits long names in a prefix and a name */
+				if (!memcmp(hdr + 257, "ustar", 5) && hdr[345])
+					name = std::string((char*)hdr + 345,
+									   strnlen((char*)hdr + 345, 155)) +
+						   "/" + name;
+			}
+
+			if ((type == '0' || type == '\0' || type == '7') &&
+				pos + size <= file_size)
+				archive.add({name, pos, size, size, false});
+
+			long_name.clear();
+			pax_path.clear();
+			pax_size = UINT64_MAX;
+		}
+
+		pos += (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+	}
+
+	return 0;
+}
+
+static int index_zip(Archive& archive,
+					 int fd,
+					 uint64_t file_size) {
+	unsigned char eocd64[ZIP64_EOCD_SIZE];
+	unsigned char local[30];
+	std::vector<unsigned char> tail;
+	std::vector<unsigned char> dir;
+	const unsigned char* extra;
+	const unsigned char* field;
+	const unsigned char* end;
+	const unsigned char* p;
+	uint64_t dir_offset;
+	uint64_t dir_size;
+	uint64_t entries;
+	uint64_t offset;
+	uint64_t csize;
+	uint64_t size;
+	unsigned name_len;
+	unsigned extra_len;
+	unsigned method;
+	std::string name;
+	uint64_t pos;
+	uint64_t i;
+	size_t at;
+	int ret;
+
+	if (file_size < ZIP_EOCD_SIZE)
+		return -EINVAL;
+
+	tail.resize(std::min<uint64_t>(file_size, ZIP_EOCD_SEARCH));
+	ret = read_at(fd, tail.data(), tail.size(), file_size - tail.size());
+	if (ret < 0)
+		return ret;
+
+	for (at = tail.size() - ZIP_EOCD_SIZE; le32(&tail[at]) != ZIP_EOCD_MAGIC;
+		 at--)
+		if (!at)
+			return -EINVAL;
+
+	entries = le16(&tail[at + 10]);
+	dir_size = le32(&tail[at + 12]);
+	dir_offset = le32(&tail[at + 16]);
+
+	if (entries == 0xffff || dir_size == 0xffffffff ||
+		dir_offset == 0xffffffff) {
+		if (at < ZIP64_LOCATOR_SIZE ||
+			le32(&tail[at - ZIP64_LOCATOR_SIZE]) != ZIP64_LOCATOR_MAGIC)
+			return -EINVAL;
+
+		ret = read_at(fd, eocd64, sizeof(eocd64),
+					  le64(&tail[at - ZIP64_LOCATOR_SIZE + 8]));
+		if (ret < 0)
+			return ret;
+		if (le32(eocd64) != ZIP64_EOCD_MAGIC)
+			return -EINVAL;
+
+		entries = le64(eocd64 + 32);
+		dir_size = le64(eocd64 + 40);
+		dir_offset = le64(eocd64 + 48);
+	}
+
+	if (dir_offset + dir_size > file_size)
+		return -EINVAL;
+
+	dir.resize(dir_size);
+	ret = read_at(fd, dir.data(), dir.size(), dir_offset);
+	if (ret < 0)
+		return ret;
+
+	for (pos = 0, i = 0; i < entries; i++) {
+		p = dir.data() + pos;
+		if (pos + 46 > dir_size || le32(p) != ZIP_CENTRAL_MAGIC)
+			return -EINVAL;
+
+		method = le16(p + 10);
+		csize = le32(p + 20);
+		size = le32(p + 24);
+		name_len = le16(p + 28);
+		extra_len = le16(p + 30);
+		offset = le32(p + 42);
+		if (pos + 46 + name_len + extra_len + le16(p + 32) > dir_size)
+			return -EINVAL;
+
+		name.assign((const char*)p + 46, name_len);
+
+		/* The zip64 extra field holds the values that didn't fit */
+		extra = p + 46 + name_len;
+		end = extra + extra_len;
+		for (; extra + 4 <= end; extra += 4 + le16(extra + 2)) {
+			if (le16(extra) != 0x0001)
+				continue;
+
+			field = extra + 4;
+			if (size == 0xffffffff && field + 8 <= end) {
+				size = le64(field);
+				field += 8;
+			}
+			if (csize == 0xffffffff && field + 8 <= end) {
+				csize = le64(field);
+				field += 8;
+			}
+			if (offset == 0xffffffff && field + 8 <= end)
+				offset = le64(field);
+		}
+
+		pos += 46 + name_len + extra_len + le16(p + 32);
+
+		if (name.empty() || name.back() == '/')
+			continue;
+
+		if ((le16(p + 8) & 1) || (method != 0 && method != 8)) {
+			logger::warn("[ARCHIVE] %s: %s is encrypted or compressed with "
+						 "method %u, ignoring",
+						 archive.path(), name.c_str(), method);
+			continue;
+		}
+
+		ret = read_at(fd, local, sizeof(local), offset);
+		if (ret < 0)
+			return ret;
+		if (le32(local) != ZIP_LOCAL_MAGIC)
+			return -EINVAL;
+
+		offset += sizeof(local) + le16(local + 26) + le16(local + 28);
+		if (offset + csize > file_size)
+			return -EINVAL;
+
+		archive.add({name, offset, size, csize, method == 8});
+	}
+
+	return 0;
+}
+
+/**
+ * find() - look up the member @name, or if @name has no directory part, the
+ * first member with that file name in any directory
+ */
+const Entry* Archive::find(const char* name) const {
+	auto it = names.find(name);
+
+	if (it != names.end())
+		return &members[it->second];
+	if (strchr(name, '/'))
+		return NULL;
+
+	it = basenames.find(name);
+	if (it == basenames.end())
+		return NULL;
+
+	return &members[it->second];
+}
+
+/**
+ * open() - index the tar or zip archive at @path
+ *
+ * Returns the index, shared with earlier callers while the archive is
+ * unchanged, or nullptr with errno set if @path isn't a readable archive.
+ */
+std::shared_ptr<const Archive> open(const char* path) {
+	std::shared_ptr<Archive> archive;
+	unsigned char magic[4];
+	image::Stamp id;
+	int ret;
+	int fd;
+
+	ret = image::stamp(path, id);
+	if (ret < 0) {
+		errno = -ret;
+		return nullptr;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = archives.find(path);
+		if (it != archives.end() && it->second->id == id)
+			return it->second;
+	}
+
+	fd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return nullptr;
+
+	archive = std::make_shared<Archive>();
+	archive->file = path;
+	archive->id = id;
+
+	ret = read_at(fd, magic, sizeof(magic), 0);
+	if (ret == 0 && le32(magic) == ZIP_LOCAL_MAGIC)
+		ret = index_zip(*archive, fd, id.size);
+	else if (ret == 0)
+		ret = index_tar(*archive, fd, id.size);
+	close(fd);
+
+	if (ret < 0) {
+		logger::error("[ARCHIVE] unable to index %s: %s", path,
+					  ret == -EINVAL ? "not a tar or zip archive"
+									 : strerror(-ret));
+		errno = -ret;
+		return nullptr;
+	}
+
+	logger::info("[ARCHIVE] %s: %zu members", path, archive->members.size());
+
+	std::lock_guard<std::mutex> guard(lock);
+	archives[path] = archive;
+
+	return archive;
+}
+
+/**
+ * split() - split @path into the archive @file and the @member in it
+ *
+ * Returns false if @path doesn't name an archive member.
+ */
+bool split(const char* path, std::string& file, std::string& member) {
+	const char* sep = strstr(path, ARCHIVE_SEPARATOR);
+
+	if (!sep)
+		return false;
+
+	file.assign(path, sep - path);
+	member = sep + strlen(ARCHIVE_SEPARATOR);
+
+	return true;
+}
+
+/**
+ * locate() - find the @archive and @entry of the member at @path
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int locate(const char* path,
+		   std::shared_ptr<const Archive>& archive,
+		   const Entry** entry) {
+	std::string member;
+	std::string file;
+
+	if (!split(path, file, member))
+		return -EINVAL;
+
+	archive = archive::open(file.c_str());
+	if (!archive)
+		return -errno;
+
+	*entry = archive->find(member.c_str());
+	if (!*entry)
+		return -ENOENT;
+
+	return 0;
+}
+
+/**
+ * resolve() - path of @name in the first of the @incdirs that is an archive
+ * holding it
+ *
+ * Returns the member path, or an empty string if none has it.
+ */
+std::string resolve(const std::vector<const char*>& incdirs,
+					const char* name) {
+	std::shared_ptr<const Archive> archive;
+	const Entry* entry;
+	struct stat sb;
+
+	for (auto incdir : incdirs) {
+		if (stat(incdir, &sb) < 0 || !S_ISREG(sb.st_mode))
+			continue;
+
+		archive = archive::open(incdir);
+		if (!archive)
+			continue;
+
+		entry = archive->find(name);
+		if (entry)
+			return std::string(incdir) + ARCHIVE_SEPARATOR + entry->name;
+	}
+
+	return "";
+}
+
+/* Stored member, read straight from the archive */
+class Stored : public image::Source {
+   public:
+	Stored(std::unique_ptr<image::Source> file, const Entry& entry)
+		: file(std::move(file)), base(entry.offset), length(entry.size) {}
+
+	uint64_t size() const { return length; }
+	ssize_t read(uint64_t offset, size_t len, const char** data);
+
+   private:
+	std::unique_ptr<image::Source> file;
+	uint64_t base;
+	uint64_t length;
+	std::vector<char> tail;
+};
+
+ssize_t Stored::read(uint64_t offset, size_t len, const char** data) {
+	ssize_t n = 0;
+	size_t left;
+
+	if (offset < length) {
+		n = file->read(base + offset, len, data);
+		if (n < 0)
+			return n;
+
+		left = length - offset;
+		if (len <= left)
+			return n;
+
+		n = std::min<size_t>(n, left);
+	}
+
+	/* Whatever follows the member in the archive reads as zeroes */
+	tail.assign(len, 0);
+	if (n)
+		memcpy(tail.data(), *data, n);
+	*data = tail.data();
+
+	return n;
+}
+
+/*
+ * Deflated member, inflated as it's read. Reads are expected in order; going
+ * back, as when retrying a segment, inflates again from the start.
+ */
+class Inflated : public image::Source {
+   public:
+	Inflated(std::unique_ptr<image::Source> file, const Entry& entry)
+		: file(std::move(file)), entry(entry) {}
+	~Inflated();
+
+	uint64_t size() const { return entry.size; }
+	ssize_t read(uint64_t offset, size_t len, const char** data);
+
+   private:
+	int rewind();
+	ssize_t inflate(char* out, size_t len);
+
+	std::unique_ptr<image::Source> file;
+	Entry entry;
+
+	z_stream zs = {};
+	bool started = false;
+	bool finished = false;
+	/* Compressed bytes handed to zlib, and bytes inflated */
+	uint64_t in_pos = 0;
+	uint64_t out_pos = 0;
+	std::vector<char> buf;
+};
+
+Inflated::~Inflated() {
+	if (started)
+		inflateEnd(&zs);
+}
+
+int Inflated::rewind() {
+	int ret;
+
+	if (started)
+		ret = inflateReset(&zs);
+	else
+		ret = inflateInit2(&zs, -MAX_WBITS);
+	if (ret != Z_OK)
+		return -ENOMEM;
+
+	started = true;
+	finished = false;
+	zs.avail_in = 0;
+	in_pos = 0;
+	out_pos = 0;
+
+	return 0;
+}
+
+/* Inflate up to @len bytes to @out, returns the number inflated */
+ssize_t Inflated::inflate(char* out, size_t len) {
+	const char* in;
+	size_t chunk;
+	ssize_t n;
+	int ret;
+
+	zs.next_out = (Bytef*)out;
+	zs.avail_out = len;
+
+	while (zs.avail_out && !finished) {
+		if (!zs.avail_in && in_pos < entry.csize) {
+			chunk = std::min<uint64_t>(INFLATE_CHUNK, entry.csize - in_pos);
+			n = file->read(entry.offset + in_pos, chunk, &in);
+			if (n < 0)
+				return n;
+			if ((size_t)n < chunk)
+				return -EIO;
+
+			zs.next_in = (Bytef*)in;
+			zs.avail_in = chunk;
+			in_pos += chunk;
+		}
+
+		/* zlib may hold output back with all of the input consumed */
+		ret = ::inflate(&zs, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END) {
+			finished = true;
+		} else if (ret == Z_BUF_ERROR && !zs.avail_in) {
+			break;
+		} else if (ret != Z_OK) {
+			logger::error("[ARCHIVE] %s: corrupt data: %s",
+						  entry.name.c_str(), zs.msg ? zs.msg : "");
+			return -EIO;
+		}
+	}
+
+	n = len - zs.avail_out;
+	out_pos += n;
+
+	return n;
+}
+
+ssize_t Inflated::read(uint64_t offset, size_t len, const char** data) {
+	ssize_t n = 0;
+	int ret;
+
+	if (!started || offset < out_pos) {
+		ret = Inflated::rewind();
+		if (ret < 0)
+			return ret;
+	}
+
+	buf.resize(len);
+
+	/* Skip ahead, inflating what isn't asked for */
+	while (out_pos < offset && len) {
+		n = Inflated::inflate(buf.data(),
+							  std::min<uint64_t>(len, offset - out_pos));
+		if (n < 0)
+			return n;
+		if (n == 0)
+			break;
+	}
+
+	n = 0;
+	if (out_pos == offset) {
+		n = Inflated::inflate(buf.data(), len);
+		if (n < 0)
+			return n;
+	}
+
+	memset(buf.data() + n, 0, len - n);
+	*data = buf.data();
+
+	return n;
+}
+
+/**
+ * open_member() - open the archive member at @path for reading
+ * @direct:	read the archive bypassing the page cache, see image::open()
+ *
+ * Returns the source, or NULL with errno set.
+ */
+std::unique_ptr<image::Source> open_member(const char* path, bool direct) {
+	std::shared_ptr<const Archive> archive;
+	std::unique_ptr<image::Source> file;
+	const Entry* entry;
+	int ret;
+
+	ret = locate(path, archive, &entry);
+	if (ret < 0) {
+		errno = -ret;
+		return nullptr;
+	}
+
+	file = image::open(archive->path(), direct);
+	if (!file)
+		return nullptr;
+
+	if (entry->deflated)
+		return std::unique_ptr<image::Source>(
+			new Inflated(std::move(file), *entry));
+
+	return std::unique_ptr<image::Source>(new Stored(std::move(file), *entry));
+}
+
+}  // namespace archive
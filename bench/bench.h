@@ -0,0 +1,28 @@
+#pragma once
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+
+namespace bench {
+
+/* Heap allocations made so far, by operator new and by libxml2 */
+extern std::atomic<uint64_t> allocs;
+/* The results, stdout is left to the logger and goes to /dev/null */
+extern FILE* out;
+
+void run(const char* name,
+		 unsigned iterations,
+		 const std::function<void()>& fn,
+		 uint64_t bytes_per_op = 0);
+
+void manifest();
+void protocol();
+
+}  // namespace bench
+
+#endif
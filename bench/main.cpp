@@ -0,0 +1,133 @@
+/*
+ * Host side microbenchmarks
+ *
+ * Every heap allocation, whether from operator new or from libxml2, is
+ * counted so each benchmark reports allocations per operation next to its
+ * time per operation.
+ */
+#include <fcntl.h>
+#include <libxml/parser.h>
+#include <libxml/xmlmemory.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#include "bench.h"
+#include "logger.h"
+
+namespace bench {
+
+std::atomic<uint64_t> allocs;
+FILE* out = stdout;
+
+/**
+ * run() - time @iterations calls of @fn after one warm up call
+ */
+void run(const char* name,
+		 unsigned iterations,
+		 const std::function<void()>& fn,
+		 uint64_t bytes_per_op) {
+	uint64_t n_allocs;
+	double ns;
+	unsigned i;
+
+	fn();
+
+	n_allocs = allocs.load();
+	auto t0 = std::chrono::steady_clock::now();
+	for (i = 0; i < iterations; i++)
+		fn();
+	auto t1 = std::chrono::steady_clock::now();
+	n_allocs = allocs.load() - n_allocs;
+
+	ns = std::chrono::duration<double, std::nano>(t1 - t0).count() /
+		 iterations;
+
+	fprintf(out, "  %-28s %12.0f ns/op %10.1f allocs/op", name, ns,
+			(double)n_allocs / iterations);
+	if (bytes_per_op)
+		fprintf(out, " %10.1f MB/s", bytes_per_op * 1e3 / ns);
+	fprintf(out, "\n");
+	fflush(out);
+}
+
+/**
+ * quiet_stdout() - print the results to the original stdout, and what
+ * the logger writes there to /dev/null
+ */
+static void quiet_stdout() {
+	FILE* fp;
+	int fd;
+
+	fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	fflush(stdout);
+	fp = fdopen(dup(STDOUT_FILENO), "w");
+	if (fp) {
+		out = fp;
+		dup2(fd, STDOUT_FILENO);
+	}
+	close(fd);
+}
+
+}  // namespace bench
+
+void* operator new(size_t size) {
+	void* ptr;
+
+	bench::allocs++;
+	ptr = malloc(size ? size : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+
+	return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+	free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+	free(ptr);
+}
+
+static void* xml_malloc(size_t size) {
+	bench::allocs++;
+	return malloc(size);
+}
+
+static void* xml_realloc(void* ptr, size_t size) {
+	bench::allocs++;
+	return realloc(ptr, size);
+}
+
+static char* xml_strdup(const char* str) {
+	bench::allocs++;
+	return strdup(str);
+}
+
+int main(int argc, char** argv) {
+	/* Must be in place before libxml2 allocates anything */
+	xmlMemSetup(free, xml_malloc, xml_realloc, xml_strdup);
+	xmlInitParser();
+
+	/*
+	 * The protocol paths log every command, keep that out of the numbers
+	 * but for the logging benchmarks, which log through the background
+	 * writer as qdl does
+	 */
+	bench::quiet_stdout();
+	logger::start(NULL);
+	logger::set_level(logger::level::warn);
+
+	bench::manifest();
+	bench::protocol();
+
+	return 0;
+}
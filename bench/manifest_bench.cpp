@@ -0,0 +1,148 @@
+/*
+ * Startup benchmark: time to load a realistic set of rawprogram/patch files,
+ * comparing a DOM parse of every file (what the loader used to do, twice per
+ * file) against the streaming manifest loader.
+ */
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+#include "manifest.h"
+#include "plan.h"
+
+static const unsigned n_files = 40;
+static const unsigned n_entries = 250;
+
+static std::string write_program(const char* dir, unsigned idx) {
+	std::string path = std::string(dir) + "/rawprogram" +
+					   std::to_string(idx) + ".xml";
+	FILE* fp;
+	unsigned i;
+
+	fp = fopen(path.c_str(), "w");
+	if (!fp) {
+		perror(path.c_str());
+		exit(1);
+	}
+
+	fprintf(fp, "<?xml version=\"1.0\" ?>\n<data>\n");
+	for (i = 0; i < n_entries; i++) {
+		fprintf(fp,
+				"  <program SECTOR_SIZE_IN_BYTES=\"4096\" "
+				"file_sector_offset=\"0\" filename=\"image_%u_%u.img\" "
+				"label=\"part_%u_%u\" num_partition_sectors=\"%u\" "
+				"partofsingleimage=\"false\" physical_partition_number=\"%u\" "
+				"readbackverify=\"false\" size_in_KB=\"%u.0\" sparse=\"false\" "
+				"start_byte_hex=\"0x%x000\" start_sector=\"%u\"/>\n",
+				idx, i, idx, i, 256 + i, idx % 6, (256 + i) * 4, 6 + i * 300,
+				6 + i * 300);
+	}
+	fprintf(fp, "</data>\n");
+	fclose(fp);
+
+	return path;
+}
+
+static std::string write_patch(const char* dir, unsigned idx) {
+	std::string path =
+		std::string(dir) + "/patch" + std::to_string(idx) + ".xml";
+	FILE* fp;
+	unsigned i;
+
+	fp = fopen(path.c_str(), "w");
+	if (!fp) {
+		perror(path.c_str());
+		exit(1);
+	}
+
+	fprintf(fp, "<?xml version=\"1.0\" ?>\n<patches>\n");
+	for (i = 0; i < n_entries; i++) {
+		fprintf(fp,
+				"  <patch SECTOR_SIZE_IN_BYTES=\"4096\" byte_offset=\"%u\" "
+				"filename=\"DISK\" physical_partition_number=\"%u\" "
+				"size_in_bytes=\"8\" start_sector=\"NUM_DISK_SECTORS-5.\" "
+				"value=\"NUM_DISK_SECTORS-6.\" what=\"Update last partition "
+				"%u with actual size.\"/>\n",
+				i * 8 % 4096, idx % 6, i);
+	}
+	fprintf(fp, "</patches>\n");
+	fclose(fp);
+
+	return path;
+}
+
+static unsigned dom_load(const char* path) {
+	xmlNode* node;
+	xmlDoc* doc;
+	unsigned n = 0;
+
+	doc = xmlReadFile(path, NULL, 0);
+	if (!doc)
+		return 0;
+
+	for (node = xmlDocGetRootElement(doc)->children; node; node = node->next) {
+		if (node->type != XML_ELEMENT_NODE)
+			continue;
+
+		xmlFree(xmlGetProp(node, (xmlChar*)"filename"));
+		xmlFree(xmlGetProp(node, (xmlChar*)"start_sector"));
+		n++;
+	}
+
+	xmlFreeDoc(doc);
+
+	return n;
+}
+
+void bench::manifest() {
+	std::vector<std::string> paths;
+	std::vector<const char*> files;
+	char dir[] = "/tmp/qdl-bench-XXXXXX";
+	unsigned i;
+	int ret = 0;
+
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		exit(1);
+	}
+
+	for (i = 0; i < n_files / 2; i++) {
+		paths.push_back(write_program(dir, i));
+		paths.push_back(write_patch(dir, i));
+	}
+	for (auto& path : paths)
+		files.push_back(path.c_str());
+
+	fprintf(bench::out, "manifest: %zu files, %zu entries\n", files.size(),
+			files.size() * n_entries);
+
+	run("dom, two passes", 5, [&] {
+		/* type detection and load each parsed the whole file */
+		for (auto file : files) {
+			dom_load(file);
+			dom_load(file);
+		}
+	});
+
+	run("streaming", 5, [&] {
+		plan::Plan plan;
+
+		if (manifest::load(plan, files, false) < 0)
+			ret = -1;
+	});
+
+	for (auto& path : paths)
+		unlink(path.c_str());
+	rmdir(dir);
+
+	if (ret < 0) {
+		fprintf(stderr, "manifest load failed\n");
+		exit(1);
+	}
+}
@@ -0,0 +1,124 @@
+/*
+ * Protocol hot paths: response parsing, command construction, attribute
+ * accessors, hex dumps, checksums and the program chunk loop, run against a
+ * transport that acknowledges every command without any USB traffic.
+ */
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "bench.h"
+#include "firehose.h"
+#include "logger.h"
+#include "qdl.h"
+#include "report.h"
+#include "session.h"
+#include "sha256.h"
+#include "transport.h"
+
+static const char ack[] =
+	"<?xml version=\"1.0\" encoding=\"UTF-8\" ?>"
+	"<data><response value=\"ACK\" rawmode=\"false\" /></data>";
+
+/* Answers the last write, command or raw data, with one ACK */
+struct NullTransport : Transport {
+	int read(void* buf, size_t len, unsigned int timeout) override {
+		if (!pending) {
+			errno = ETIMEDOUT;
+			return -1;
+		}
+
+		pending = false;
+		len = std::min(len - 1, sizeof(ack) - 1);
+		memcpy(buf, ack, len);
+		return len;
+	}
+
+	int write(const void* buf, size_t len, bool eot) override {
+		pending = true;
+		return len;
+	}
+
+	bool pending = false;
+};
+
+void bench::protocol() {
+	NullTransport transport;
+	Options options;
+	Report report;
+	Firehose firehose(transport, options, report);
+	patch::Patch patch = {
+		4096, 1048, "DISK", 0, 8, "NUM_DISK_SECTORS-5.", "NUM_DISK_SECTORS-6.",
+		"Update last partition with actual size."};
+	program::Program program = {4096, 0, "system.img", "system", 0,
+								0, "6", "system.img", 0};
+	auto data = std::make_shared<std::vector<char>>(64 * 1024 * 1024, 0x5a);
+	image::Memory image(data);
+	std::vector<uint8_t> dump(512);
+	xmlNode* node;
+	xmlDoc* doc;
+	int errors = 0;
+	int ret = 0;
+	size_t i;
+
+	fprintf(bench::out, "protocol:\n");
+
+	run("response_parse", 100000, [&] {
+		int error;
+
+		node = Firehose::response_parse(ack, sizeof(ack) - 1, &error);
+		if (node)
+			xmlFreeDoc(node->doc);
+	});
+
+	run("apply_patch", 100000, [&] {
+		if (firehose.apply_patch(patch))
+			ret = -1;
+	});
+
+	doc = xmlReadMemory(ack, sizeof(ack) - 1, NULL, NULL, 0);
+	node = xmlDocGetRootElement(doc)->children;
+	run("attr_as_string", 100000, [&] {
+		free((void*)attr_as_string(node, "value", &errors));
+	});
+	run("attr_as_unsigned", 100000,
+		[&] { attr_as_unsigned(node, "rawmode", &errors); });
+	xmlFreeDoc(doc);
+
+	for (i = 0; i < dump.size(); i++)
+		dump.at(i) = i;
+	/* Few enough lines for the log ring, so none is dropped */
+	logger::flush();
+	logger::set_level(logger::level::info);
+	run("print_hex_dump, 512 bytes", 100,
+		[&] { print_hex_dump("bench", dump.data(), dump.size()); });
+	logger::flush();
+	logger::set_level(logger::level::warn);
+
+	run("crc32, 16 KiB", 10000,
+		[&] { crc32(0, data->data(), 16384); }, 16384);
+
+	run("sha256, 1 MiB", 100, [&] {
+		uint8_t sum[SHA256_DIGEST_SIZE];
+		Sha256 sha;
+
+		sha.update(data->data(), 1024 * 1024);
+		sha.final(sum);
+	}, 1024 * 1024);
+
+	run("apply_program, 64 MiB", 20, [&] {
+		if (firehose.apply_program(program, image))
+			ret = -1;
+	}, data->size());
+
+	if (ret < 0) {
+		fprintf(stderr, "protocol benchmark failed\n");
+		exit(1);
+	}
+}
@@ -0,0 +1,281 @@
+#include "capture.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include "logger.h"
+
+namespace capture {
+
+/**
+ * hash() - 64-bit hash of @len bytes at @buf, for telling payloads apart
+ */
+uint64_t hash(const void* buf, size_t len) {
+	const uint8_t* ptr = (const uint8_t*)buf;
+	const uint64_t k1 = 0x87c37b91114253d5ULL;
+	const uint64_t k2 = 0x4cf5ad432745937fULL;
+	uint64_t h = len * k1;
+	uint64_t w;
+
+	for (; len >= 8; ptr += 8, len -= 8) {
+		memcpy(&w, ptr, 8);
+		w *= k1;
+		w = (w << 31) | (w >> 33);
+		h ^= w * k2;
+		h = ((h << 27) | (h >> 37)) * 5 + 0x52dce729;
+	}
+
+	for (w = 0; len; len--)
+		w = (w << 8) | ptr[len - 1];
+	h ^= w * k2;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+Recorder::~Recorder() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stop = true;
+	}
+	cond.notify_one();
+
+	if (thread.joinable())
+		thread.join();
+
+	if (fp)
+		fclose(fp);
+}
+
+/**
+ * open() - start capturing the transfers to @path
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int Recorder::open(const char* path) {
+	fp = fopen(path, "wb");
+	if (!fp) {
+		logger::error("[CAPTURE] unable to create %s: %s", path,
+					  strerror(errno));
+		return -errno;
+	}
+
+	fwrite(CAPTURE_MAGIC, 1, sizeof(CAPTURE_MAGIC), fp);
+
+	start = std::chrono::steady_clock::now();
+	thread = std::thread(&Recorder::writer, this);
+
+	return 0;
+}
+
+void Recorder::record(uint8_t dir, int result, const void* buf, size_t len) {
+	std::vector<char> entry;
+	Record rec = {};
+	uint64_t digest;
+
+	rec.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					  std::chrono::steady_clock::now() - start)
+					  .count();
+	rec.result = result;
+	rec.dir = dir;
+
+	if (len > CAPTURE_INLINE_MAX) {
+		digest = hash(buf, len);
+		rec.flags = FLAG_HASHED;
+		rec.length = sizeof(digest);
+		buf = &digest;
+	} else {
+		rec.length = len;
+	}
+
+	entry.resize(sizeof(rec) + rec.length);
+	memcpy(entry.data(), &rec, sizeof(rec));
+	if (rec.length)
+		memcpy(entry.data() + sizeof(rec), buf, rec.length);
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		queue.push_back(std::move(entry));
+	}
+	cond.notify_one();
+}
+
+void Recorder::writer() {
+	std::unique_lock<std::mutex> guard(lock);
+	std::vector<char> entry;
+
+	for (;;) {
+		cond.wait(guard, [this] { return stop || !queue.empty(); });
+		if (queue.empty())
+			break;
+
+		entry = std::move(queue.front());
+		queue.pop_front();
+
+		guard.unlock();
+		fwrite(entry.data(), 1, entry.size(), fp);
+		guard.lock();
+	}
+
+	fflush(fp);
+}
+
+int Recorder::read(void* buf, size_t len, unsigned int timeout) {
+	int saved_errno;
+	int n;
+
+	n = inner.read(buf, len, timeout);
+	saved_errno = errno;
+
+	if (fp)
+		record(DIR_IN, n < 0 ? -saved_errno : n, buf, n < 0 ? 0 : n);
+
+	errno = saved_errno;
+	return n;
+}
+
+int Recorder::write(const void* buf, size_t len, bool eot) {
+	int saved_errno;
+	int n;
+
+	n = inner.write(buf, len, eot);
+	saved_errno = errno;
+
+	if (fp)
+		record(DIR_OUT, n < 0 ? -saved_errno : n, buf, len);
+
+	errno = saved_errno;
+	return n;
+}
+
+/**
+ * open() - load the capture at @path
+ * @realtime:	delay responses like the captured device did
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int Player::open(const char* path, bool realtime) {
+	char magic[sizeof(CAPTURE_MAGIC)];
+	Entry entry;
+	FILE* fp;
+	int ret = 0;
+
+	fp = fopen(path, "rb");
+	if (!fp) {
+		logger::error("[REPLAY] unable to open %s: %s", path, strerror(errno));
+		return -errno;
+	}
+
+	if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+		memcmp(magic, CAPTURE_MAGIC, sizeof(magic))) {
+		logger::error("[REPLAY] %s is not a capture", path);
+		fclose(fp);
+		return -EINVAL;
+	}
+
+	while (fread(&entry.rec, sizeof(entry.rec), 1, fp) == 1) {
+		entry.payload.resize(entry.rec.length);
+		if (entry.rec.length &&
+			fread(entry.payload.data(), entry.rec.length, 1, fp) != 1) {
+			logger::error("[REPLAY] %s is truncated", path);
+			ret = -EINVAL;
+			break;
+		}
+
+		records.push_back(entry);
+	}
+
+	fclose(fp);
+
+	this->realtime = realtime;
+	last = std::chrono::steady_clock::now();
+
+	return ret;
+}
+
+void Player::pace(const Record& rec) {
+	uint64_t prev = pos ? records[pos - 1].rec.time_ns : 0;
+
+	/* Only the device's share of the time is reproduced */
+	if (realtime && rec.dir == DIR_IN && rec.time_ns > prev)
+		std::this_thread::sleep_until(
+			last + std::chrono::nanoseconds(rec.time_ns - prev));
+
+	last = std::chrono::steady_clock::now();
+}
+
+int Player::read(void* buf, size_t len, unsigned int timeout) {
+	Entry* entry;
+
+	if (pos >= records.size()) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	entry = &records[pos];
+	if (entry->rec.dir != DIR_IN) {
+		if (!mismatches++)
+			first_mismatch = pos;
+		errno = EPROTO;
+		return -1;
+	}
+
+	pace(entry->rec);
+	pos++;
+
+	if (entry->rec.result < 0) {
+		errno = -entry->rec.result;
+		return -1;
+	}
+
+	if ((size_t)entry->rec.result > len ||
+		(entry->rec.flags & FLAG_HASHED)) {
+		if (!mismatches++)
+			first_mismatch = pos - 1;
+		errno = EPROTO;
+		return -1;
+	}
+
+	memcpy(buf, entry->payload.data(), entry->rec.result);
+	return entry->rec.result;
+}
+
+int Player::write(const void* buf, size_t len, bool eot) {
+	uint64_t digest;
+	Entry* entry;
+	bool match;
+
+	if (pos >= records.size() || records[pos].rec.dir != DIR_OUT) {
+		if (!mismatches++)
+			first_mismatch = pos;
+		errno = EPROTO;
+		return -1;
+	}
+
+	entry = &records[pos];
+	pace(entry->rec);
+	pos++;
+
+	if (entry->rec.flags & FLAG_HASHED) {
+		digest = hash(buf, len);
+		match = !memcmp(entry->payload.data(), &digest, sizeof(digest));
+	} else {
+		match = entry->payload.size() == len &&
+				!memcmp(entry->payload.data(), buf, len);
+	}
+
+	if (!match && !mismatches++)
+		first_mismatch = pos - 1;
+
+	if (entry->rec.result < 0) {
+		errno = -entry->rec.result;
+		return -1;
+	}
+
+	return len;
+}
+
+}  // namespace capture
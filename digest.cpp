@@ -0,0 +1,409 @@
+#include "digest.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+#include "archive.h"
+#include "logger.h"
+
+#define DIGEST_MAGIC "QDLSUM2"
+
+namespace digest {
+
+/* Identity of an image, as in Entry */
+struct Key {
+	image::Stamp id;
+	uint64_t offset = 0;
+
+	bool operator==(const Key& other) const {
+		return id == other.id && offset == other.offset;
+	}
+};
+
+struct KeyHash {
+	size_t operator()(const Key& key) const {
+		return std::hash<uint64_t>()(key.id.ino * 31 + key.id.dev) ^
+			   std::hash<uint64_t>()(key.id.size * 31 + key.id.mtime_ns) ^
+			   std::hash<uint64_t>()(key.offset);
+	}
+};
+
+static std::mutex lock;
+static std::string cache_dir;
+static std::unordered_map<Key, std::shared_ptr<const Entry>, KeyHash> entries;
+
+/**
+ * set_dir() - keep the digests in @path as well, NULL for memory only
+ *
+ * Called once at startup, sessions only hash into this directory.
+ */
+void set_dir(const char* path) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	cache_dir = path ? path : "";
+}
+
+/* The directory given to set_dir(), empty for memory only */
+std::string dir() {
+	std::lock_guard<std::mutex> guard(lock);
+
+	return cache_dir;
+}
+
+std::string hex(const Sum& sum) {
+	static const char digits[] = "0123456789abcdef";
+	std::string out;
+
+	for (auto byte : sum) {
+		out += digits[byte >> 4];
+		out += digits[byte & 0xf];
+	}
+
+	return out;
+}
+
+/**
+ * identify() - get the identity of the image at @path
+ *
+ * That of the file, or for an archive member that of the archive with the
+ * size and offset of the member. @deflated, if given, tells whether the
+ * image is a deflated member.
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+static int identify(const char* path, Key& key, bool* deflated = NULL) {
+	std::shared_ptr<const archive::Archive> archive;
+	const archive::Entry* member;
+	struct stat sb;
+	int ret;
+
+	ret = image::stamp(path, key.id);
+	if (ret < 0)
+		return ret;
+
+	key.offset = 0;
+	if (deflated)
+		*deflated = false;
+	if (!stat(path, &sb))
+		return 0;
+
+	ret = archive::locate(path, archive, &member);
+	if (ret < 0)
+		return ret;
+
+	key.id.size = member->size;
+	key.offset = member->offset;
+	if (deflated)
+		*deflated = member->deflated;
+
+	return 0;
+}
+
+static std::string entry_path(const std::string& dir, const Key& key) {
+	const image::Stamp& id = key.id;
+	char name[128];
+
+	snprintf(name, sizeof(name),
+			 "/%" PRIx64 "-%" PRIx64 "-%" PRIx64 "-%" PRIx64 "-%" PRIx64,
+			 id.dev, id.ino, id.size, (uint64_t)id.mtime_ns, key.offset);
+
+	return dir + name;
+}
+
+static std::shared_ptr<const Entry> load(const std::string& dir,
+										 const Key& key) {
+	char magic[sizeof(DIGEST_MAGIC)];
+	std::shared_ptr<Entry> entry;
+	uint32_t chunk_size;
+	uint32_t n_chunks;
+	image::Stamp found;
+	uint64_t offset;
+	FILE* fp;
+	bool ok;
+
+	fp = fopen(entry_path(dir, key).c_str(), "rb");
+	if (!fp)
+		return nullptr;
+
+	entry = std::make_shared<Entry>();
+	ok = fread(magic, sizeof(magic), 1, fp) == 1 &&
+		 !memcmp(magic, DIGEST_MAGIC, sizeof(magic)) &&
+		 fread(&found, sizeof(found), 1, fp) == 1 && found == key.id &&
+		 fread(&offset, sizeof(offset), 1, fp) == 1 && offset == key.offset &&
+		 fread(&chunk_size, sizeof(chunk_size), 1, fp) == 1 &&
+		 chunk_size == DIGEST_CHUNK_SIZE &&
+		 fread(&n_chunks, sizeof(n_chunks), 1, fp) == 1 &&
+		 n_chunks ==
+			 (key.id.size + DIGEST_CHUNK_SIZE - 1) / DIGEST_CHUNK_SIZE &&
+		 fread(entry->file.data(), entry->file.size(), 1, fp) == 1;
+	if (ok) {
+		entry->chunks.resize(n_chunks);
+		ok = !n_chunks || fread(entry->chunks.data(), sizeof(Sum), n_chunks,
+								fp) == n_chunks;
+	}
+	fclose(fp);
+
+	if (!ok)
+		return nullptr;
+
+	entry->id = key.id;
+	entry->offset = key.offset;
+	return entry;
+}
+
+static void store(const std::string& dir, const Entry& entry) {
+	std::string path = entry_path(dir, {entry.id, entry.offset});
+	std::string tmp = path + ".XXXXXX";
+	uint32_t chunk_size = DIGEST_CHUNK_SIZE;
+	uint32_t n_chunks = entry.chunks.size();
+	FILE* fp;
+	bool ok;
+	int fd;
+
+	mkdir(dir.c_str(), 0755);
+
+	fd = mkstemp(&tmp[0]);
+	if (fd < 0) {
+		logger::warn("[DIGEST] unable to write to %s: %s", dir.c_str(),
+					 strerror(errno));
+		return;
+	}
+	fchmod(fd, 0644);
+
+	fp = fdopen(fd, "wb");
+	ok = fwrite(DIGEST_MAGIC, sizeof(DIGEST_MAGIC), 1, fp) == 1 &&
+		 fwrite(&entry.id, sizeof(entry.id), 1, fp) == 1 &&
+		 fwrite(&entry.offset, sizeof(entry.offset), 1, fp) == 1 &&
+		 fwrite(&chunk_size, sizeof(chunk_size), 1, fp) == 1 &&
+		 fwrite(&n_chunks, sizeof(n_chunks), 1, fp) == 1 &&
+		 fwrite(entry.file.data(), entry.file.size(), 1, fp) == 1 &&
+		 (!n_chunks ||
+		  fwrite(entry.chunks.data(), sizeof(Sum), n_chunks, fp) == n_chunks);
+	ok &= fclose(fp) == 0;
+
+	if (!ok || rename(tmp.c_str(), path.c_str()) < 0)
+		unlink(tmp.c_str());
+}
+
+static std::shared_ptr<const Entry> lookup(const Key& key) {
+	std::shared_ptr<const Entry> entry;
+	std::string dir;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		auto it = entries.find(key);
+		if (it != entries.end())
+			return it->second;
+		if (cache_dir.empty())
+			return nullptr;
+		dir = cache_dir;
+	}
+
+	entry = load(dir, key);
+	if (entry) {
+		std::lock_guard<std::mutex> guard(lock);
+		entries[key] = entry;
+	}
+
+	return entry;
+}
+
+/**
+ * find() - digests of the image at @path, if already computed
+ *
+ * Returns NULL if the file in its current state hasn't been hashed.
+ */
+std::shared_ptr<const Entry> find(const char* path) {
+	Key key;
+
+	if (identify(path, key) < 0)
+		return nullptr;
+
+	return lookup(key);
+}
+
+struct Job {
+	const char* path;
+	/* Deflated archive members are read in order, by a single worker */
+	bool serial;
+	std::shared_ptr<Entry> entry;
+	std::atomic<int> error{0};
+};
+
+/* Chunks @first to @first + @count - 1 of jobs[@job] */
+struct Work {
+	size_t job;
+	size_t first;
+	size_t count;
+};
+
+static void worker(std::vector<std::unique_ptr<Job>>& jobs,
+				   std::vector<Work>& works,
+				   std::atomic<size_t>& next,
+				   bool direct,
+				   const std::atomic<bool>* stop) {
+	std::unique_ptr<image::Source> source;
+	size_t current = SIZE_MAX;
+	const char* data;
+	uint64_t offset;
+	size_t chunk;
+	size_t i;
+	Job* job;
+	ssize_t n;
+	size_t len;
+	Sha256 sha;
+
+	while (!(stop && *stop) && (i = next++) < works.size()) {
+		job = jobs[works[i].job].get();
+
+		/* Chunks come mostly in order, keep the image open until the next */
+		if (works[i].job != current) {
+			current = works[i].job;
+			source = image::open(job->path, direct);
+		}
+		if (!source) {
+			job->error = errno ? -errno : -EIO;
+			continue;
+		}
+
+		for (chunk = works[i].first; chunk < works[i].first + works[i].count;
+			 chunk++) {
+			if (stop && *stop)
+				return;
+
+			offset = (uint64_t)chunk * DIGEST_CHUNK_SIZE;
+			len = std::min<uint64_t>(DIGEST_CHUNK_SIZE,
+									 job->entry->id.size - offset);
+
+			n = source->read(offset, len, &data);
+			if (n != (ssize_t)len) {
+				job->error = n < 0 ? n : -EIO;
+				break;
+			}
+
+			sha = Sha256();
+			sha.update(data, len);
+			sha.final(job->entry->chunks[chunk].data());
+		}
+	}
+}
+
+/**
+ * fill() - compute the digests of the images in @paths not hashed yet
+ * @workers:	number of hashing threads, 0 for one per CPU
+ * @direct:	read the images with direct I/O, see image::open()
+ * @stop:	if given, hashing is abandoned once it is set
+ *
+ * The chunks of all images are spread over the workers, so even a single
+ * large image is hashed in parallel. Images are read through image::open(),
+ * so archive members are hashed as well; deflated ones by a single worker.
+ *
+ * Returns 0 on success, -ECANCELED if stopped, negative errno if an image
+ * could not be hashed.
+ */
+int fill(const std::vector<const char*>& paths,
+		 unsigned workers,
+		 bool direct,
+		 const std::atomic<bool>* stop) {
+	std::unique_ptr<image::Source> source;
+	std::vector<std::unique_ptr<Job>> jobs;
+	std::vector<std::thread> threads;
+	std::atomic<size_t> next{0};
+	std::vector<Work> works;
+	std::string dir;
+	size_t n_chunks;
+	bool deflated;
+	size_t i;
+	Sha256 sha;
+	int ret = 0;
+	Key key;
+
+	for (auto path : paths) {
+		if (identify(path, key, &deflated) < 0 || lookup(key))
+			continue;
+
+		/* Listed twice, or hard links */
+		for (i = 0; i < jobs.size(); i++)
+			if (jobs[i]->entry->id == key.id &&
+				jobs[i]->entry->offset == key.offset)
+				break;
+		if (i < jobs.size())
+			continue;
+
+		/* The file might have changed in between */
+		source = image::open(path, direct);
+		if (!source || source->size() != key.id.size)
+			continue;
+
+		n_chunks = (key.id.size + DIGEST_CHUNK_SIZE - 1) / DIGEST_CHUNK_SIZE;
+
+		jobs.emplace_back(new Job);
+		jobs.back()->path = path;
+		jobs.back()->serial = deflated;
+		jobs.back()->entry = std::make_shared<Entry>();
+		jobs.back()->entry->id = key.id;
+		jobs.back()->entry->offset = key.offset;
+		jobs.back()->entry->chunks.resize(n_chunks);
+
+		if (deflated) {
+			works.push_back({jobs.size() - 1, 0, n_chunks});
+			continue;
+		}
+		for (i = 0; i < n_chunks; i++)
+			works.push_back({jobs.size() - 1, i, 1});
+	}
+	source = nullptr;
+
+	if (!workers)
+		workers = std::max(1u, std::thread::hardware_concurrency());
+	workers = std::min<size_t>(workers, works.size());
+
+	for (i = 0; i < workers; i++)
+		threads.emplace_back(worker, std::ref(jobs), std::ref(works),
+							 std::ref(next), direct, stop);
+	for (auto& thread : threads)
+		thread.join();
+
+	/* Some chunks weren't hashed */
+	if (stop && *stop)
+		return -ECANCELED;
+
+	for (auto& job : jobs) {
+		if (job->error) {
+			logger::warn("[DIGEST] failed to hash %s: %s", job->path,
+						 strerror(-job->error));
+			ret = job->error;
+			continue;
+		}
+
+		sha = Sha256();
+		sha.update(job->entry->chunks.data(),
+				   job->entry->chunks.size() * sizeof(Sum));
+		sha.final(job->entry->file.data());
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			entries[{job->entry->id, job->entry->offset}] = job->entry;
+			if (cache_dir.empty())
+				continue;
+			dir = cache_dir;
+		}
+
+		store(dir, *job->entry);
+	}
+
+	return ret;
+}
+
+}  // namespace digest
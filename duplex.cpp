@@ -0,0 +1,118 @@
+#include "duplex.h"
+
+#include <cerrno>
+#include <cstdio>
+
+#include "firehose.h"
+#include "logger.h"
+
+namespace duplex {
+
+Reader::~Reader() {
+	Reader::stop();
+
+	for (auto& packet : queue)
+		if (packet.nodes)
+			xmlFreeDoc(packet.nodes->doc);
+}
+
+/**
+ * start() - start reading from @usb in the background
+ * @debug:	log what is read
+ */
+void Reader::start(Transport& usb, bool debug) {
+	this->usb = &usb;
+	this->debug = debug;
+	snprintf(prefix, sizeof(prefix), "%s", logger::prefix());
+
+	quit = false;
+	error = 0;
+	thread = std::thread(&Reader::reader, this);
+}
+
+/**
+ * stop() - stop reading, packets already queued can still be popped
+ */
+void Reader::stop() {
+	if (!thread.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		quit = true;
+	}
+
+	thread.join();
+}
+
+void Reader::reader() {
+	char buf[4096];
+	xmlNode* nodes;
+	size_t pos;
+	int ret;
+	int n;
+
+	logger::set_prefix(prefix);
+
+	for (;;) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			if (quit)
+				break;
+		}
+
+		/* Returns as soon as something arrives, the timeout is for quit */
+		n = usb->read(buf, sizeof(buf) - 1, DUPLEX_POLL_MS);
+		if (n < 0) {
+			if (errno == ETIMEDOUT)
+				continue;
+
+			std::lock_guard<std::mutex> guard(lock);
+			error = -errno;
+			cond.notify_one();
+			break;
+		}
+		buf[n] = '\0';
+
+		if (debug)
+			logger::debug("FIREHOSE READ: %s", buf);
+
+		for (pos = 0; pos < (size_t)n && buf[pos];) {
+			ret = Firehose::response_next(buf, n, &pos, &nodes);
+
+			std::lock_guard<std::mutex> guard(lock);
+			queue.push_back({ret < 0 ? NULL : nodes, ret});
+		}
+		cond.notify_one();
+	}
+}
+
+/**
+ * pop() - take the next packet, waiting up to @timeout ms for it
+ *
+ * Returns 0 with @nodes set, the parse error of a malformed packet, or
+ * -ETIMEDOUT with errno set when nothing was read.
+ */
+int Reader::pop(xmlNode** nodes, unsigned timeout) {
+	std::unique_lock<std::mutex> guard(lock);
+	Packet packet;
+
+	if (!cond.wait_for(guard, std::chrono::milliseconds(timeout),
+					   [this] { return !queue.empty() || error; })) {
+		errno = ETIMEDOUT;
+		return -ETIMEDOUT;
+	}
+
+	if (queue.empty()) {
+		errno = -error;
+		return -ETIMEDOUT;
+	}
+
+	packet = queue.front();
+	queue.pop_front();
+
+	*nodes = packet.nodes;
+	return packet.error;
+}
+
+}  // namespace duplex
@@ -0,0 +1,380 @@
+#include "engine.h"
+
+#include <linux/usbdevice_fs.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+
+#include "logger.h"
+
+/* Coroutine stacks, protocol code keeps a few 4 KiB buffers on the stack */
+#define ENGINE_STACK_SIZE (256 * 1024)
+/* OUT transfers are split in URBs of this size, all submitted at once */
+#define ENGINE_URB_SIZE (64 * 1024)
+/* Interval of checking for a restarting device to go away and come back, ms */
+#define USB_RECONNECT_POLL 100
+
+namespace engine {
+
+struct Fiber {
+	std::string name;
+	std::function<void()> fn;
+	ucontext_t ctx;
+	void* stack = MAP_FAILED;
+	bool done = false;
+};
+
+static thread_local Engine* current;
+
+void trampoline() {
+	Fiber* fiber = current->running;
+
+	fiber->fn();
+	fiber->done = true;
+}
+
+Engine::Engine() {
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+Engine::~Engine() {
+	for (auto& fiber : fibers)
+		if (fiber->stack != MAP_FAILED)
+			munmap(fiber->stack, ENGINE_STACK_SIZE);
+
+	if (epfd >= 0)
+		close(epfd);
+}
+
+/**
+ * spawn() - add a coroutine running @fn, started by run()
+ * @name:	log prefix of the coroutine
+ */
+void Engine::spawn(const char* name, std::function<void()> fn) {
+	std::unique_ptr<Fiber> fiber(new Fiber);
+
+	fiber->name = name ? name : "";
+	fiber->fn = std::move(fn);
+	fibers.push_back(std::move(fiber));
+}
+
+void Engine::resume(Fiber* fiber) {
+	current = this;
+	running = fiber;
+	logger::set_prefix(fiber->name.c_str());
+
+	swapcontext(&main, &fiber->ctx);
+
+	running = nullptr;
+	logger::set_prefix(NULL);
+
+	if (fiber->done && fiber->stack != MAP_FAILED) {
+		munmap(fiber->stack, ENGINE_STACK_SIZE);
+		fiber->stack = MAP_FAILED;
+	}
+}
+
+/**
+ * add() - watch @usb for completed transfers
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int Engine::add(Qdl& usb) {
+	struct epoll_event ev = {};
+
+	ev.events = EPOLLOUT;
+	ev.data.fd = usb.fileno();
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, usb.fileno(), &ev) < 0)
+		return -errno;
+
+	devices[usb.fileno()] = &usb;
+
+	return 0;
+}
+
+void Engine::remove(Qdl& usb) {
+	if (!devices.erase(usb.fileno()))
+		return;
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, usb.fileno(), NULL);
+}
+
+/**
+ * wait() - suspend the running coroutine until the transfers of @wait are
+ * done, or @timeout ms passed
+ */
+void Engine::wait(Wait& wait, unsigned timeout) {
+	Fiber* fiber = running;
+
+	wait.fiber = fiber;
+	wait.deadline = timeout ? clock::now() + std::chrono::milliseconds(timeout)
+							: clock::time_point::max();
+	waiting.push_back(&wait);
+
+	swapcontext(&fiber->ctx, &main);
+}
+
+/**
+ * sleep() - suspend the running coroutine for @ms milliseconds
+ */
+void Engine::sleep(unsigned ms) {
+	Wait wait;
+
+	/* Nothing to reap, expire() completes it */
+	wait.pending = 1;
+	Engine::wait(wait, ms ? ms : 1);
+}
+
+void Engine::reap(Qdl* usb) {
+	struct usbdevfs_urb* urb;
+	Wait* wait;
+	int ret;
+
+	for (;;) {
+		ret = usb->reap(&urb);
+		if (ret == -EAGAIN)
+			return;
+
+		if (ret < 0) {
+			/* Gone, fail whatever waits on it */
+			for (auto w : waiting) {
+				if (w->usb != usb)
+					continue;
+				w->status = w->status ?: ret;
+				w->pending = 0;
+			}
+			remove(*usb);
+			return;
+		}
+
+		wait = (Wait*)urb->usercontext;
+		wait->pending--;
+		wait->actual += urb->actual_length;
+		if (urb->status < 0 && !wait->status)
+			wait->status = urb->status;
+	}
+}
+
+int Engine::next_timeout() {
+	clock::time_point deadline = clock::time_point::max();
+	clock::time_point now = clock::now();
+
+	for (auto w : waiting)
+		if (!w->expired)
+			deadline = std::min(deadline, w->deadline);
+
+	if (deadline == clock::time_point::max())
+		return -1;
+	if (deadline <= now)
+		return 0;
+
+	return std::chrono::duration_cast<std::chrono::milliseconds>(deadline -
+																 now)
+			   .count() +
+		   1;
+}
+
+void Engine::expire() {
+	clock::time_point now = clock::now();
+
+	for (auto w : waiting) {
+		if (w->expired || w->deadline > now)
+			continue;
+
+		w->expired = true;
+		for (auto urb : w->urbs)
+			w->usb->discard(urb);
+		if (w->urbs.empty())
+			w->pending = 0;
+	}
+}
+
+/**
+ * run() - run the spawned coroutines until all of them returned
+ *
+ * Returns 0 on success, negative errno if the event loop failed.
+ */
+int Engine::run() {
+	struct epoll_event events[64];
+	std::vector<Wait*> ready;
+	bool live;
+	int n;
+	int i;
+
+	if (epfd < 0)
+		return -EBADF;
+
+	for (auto& fiber : fibers) {
+		fiber->stack = mmap(NULL, ENGINE_STACK_SIZE, PROT_READ | PROT_WRITE,
+							MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+		if (fiber->stack == MAP_FAILED)
+			return -ENOMEM;
+
+		getcontext(&fiber->ctx);
+		fiber->ctx.uc_stack.ss_sp = fiber->stack;
+		fiber->ctx.uc_stack.ss_size = ENGINE_STACK_SIZE;
+		fiber->ctx.uc_link = &main;
+		makecontext(&fiber->ctx, trampoline, 0);
+
+		resume(fiber.get());
+	}
+
+	for (;;) {
+		live = std::any_of(fibers.begin(), fibers.end(),
+						   [](const std::unique_ptr<Fiber>& f) {
+							   return !f->done;
+						   });
+		if (!live)
+			break;
+
+		n = epoll_wait(epfd, events, 64, next_timeout());
+		if (n < 0 && errno != EINTR)
+			return -errno;
+
+		for (i = 0; i < n; i++) {
+			auto it = devices.find(events[i].data.fd);
+			if (it != devices.end())
+				reap(it->second);
+		}
+
+		expire();
+
+		ready.clear();
+		for (auto it = waiting.begin(); it != waiting.end();) {
+			if ((*it)->pending) {
+				++it;
+				continue;
+			}
+
+			ready.push_back(*it);
+			it = waiting.erase(it);
+		}
+
+		for (auto w : ready) {
+			/* Cancelled by expire() */
+			if (w->expired &&
+				(w->status == -ENOENT || w->status == -ECONNRESET))
+				w->status = -ETIMEDOUT;
+			if (w->expired && !w->status && !w->actual)
+				w->status = -ETIMEDOUT;
+
+			resume(w->fiber);
+		}
+	}
+
+	return 0;
+}
+
+Usb::Usb(Engine& engine, Qdl& usb) : engine(engine), usb(usb) {
+	registered = engine.add(usb);
+}
+
+Usb::~Usb() {
+	engine.remove(usb);
+}
+
+/**
+ * reconnect() - Qdl::reconnect(), yielding to the other coroutines while
+ * the device restarts
+ */
+int Usb::reconnect(unsigned timeout) {
+	char device[sizeof(usb.name)];
+	unsigned waited = 0;
+	int ret;
+
+	if (!usb.name[0])
+		return -ENODEV;
+
+	snprintf(device, sizeof(device), "%s", usb.name);
+	engine.remove(usb);
+	usb.disconnect();
+
+	while (!usb.gone() && waited < timeout) {
+		engine.sleep(USB_RECONNECT_POLL);
+		waited += USB_RECONNECT_POLL;
+	}
+
+	for (;;) {
+		ret = usb.open(device, nullptr, 0);
+		if (!ret || waited >= timeout)
+			break;
+
+		engine.sleep(USB_RECONNECT_POLL);
+		waited += USB_RECONNECT_POLL;
+	}
+	if (ret < 0) {
+		registered = ret;
+		return ret;
+	}
+
+	/* A new file descriptor */
+	registered = engine.add(usb);
+
+	return registered;
+}
+
+int Usb::transfer(bool in,
+				  void* buf,
+				  size_t len,
+				  bool eot,
+				  unsigned timeout) {
+	char* ptr = (char*)buf;
+	size_t pieces;
+	size_t piece;
+	size_t i;
+	Wait wait;
+	int ret;
+
+	if (registered < 0) {
+		errno = -registered;
+		return -1;
+	}
+
+	pieces = in || !len ? 1 : (len + ENGINE_URB_SIZE - 1) / ENGINE_URB_SIZE;
+	while (urbs.size() < pieces)
+		urbs.emplace_back(new usbdevfs_urb);
+
+	wait.usb = &usb;
+	for (i = 0; i < pieces; i++) {
+		piece = in ? len
+				   : std::min<size_t>(ENGINE_URB_SIZE,
+									  len - i * ENGINE_URB_SIZE);
+
+		ret = usb.submit(urbs[i].get(), in, ptr + i * ENGINE_URB_SIZE, piece,
+						 eot && i == pieces - 1, &wait);
+		if (ret < 0) {
+			wait.status = ret;
+			/* Cancel what was submitted */
+			timeout = 1;
+			break;
+		}
+
+		wait.urbs.push_back(urbs[i].get());
+		wait.pending++;
+	}
+
+	if (wait.pending)
+		engine.wait(wait, timeout);
+
+	if (wait.status < 0) {
+		errno = -wait.status;
+		return -1;
+	}
+
+	return wait.actual;
+}
+
+int Usb::read(void* buf, size_t len, unsigned int timeout) {
+	return transfer(true, buf, len, false, timeout);
+}
+
+int Usb::write(const void* buf, size_t len, bool eot) {
+	/* At least 1 MB/s, as the synchronous path allows 1 s per packet */
+	return transfer(false, (void*)buf, len, eot, 1000 + len / 1000);
+}
+
+}  // namespace engine
@@ -0,0 +1,385 @@
+#include "fanout.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "logger.h"
+
+namespace fanout {
+
+struct Block {
+	std::vector<char> data;
+};
+
+struct Stream {
+	std::string path;
+	std::unique_ptr<image::Source> source;
+	uint64_t size = 0;
+
+	/* Blocks read and not yet consumed by every member */
+	std::map<uint64_t, std::shared_ptr<const Block>> blocks;
+	std::vector<Member*> members;
+	/* Readers that opened it, and whether the others are still waited for */
+	std::vector<const Reader*> opened;
+	bool late = false;
+	/* Blocks before this one have been dropped */
+	uint64_t low = 0;
+	bool started = false;
+	bool loading = false;
+};
+
+/* One session's view of a Stream */
+class Member : public image::Source {
+   public:
+	Member(Group& group, std::shared_ptr<Stream> stream)
+		: group(group), stream(std::move(stream)) {}
+	~Member();
+
+	uint64_t size() const { return stream->size; }
+	ssize_t read(uint64_t offset, size_t len, const char** data);
+
+   private:
+	friend class Group;
+
+	ssize_t shared(uint64_t offset, size_t len, const char** data);
+
+	Group& group;
+	std::shared_ptr<Stream> stream;
+
+	/* First block still needed, once reading started */
+	uint64_t next = 0;
+	bool started = false;
+	bool detached = false;
+
+	/* Private reader once detached */
+	std::unique_ptr<image::Source> own;
+	/* Blocks of the last chunk handed out, and chunks spanning blocks */
+	std::vector<std::shared_ptr<const Block>> held;
+	std::vector<char> buf;
+};
+
+Member::~Member() {
+	std::lock_guard<std::mutex> guard(group.lock);
+	auto& members = stream->members;
+
+	members.erase(std::find(members.begin(), members.end(), this));
+	held.clear();
+
+	if (members.empty()) {
+		stream->blocks.clear();
+		stream->source.reset();
+	} else {
+		group.evict(*stream);
+	}
+
+	group.cond.notify_all();
+}
+
+ssize_t Member::read(uint64_t offset, size_t len, const char** data) {
+	ssize_t n;
+
+	if (!own) {
+		n = Member::shared(offset, len, data);
+		if (n != -EAGAIN)
+			return n;
+
+		own = image::open(stream->path.c_str(), group.direct);
+		if (!own)
+			return -ENOENT;
+	}
+
+	return own->read(offset, len, data);
+}
+
+/* Returns -EAGAIN once this member is to read privately */
+ssize_t Member::shared(uint64_t offset, size_t len, const char** data) {
+	std::unique_lock<std::mutex> guard(group.lock);
+	std::shared_ptr<const Block> block;
+	uint64_t first;
+	uint64_t last;
+	uint64_t idx;
+	size_t piece;
+	size_t skip;
+	size_t pos;
+
+	first = offset / FANOUT_BLOCK_SIZE;
+	last = len ? (offset + len - 1) / FANOUT_BLOCK_SIZE : first;
+
+	held.clear();
+
+	if (!detached) {
+		next = first;
+		started = true;
+		group.evict(*stream);
+		group.cond.notify_all();
+
+		for (idx = first; idx <= last; idx++) {
+			block = group.get(*stream, idx, guard);
+			if (!block || detached)
+				break;
+			held.push_back(block);
+		}
+	}
+
+	if (detached || held.size() != last - first + 1) {
+		if (!detached) {
+			detached = true;
+			group.detached++;
+		}
+		held.clear();
+		group.evict(*stream);
+		group.cond.notify_all();
+		return -EAGAIN;
+	}
+
+	group.served += len;
+	guard.unlock();
+
+	skip = offset - first * FANOUT_BLOCK_SIZE;
+	if (held.size() == 1) {
+		*data = held[0]->data.data() + skip;
+	} else {
+		buf.resize(len);
+		for (pos = 0; pos < len; pos += piece, skip = 0) {
+			piece = std::min<size_t>(FANOUT_BLOCK_SIZE - skip, len - pos);
+			block = held[(pos + offset) / FANOUT_BLOCK_SIZE - first];
+			memcpy(buf.data() + pos, block->data.data() + skip, piece);
+		}
+		*data = buf.data();
+	}
+
+	if (offset >= stream->size)
+		return 0;
+
+	return std::min<uint64_t>(len, stream->size - offset);
+}
+
+Reader::~Reader() {
+	std::lock_guard<std::mutex> guard(group.lock);
+	auto& readers = group.readers;
+
+	readers.erase(std::find(readers.begin(), readers.end(), this));
+	group.cond.notify_all();
+}
+
+/**
+ * open() - open the image at @path
+ *
+ * Returns a Source sharing the reads of the image with the other sessions
+ * of the group, or nullptr if it can't be opened.
+ */
+std::unique_ptr<image::Source> Reader::open(const char* path) {
+	return group.open(this, path);
+}
+
+/**
+ * join() - add a session to the group, until the returned Reader is gone
+ */
+std::unique_ptr<Reader> Group::join() {
+	std::lock_guard<std::mutex> guard(lock);
+	std::unique_ptr<Reader> reader(new Reader(*this));
+
+	readers.push_back(reader.get());
+
+	return reader;
+}
+
+std::unique_ptr<image::Source> Group::open(const Reader* reader,
+										   const char* path) {
+	std::lock_guard<std::mutex> guard(lock);
+	std::shared_ptr<Stream>& stream = streams[path];
+	Member* member;
+
+	if (!stream) {
+		stream = std::make_shared<Stream>();
+		stream->path = path;
+	}
+
+	/* The previous sessions are done with it, start over */
+	if (!stream->source) {
+		stream->source = image::open(path, direct);
+		if (!stream->source)
+			return nullptr;
+
+		stream->size = stream->source->size();
+		stream->low = 0;
+		stream->started = false;
+		stream->late = false;
+	}
+
+	if (std::find(stream->opened.begin(), stream->opened.end(), reader) ==
+		stream->opened.end())
+		stream->opened.push_back(reader);
+
+	member = new Member(*this, stream);
+	stream->members.push_back(member);
+
+	return std::unique_ptr<image::Source>(member);
+}
+
+/**
+ * prefetch() - read the images of @plan ahead of the sessions, at most
+ * @budget bytes ahead
+ */
+void Group::prefetch(std::shared_ptr<const plan::Plan> plan, size_t budget) {
+	this->plan = plan;
+	prefetcher.start(plan->programs, budget);
+}
+
+/* Sessions that haven't started reading hold on to what is there */
+uint64_t Group::position(const Stream& stream, const Member* member) const {
+	return member->started ? member->next : stream.low;
+}
+
+/* Sessions of the group that haven't got to @stream yet */
+unsigned Group::pending(const Stream& stream) const {
+	unsigned count = 0;
+
+	if (stream.late)
+		return 0;
+
+	for (auto reader : readers)
+		if (std::find(stream.opened.begin(), stream.opened.end(), reader) ==
+			stream.opened.end())
+			count++;
+
+	return count;
+}
+
+uint64_t Group::needed(const Stream& stream) const {
+	uint64_t idx = UINT64_MAX;
+
+	for (auto member : stream.members)
+		if (!member->detached)
+			idx = std::min(idx, Group::position(stream, member));
+
+	if (Group::pending(stream))
+		idx = std::min(idx, stream.low);
+
+	return idx;
+}
+
+void Group::evict(Stream& stream) {
+	uint64_t idx = Group::needed(stream);
+
+	if (idx == UINT64_MAX)
+		return;
+
+	stream.blocks.erase(stream.blocks.begin(), stream.blocks.lower_bound(idx));
+	if (stream.started)
+		stream.low = std::max(stream.low, idx);
+}
+
+void Group::wait(std::unique_lock<std::mutex>& guard) {
+	if (pause) {
+		guard.unlock();
+		pause(FANOUT_POLL_MS);
+		guard.lock();
+	} else {
+		cond.wait_for(guard, std::chrono::milliseconds(FANOUT_POLL_MS));
+	}
+}
+
+/*
+ * Block @index of @stream, read from disk if nobody did yet. Returns nullptr
+ * if it was dropped already or can't be read.
+ */
+std::shared_ptr<const Block> Group::get(Stream& stream,
+										uint64_t index,
+										std::unique_lock<std::mutex>& guard) {
+	std::shared_ptr<Block> block;
+	unsigned waited = 0;
+	const char* data;
+	ssize_t n = 0;
+
+	for (;;) {
+		auto it = stream.blocks.find(index);
+		if (it != stream.blocks.end())
+			return it->second;
+
+		if (stream.started && index < stream.low)
+			return nullptr;
+
+		if (stream.loading) {
+			Group::wait(guard);
+			continue;
+		}
+
+		if (!stream.started || index < Group::needed(stream) + FANOUT_WINDOW)
+			break;
+
+		/* Back-pressure, then leave the stragglers behind */
+		if (waited < stall_ms) {
+			Group::wait(guard);
+			waited += FANOUT_POLL_MS;
+			continue;
+		}
+
+		for (auto member : stream.members) {
+			if (member->detached ||
+				Group::position(stream, member) + FANOUT_WINDOW > index)
+				continue;
+
+			logger::info("[FANOUT] %s: detaching a session %llu MiB behind",
+						 stream.path.c_str(),
+						 (unsigned long long)(index -
+											  Group::position(stream, member)) *
+							 FANOUT_BLOCK_SIZE / (1024 * 1024));
+			member->detached = true;
+			detached++;
+		}
+
+		if (Group::pending(stream)) {
+			logger::info("[FANOUT] %s: not waiting for %u more sessions",
+						 stream.path.c_str(), Group::pending(stream));
+			stream.late = true;
+		}
+		Group::evict(stream);
+		break;
+	}
+
+	stream.loading = true;
+	guard.unlock();
+
+	block = std::make_shared<Block>();
+	block->data.resize(FANOUT_BLOCK_SIZE);
+	if (index * FANOUT_BLOCK_SIZE < stream.size) {
+		n = stream.source->read(index * FANOUT_BLOCK_SIZE, FANOUT_BLOCK_SIZE,
+								&data);
+		if (n >= 0)
+			memcpy(block->data.data(), data, FANOUT_BLOCK_SIZE);
+	}
+
+	guard.lock();
+	stream.loading = false;
+	cond.notify_all();
+
+	if (n < 0)
+		return nullptr;
+
+	if (!stream.started) {
+		stream.started = true;
+		stream.low = index;
+	}
+
+	loaded += n;
+	stream.blocks[index] = block;
+	prefetcher.consumed(n);
+
+	return block;
+}
+
+/**
+ * report() - log how much reading the group saved
+ */
+void Group::report() {
+	std::lock_guard<std::mutex> guard(lock);
+
+	logger::info("[FANOUT] read %llu MiB from disk for %llu MiB flashed, "
+				 "%u sessions detached",
+				 (unsigned long long)(loaded >> 20),
+				 (unsigned long long)(served >> 20), detached);
+}
+
+}  // namespace fanout
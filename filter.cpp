@@ -0,0 +1,177 @@
+#include "filter.h"
+
+#include <fnmatch.h>
+
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <utility>
+
+#include "logger.h"
+
+namespace filter {
+
+static int parse(const char* option, std::vector<Term>& terms) {
+	const char* spec;
+	const char* end;
+	char* last;
+	Term term;
+
+	for (spec = option; *spec; spec = *end ? end + 1 : end) {
+		end = strchrnul(spec, ',');
+		term.text.assign(spec, end - spec);
+		if (term.text.empty()) {
+			logger::error("[FILTER] empty term in \"%s\"", option);
+			return -EINVAL;
+		}
+
+		term.partition = strtoul(term.text.c_str(), &last, 10);
+		if (!*last && isdigit(term.text[0]))
+			term.kind = Term::PARTITION;
+		else if (strpbrk(term.text.c_str(), "*?["))
+			term.kind = Term::GLOB;
+		else if (term.text[0] == '_')
+			term.kind = Term::SLOT;
+		else
+			term.kind = Term::LABEL;
+
+		terms.push_back(term);
+	}
+
+	return 0;
+}
+
+static bool match(const Term& term, const program::Program& program) {
+	size_t len;
+
+	switch (term.kind) {
+		case Term::PARTITION:
+			return program.partition == term.partition;
+		case Term::SLOT:
+			len = strlen(program.label);
+			return len >= term.text.size() &&
+				   !strcmp(program.label + len - term.text.size(),
+						   term.text.c_str());
+		case Term::LABEL:
+			return !strcmp(program.label, term.text.c_str());
+		case Term::GLOB:
+			return !fnmatch(term.text.c_str(), program.label, 0);
+	}
+
+	return false;
+}
+
+static bool any(const std::vector<Term>& terms,
+				const program::Program& program) {
+	for (auto& term : terms)
+		if (match(term, program))
+			return true;
+
+	return false;
+}
+
+/**
+ * compile() - parse the @only and @skip options into the matcher
+ *
+ * Returns 0 on success, -EINVAL if a term is malformed.
+ */
+int Matcher::compile(const std::vector<const char*>& only,
+					 const std::vector<const char*>& skip) {
+	int ret;
+
+	for (auto spec : only) {
+		ret = parse(spec, this->only);
+		if (ret < 0)
+			return ret;
+	}
+
+	for (auto spec : skip) {
+		ret = parse(spec, this->skip);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * keep() - tell whether @program passes the filters
+ */
+bool Matcher::keep(const program::Program& program) const {
+	if (!only.empty() && !any(only, program))
+		return false;
+
+	return !any(skip, program);
+}
+
+/**
+ * apply() - the part of @plan passing the filters of @matcher
+ *
+ * The DISK patches of a LUN fix up its GPT images, which the patch manifest
+ * names by also patching the image files. They are kept if any of those
+ * images is still programmed, or if the manifest names none, if anything on
+ * the LUN is.
+ */
+std::shared_ptr<const plan::Plan> apply(
+	const Matcher& matcher, std::shared_ptr<const plan::Plan> plan) {
+	auto filtered = std::make_shared<plan::Plan>();
+	std::set<std::pair<unsigned, std::string>> kept;
+	/* LUNs with programs left, naming GPT images, and with them left */
+	std::set<unsigned> luns;
+	std::set<unsigned> named;
+	std::set<unsigned> patched;
+	unsigned skipped = 0;
+
+	for (auto& program : plan->programs) {
+		if (!matcher.keep(program)) {
+			logger::info("[FILTER] skipping %s", program.label);
+			skipped++;
+			continue;
+		}
+
+		filtered->programs.push_back(program);
+		luns.insert(program.partition);
+		if (program.filename)
+			kept.emplace(program.partition, program.filename);
+	}
+
+	for (auto& patch : plan->patches) {
+		if (!patch.filename || !strcmp(patch.filename, "DISK"))
+			continue;
+
+		named.insert(patch.partition);
+		if (kept.count({patch.partition, patch.filename}))
+			patched.insert(patch.partition);
+	}
+
+	for (auto& patch : plan->patches) {
+		if (!patch.filename)
+			continue;
+
+		if (strcmp(patch.filename, "DISK")) {
+			if (!kept.count({patch.partition, patch.filename}))
+				continue;
+		} else if (named.count(patch.partition)) {
+			if (!patched.count(patch.partition))
+				continue;
+		} else if (!luns.count(patch.partition)) {
+			continue;
+		}
+
+		filtered->patches.push_back(patch);
+	}
+
+	logger::info("[FILTER] %zu programs and %zu patches left, %u skipped",
+				 filtered->programs.size(), filtered->patches.size(),
+				 skipped);
+
+	filtered->ufs = plan->ufs;
+	/* The entries point into the strings of the original plan */
+	filtered->mapping = std::const_pointer_cast<plan::Plan>(plan);
+
+	return filtered;
+}
+
+}  // namespace filter
@@ -1,7 +1,6 @@
 #include "firehose.h"
 
 #include <dirent.h>
-#include <err.h>
 #include <fcntl.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
@@ -11,6 +10,7 @@
 #include <termios.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cctype>
 #include <cerrno>
@@ -20,10 +20,29 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
-#include <iostream>
 
+#include "digest.h"
+#include "logger.h"
+#include "prefetch.h"
+#include "qdl.h"
 #include "ufs.h"
 
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+#define ROUND_UP(x, a) (((x) + (a)-1) & ~((a)-1))
+
+/* Upper bound for the programmer to boot after the Sahara transfer */
+#define FIREHOSE_READY_TIMEOUT 10000
+
+/* Data covered by one program command, the unit of retransmission */
+#define FIREHOSE_SEGMENT_SIZE (64 * 1024 * 1024)
+/* Attempts to recover from transfer errors per segment */
+#define FIREHOSE_RETRIES 3
+/* Bytes at the start of a range the programmer hashes for --verify-history */
+#define FIREHOSE_VERIFY_SIZE (1024 * 1024)
+/* Upper bound for the programmer to answer again after clearing a halt */
+#define FIREHOSE_RECOVER_TIMEOUT 2000
+
 static void xml_setpropf(xmlNode* node,
 						 const char* attr,
 						 const char* fmt,
@@ -44,7 +63,7 @@ xmlNode* Firehose::response_parse(const char* buf, size_t len, int* error) {
 
 	doc = xmlReadMemory(buf, len, NULL, NULL, 0);
 	if (!doc) {
-		std::cerr << "failed to parse firehose packet" << std::endl;
+		logger::error("failed to parse firehose packet");
 		*error = -EINVAL;
 		return NULL;
 	}
@@ -58,7 +77,7 @@ xmlNode* Firehose::response_parse(const char* buf, size_t len, int* error) {
 	}
 
 	if (!node) {
-		std::cerr << "firehose packet without data tag" << std::endl;
+		logger::error("firehose packet without data tag");
 		*error = -EINVAL;
 		xmlFreeDoc(doc);
 		return NULL;
@@ -75,16 +94,73 @@ void Firehose::response_log(xmlNode* node) {
 	xmlChar* value;
 
 	value = xmlGetProp(node, (xmlChar*)"value");
-	std::cout << "LOG: " << value << std::endl;
+	logger::info("LOG: %s", value);
+	xmlFree(value);
+}
+
+/**
+ * response_next() - parse the <data> packet at @pos in the @len bytes of @buf
+ *
+ * Returns 0 with @nodes set to the first node of the packet, negative errno
+ * on failure. @pos is advanced past the packet either way.
+ */
+int Firehose::response_next(const char* buf,
+							size_t len,
+							size_t* pos,
+							xmlNode** nodes) {
+	const char* msg = buf + *pos;
+	const char* end;
+	int error;
+
+	end = strstr(msg, "</data>");
+	if (!end) {
+		logger::error("firehose response truncated");
+		*pos = len;
+		return -EPROTO;
+	}
+
+	end += strlen("</data>");
+	*pos = end - buf;
+
+	*nodes = Firehose::response_parse(msg, end - msg, &error);
+	if (!*nodes) {
+		logger::error("unable to parse response");
+		return error;
+	}
+
+	return 0;
+}
+
+/*
+ * Next packet from the reader thread if there is one, else from the buffer
+ * of the last read. Returns -ETIMEDOUT with errno set if nothing was read.
+ */
+int Firehose::receive(xmlNode** nodes, int timeout) {
+	int n;
+
+	if (reader.running())
+		return reader.pop(nodes, timeout);
+
+	while (rx_pos >= rx_len || !rx[rx_pos]) {
+		n = usb.read(rx, sizeof(rx) - 1, timeout);
+		if (n < 0)
+			return -ETIMEDOUT;
+		rx[n] = '\0';
+		rx_len = n;
+		rx_pos = 0;
+
+		if (options.debug)
+			logger::debug("FIREHOSE READ: %s", rx);
+	}
+
+	return Firehose::response_next(rx, rx_len, &rx_pos, nodes);
 }
 
-int Firehose::read(int wait, std::function<int(xmlNode*)> response_parser) {
-	char buf[4096];
+int Firehose::read(int wait,
+				   std::function<int(xmlNode*)> response_parser,
+				   bool quiet) {
 	xmlNode* nodes;
 	xmlNode* node;
-	int error;
-	char* msg;
-	char* end;
 	bool done = false;
 	int ret = -ENXIO;
 	int n;
@@ -94,49 +170,48 @@ int Firehose::read(int wait, std::function<int(xmlNode*)> response_parser) {
 		timeout = wait;
 
 	for (;;) {
-		n = Qdl::read(buf, sizeof(buf), timeout);
-		if (n < 0) {
+		n = Firehose::receive(&nodes, timeout);
+		if (n == -ETIMEDOUT) {
 			if (done)
 				break;
 
-			warn("failed to read");
+			if (!quiet)
+				logger::warn("failed to read: %s", strerror(errno));
 			return -ETIMEDOUT;
 		}
-		buf[n] = '\0';
-
-		if (qdl_debug)
-			std::cerr << "FIREHOSE READ: " << buf << std::endl;
-
-		for (msg = buf; msg[0]; msg = end) {
-			end = strstr(msg, "</data>");
-			if (!end) {
-				std::cerr << "firehose response truncated" << std::endl;
-				exit(1);
-			}
-
-			end += strlen("</data>");
+		if (n < 0)
+			return n;
 
-			nodes = Firehose::response_parse(msg, end - msg, &error);
-			if (!nodes) {
-				std::cerr << "unable to parse response" << std::endl;
-				return error;
-			}
+		for (node = nodes; node; node = node->next) {
+			if (xmlStrcmp(node->name, (xmlChar*)"log") == 0) {
+				if (log_parser) {
+					xmlChar* value = xmlGetProp(node, (xmlChar*)"value");
 
-			for (node = nodes; node; node = node->next) {
-				if (xmlStrcmp(node->name, (xmlChar*)"log") == 0) {
-					Firehose::response_log(node);
-				} else if (xmlStrcmp(node->name, (xmlChar*)"response") == 0) {
-					ret = response_parser(node);
-					done = true;
-					timeout = 1;
+					if (value)
+						log_parser((char*)value);
+					xmlFree(value);
 				}
+				Firehose::response_log(node);
+			} else if (xmlStrcmp(node->name, (xmlChar*)"response") == 0) {
+				ret = response_parser(node);
+				done = true;
 			}
-
-			xmlFreeDoc(nodes->doc);
 		}
 
-		if (wait > 0)
+		xmlFreeDoc(nodes->doc);
+
+		/*
+		 * Once answered, take only what already arrived. Without the reader
+		 * stragglers have to be polled for.
+		 */
+		if (reader.running()) {
+			if (done)
+				timeout = 0;
+		} else if (wait > 0) {
 			timeout = 100;
+		} else if (done) {
+			timeout = 1;
+		}
 	}
 
 	return ret;
@@ -150,43 +225,46 @@ int Firehose::write(xmlDoc* doc) {
 
 	xmlDocDumpMemory(doc, &s, &len);
 
-	if (qdl_debug)
-		std::cerr << "FIREHOSE WRITE: " << s << std::endl;
+	if (options.debug)
+		logger::debug("FIREHOSE WRITE: %s", s);
 
-	ret = Qdl::write(s, len, true);
+	ret = usb.write(s, len, true);
 	saved_errno = errno;
 	xmlFree(s);
 	return ret < 0 ? -saved_errno : 0;
 }
 
-static size_t max_payload_size = 1048576;
-
 static int firehose_configure_response_parser(xmlNode* node) {
+	xmlChar* supported = NULL;
 	xmlChar* payload;
 	xmlChar* value;
-	size_t max_size;
+	int ret = -EINVAL;
 
 	value = xmlGetProp(node, (xmlChar*)"value");
 	payload = xmlGetProp(node, (xmlChar*)"MaxPayloadSizeToTargetInBytes");
 	if (!value || !payload)
-		return -EINVAL;
-
-	max_size = strtoul((char*)payload, NULL, 10);
+		goto out;
 
 	/*
 	 * When receiving an ACK the remote may indicate that we should attempt
 	 * a larger payload size
 	 */
 	if (!xmlStrcmp(value, (xmlChar*)"ACK")) {
-		payload = xmlGetProp(
+		supported = xmlGetProp(
 			node, (xmlChar*)"MaxPayloadSizeToTargetInBytesSupported");
-		if (!payload)
-			return -EINVAL;
+		if (!supported)
+			goto out;
 
-		max_size = strtoul((char*)payload, NULL, 10);
+		ret = strtoul((char*)supported, NULL, 10);
+	} else {
+		ret = strtoul((char*)payload, NULL, 10);
 	}
 
-	return max_size;
+out:
+	xmlFree(supported);
+	xmlFree(payload);
+	xmlFree(value);
+	return ret;
 }
 
 int Firehose::send_configure(size_t payload_size,
@@ -233,9 +311,8 @@ int Firehose::configure(bool skip_storage_init, const char* storage) {
 		max_payload_size = ret;
 	}
 
-	if (qdl_debug) {
-		std::cerr << "[CONFIGURE] max payload size: " << max_payload_size
-				  << std::endl;
+	if (options.debug) {
+		logger::debug("[CONFIGURE] max payload size: %zu", max_payload_size);
 	}
 
 	return 0;
@@ -243,149 +320,390 @@ int Firehose::configure(bool skip_storage_init, const char* storage) {
 
 static int firehose_nop_parser(xmlNode* node) {
 	xmlChar* value;
+	int ret;
 
 	value = xmlGetProp(node, (xmlChar*)"value");
-	return !!xmlStrcmp(value, (xmlChar*)"ACK");
+	ret = !!xmlStrcmp(value, (xmlChar*)"ACK");
+	xmlFree(value);
+	return ret;
 }
 
-#define MIN(x, y) ((x) < (y) ? (x) : (y))
-#define ROUND_UP(x, a) (((x) + (a)-1) & ~((a)-1))
 
-int Firehose::apply_program(std::shared_ptr<program::Program>& program,
-							int fd) {
-	unsigned num_sectors;
-	struct stat sb;
+/*
+ * Program @count sectors of @program from @source, starting @skip sectors
+ * into it. Returns 0 on success, a positive value on NAK, -EAGAIN if a
+ * transfer failed and negative errno on other errors.
+ */
+int Firehose::program_segment(const program::Program& program,
+							  image::Source& source,
+							  uint64_t start,
+							  unsigned skip,
+							  unsigned count,
+							  unsigned total) {
 	size_t chunk_size;
+	uint64_t offset;
+	const char* data;
 	xmlNode* root;
 	xmlNode* node;
 	xmlDoc* doc;
-	std::shared_ptr<char[]> buf;
-	time_t t0;
-	time_t t;
+	ssize_t n;
 	int left;
 	int ret;
-	int n;
 
-	if (fw_only) {
-		if (!strcmp(program->label, "system") ||
-			!strcmp(program->label, "cust") ||
-			!strcmp(program->label, "userdata") ||
-			!strcmp(program->label, "keystore") ||
-			!strcmp(program->label, "boot") ||
-			!strcmp(program->label, "recovery") ||
-			!strcmp(program->label, "sec")) {
-			std::cout << "[FIREHOSE]: skipping " << program->label << std::endl;
-			return 0;
-		}
+	doc = xmlNewDoc((xmlChar*)"1.0");
+	root = xmlNewNode(NULL, (xmlChar*)"data");
+	xmlDocSetRootElement(doc, root);
+
+	node = xmlNewChild(root, NULL, (xmlChar*)"program", NULL);
+	xml_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%d", program.sector_size);
+	xml_setpropf(node, "num_partition_sectors", "%d", count);
+	xml_setpropf(node, "physical_partition_number", "%d", program.partition);
+	if (skip)
+		xml_setpropf(node, "start_sector", "%llu",
+					 (unsigned long long)start + skip);
+	else
+		xml_setpropf(node, "start_sector", "%s", program.start_sector);
+	if (program.filename)
+		xml_setpropf(node, "filename", "%s", program.filename);
+
+	ret = Firehose::write(doc);
+	xmlFreeDoc(doc);
+	if (ret < 0) {
+		logger::error("[PROGRAM] failed to write program command");
+		return -EAGAIN;
+	}
+
+	ret = Firehose::read(-1, firehose_nop_parser);
+	if (ret) {
+		logger::error("[PROGRAM] failed to setup programming");
+		return ret < 0 ? -EAGAIN : ret;
 	}
 
-	num_sectors = program->num_sectors;
+	/* From here on the programmer takes anything it receives as data */
+	streaming = true;
+
+	offset = ((uint64_t)program.file_offset + skip) * program.sector_size;
+	left = count;
+	while (left > 0) {
+		chunk_size = MIN(max_payload_size / program.sector_size, (size_t)left);
+
+		n = source.read(offset, chunk_size * program.sector_size, &data);
+		if (n < 0) {
+			logger::error("[PROGRAM] failed to read %s: %s", program.path,
+						  strerror(-n));
+			return n;
+		}
+		if (prefetch)
+			prefetch->consumed(n);
+		offset += chunk_size * program.sector_size;
+
+		n = usb.write(data, chunk_size * program.sector_size, true);
+		if (n < 0 || (size_t)n != chunk_size * program.sector_size) {
+			logger::error("[PROGRAM] failed to write %s", program.label);
+			return -EAGAIN;
+		}
 
-	ret = fstat(fd, &sb);
+		left -= chunk_size;
+
+		if (progress)
+			progress(program,
+					 (uint64_t)(skip + count - left) * program.sector_size,
+					 (uint64_t)total * program.sector_size);
+	}
+
+	ret = Firehose::read(-1, firehose_nop_parser);
 	if (ret < 0)
-		err(1, "failed to stat \"%s\"\n", program->filename);
+		return -EAGAIN;
 
-	num_sectors =
-		(sb.st_size + program->sector_size - 1) / program->sector_size;
+	streaming = false;
 
-	if (program->num_sectors && num_sectors > program->num_sectors) {
-		fprintf(stderr, "[PROGRAM] %s truncated to %d\n", program->label,
-				program->num_sectors * program->sector_size);
-		num_sectors = program->num_sectors;
+	return ret;
+}
+
+/* Find the hex digest in a <log> of the programmer */
+static void parse_digest(const char* msg, std::string& digest) {
+	const char* p;
+
+	p = strstr(msg, "Digest");
+	if (!p)
+		return;
+
+	digest.clear();
+	for (p += strlen("Digest"); *p && digest.size() < 2 * SHA256_DIGEST_SIZE;
+		 p++) {
+		if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+			p++;
+		else if (isxdigit(*p))
+			digest += tolower(*p);
+		else if (!digest.empty() && *p != ' ')
+			break;
 	}
+}
 
-	buf = std::shared_ptr<char[]>(new char[max_payload_size]);
-	if (!buf)
-		err(1, "failed to allocate sector buffer");
+/**
+ * verify() - have the programmer confirm that the start of the range of
+ * @program on the device holds the image in @source
+ *
+ * Returns 0 if it does, -EIO if it doesn't, negative errno if the programmer
+ * can't tell.
+ */
+int Firehose::verify(const program::Program& program,
+					 image::Source& source,
+					 unsigned num_sectors) {
+	std::string expect;
+	std::string found;
+	digest::Sum sum;
+	const char* data;
+	unsigned count;
+	xmlNode* root;
+	xmlNode* node;
+	xmlDoc* doc;
+	Sha256 sha;
+	ssize_t n;
+	int ret;
+
+	count = MAX(MIN(num_sectors, FIREHOSE_VERIFY_SIZE / program.sector_size),
+				1U);
+
+	n = source.read((uint64_t)program.file_offset * program.sector_size,
+					(size_t)count * program.sector_size, &data);
+	if (n < 0)
+		return n;
+
+	sha.update(data, (size_t)count * program.sector_size);
+	sha.final(sum.data());
+	expect = digest::hex(sum);
 
 	doc = xmlNewDoc((xmlChar*)"1.0");
 	root = xmlNewNode(NULL, (xmlChar*)"data");
 	xmlDocSetRootElement(doc, root);
 
-	node = xmlNewChild(root, NULL, (xmlChar*)"program", NULL);
-	xml_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%d", program->sector_size);
-	xml_setpropf(node, "num_partition_sectors", "%d", num_sectors);
-	xml_setpropf(node, "physical_partition_number", "%d", program->partition);
-	xml_setpropf(node, "start_sector", "%s", program->start_sector);
-	if (program->filename)
-		xml_setpropf(node, "filename", "%s", program->filename);
+	node = xmlNewChild(root, NULL, (xmlChar*)"getsha256digest", NULL);
+	xml_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%d", program.sector_size);
+	xml_setpropf(node, "num_partition_sectors", "%u", count);
+	xml_setpropf(node, "physical_partition_number", "%d", program.partition);
+	xml_setpropf(node, "start_sector", "%s", program.start_sector);
 
 	ret = Firehose::write(doc);
-	if (ret < 0) {
-		std::cerr << "[PROGRAM] failed to write program command" << std::endl;
-		goto out;
-	}
+	xmlFreeDoc(doc);
+	if (ret < 0)
+		return ret;
 
+	log_parser = [&](const char* msg) { parse_digest(msg, found); };
 	ret = Firehose::read(-1, firehose_nop_parser);
-	if (ret) {
-		std::cerr << "[PROGRAM] failed to setup programming" << std::endl;
-		goto out;
+	log_parser = nullptr;
+	if (ret)
+		return ret < 0 ? ret : -ENOTSUP;
+
+	if (found.size() != expect.size()) {
+		logger::warn("[HISTORY] %s: no digest from the programmer",
+					 program.label);
+		return -ENOTSUP;
 	}
 
-	t0 = time(NULL);
+	if (found != expect) {
+		logger::info("[HISTORY] %s differs on the device", program.label);
+		return -EIO;
+	}
 
-	lseek(fd, program->file_offset * program->sector_size, SEEK_SET);
-	left = num_sectors;
-	while (left > 0) {
-		chunk_size = MIN(max_payload_size / program->sector_size, (size_t)left);
+	return 0;
+}
 
-		n = ::read(fd, buf.get(), chunk_size * program->sector_size);
-		if (n < 0)
-			err(1, "failed to read");
+const personalize::Contents* Firehose::personalized(
+	const program::Program& program) const {
+	for (auto& contents : personal)
+		if (contents.program == &program)
+			return &contents;
 
-		if ((size_t)n < max_payload_size)
-			std::memset(buf.get() + n, 0, max_payload_size - n);
+	return NULL;
+}
 
-		n = Qdl::write(buf.get(), chunk_size * program->sector_size, true);
-		if (n < 0)
-			err(1, "failed to write");
+/**
+ * replace() - the contents built for the device in place of the image of
+ * @program, if any
+ */
+std::unique_ptr<image::Source> Firehose::replace(
+	const program::Program& program) {
+	const personalize::Contents* contents;
 
-		if ((size_t)n != chunk_size * program->sector_size)
-			err(1, "failed to write full sector");
+	contents = Firehose::personalized(program);
+	if (!contents)
+		return nullptr;
 
-		left -= chunk_size;
+	return std::unique_ptr<image::Source>(new image::Memory(contents->data));
+}
+
+int Firehose::apply_program(const program::Program& program,
+							 image::Source& image) {
+	const personalize::Contents* contents;
+	const std::vector<char>* host_data = NULL;
+	std::vector<std::string> prints;
+	std::unique_ptr<image::Memory> patched;
+	image::Source* source = &image;
+	Report::clock::time_point since;
+	unsigned num_sectors;
+	unsigned segment;
+	unsigned attempts = 0;
+	unsigned done = 0;
+	bool reset;
+	unsigned count;
+	uint64_t start;
+	char* end;
+	time_t t0;
+	time_t t;
+	int ret;
+
+	contents = Firehose::personalized(program);
+
+	for (auto& region : host_regions) {
+		if (region.program != &program || contents)
+			continue;
+
+		patched.reset(new image::Memory(
+			std::make_shared<const std::vector<char>>(region.data)));
+		source = patched.get();
+		host_data = &region.data;
+	}
+
+	num_sectors =
+		(source->size() + program.sector_size - 1) / program.sector_size;
+
+	if (program.num_sectors && num_sectors > program.num_sectors) {
+		logger::warn("[PROGRAM] %s truncated to %d", program.label,
+					 program.num_sectors * program.sector_size);
+		num_sectors = program.num_sectors;
+	}
+
+	/*
+	 * Large images go out as several program commands, each acknowledged,
+	 * so a transfer error costs one segment. Start sectors given as an
+	 * expression can't be offset and go out whole.
+	 */
+	start = strtoull(program.start_sector, &end, 10);
+	if (*end || end == program.start_sector)
+		segment = num_sectors;
+	else
+		segment = MAX(FIREHOSE_SEGMENT_SIZE / program.sector_size, 1U);
+
+	if (history && (contents || program.path)) {
+		/* What is written, rather than the file it comes from */
+		if (contents)
+			prints.push_back(history::fingerprint(*contents->data));
+		else if (host_data)
+			prints.push_back(history::fingerprint(*host_data));
+		else
+			prints = history::fingerprints(program.path);
+		if (!options.force &&
+			history->unchanged(program, num_sectors, prints) &&
+			(!options.verify_history ||
+			 Firehose::verify(program, *source, num_sectors) == 0)) {
+			logger::info("[HISTORY] %s unchanged, skipping", program.label);
+			report.skipped++;
+			report.skipped_bytes += (uint64_t)num_sectors * program.sector_size;
+			if (progress)
+				progress(program, (uint64_t)num_sectors * program.sector_size,
+						 (uint64_t)num_sectors * program.sector_size);
+			return 0;
+		}
+
+		/* Nothing may claim the range while it's half written */
+		ret = history->forget(program, num_sectors);
+		if (ret < 0)
+			return ret;
+	}
+
+	t0 = time(NULL);
+
+	for (;;) {
+		count = MIN(segment, num_sectors - done);
+		since = Report::clock::now();
+
+		ret = Firehose::program_segment(program, *source, start, done, count,
+										num_sectors);
+		if (ret != -EAGAIN) {
+			if (ret)
+				break;
+			done += count;
+			attempts = 0;
+			if (done >= num_sectors)
+				break;
+			continue;
+		}
+
+		/* A programmer left inside the <program> would take NOPs as data */
+		reset = attempts > 0 || streaming;
+		streaming = false;
+
+		do {
+			if (++attempts > FIREHOSE_RETRIES) {
+				ret = -EIO;
+				break;
+			}
+
+			logger::warn("[PROGRAM] retrying %s from sector %u, attempt %u",
+						 program.label, done, attempts);
+			ret = Firehose::recover(reset);
+			report.retries++;
+			report.retry_ms += std::chrono::duration<double, std::milli>(
+								   Report::clock::now() - since)
+								   .count();
+			since = Report::clock::now();
+
+			/* If the link didn't come back, reset it on the next attempt */
+			reset = true;
+		} while (ret < 0);
+		if (ret < 0)
+			break;
 	}
 
 	t = time(NULL) - t0;
 
-	ret = Firehose::read(-1, firehose_nop_parser);
+	if (!ret) {
+		report.programs++;
+		report.bytes += (uint64_t)num_sectors * program.sector_size;
+		if (history && !prints.empty())
+			history->record(program, num_sectors, prints);
+	}
+
 	if (ret) {
-		std::cerr << "[PROGRAM] failed" << std::endl;
+		logger::error("[PROGRAM] failed");
 	} else if (t) {
-		std::cerr << "[PROGRAM] flashed \"" << program->label
-				  << "\" successfully at "
-				  << (program->sector_size * num_sectors / t / 1024) << "kB/s"
-				  << std::endl;
+		logger::notice("[PROGRAM] flashed \"%s\" successfully at %lukB/s",
+					   program.label,
+					   (unsigned long)program.sector_size * num_sectors / t /
+						   1024);
 	} else {
-		std::cerr << "[PROGRAM] flashed \"" << program->label
-				  << "\" successfully" << std::endl;
+		logger::notice("[PROGRAM] flashed \"%s\" successfully",
+					   program.label);
 	}
 
-out:
-	xmlFreeDoc(doc);
 	return ret;
 }
 
-int Firehose::apply_patch(std::shared_ptr<patch::Patch>& patch) {
+int Firehose::apply_patch(const patch::Patch& patch) {
 	xmlNode* root;
 	xmlNode* node;
 	xmlDoc* doc;
 	int ret;
 
-	printf("%s\n", patch->what);
+	if (std::find(host_partitions.begin(), host_partitions.end(),
+				  patch.partition) != host_partitions.end())
+		return 0;
+
+	logger::info("%s", patch.what);
 
 	doc = xmlNewDoc((xmlChar*)"1.0");
 	root = xmlNewNode(NULL, (xmlChar*)"data");
 	xmlDocSetRootElement(doc, root);
 
 	node = xmlNewChild(root, NULL, (xmlChar*)"patch", NULL);
-	xml_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%d", patch->sector_size);
-	xml_setpropf(node, "byte_offset", "%d", patch->byte_offset);
-	xml_setpropf(node, "filename", "%s", patch->filename);
-	xml_setpropf(node, "physical_partition_number", "%d", patch->partition);
-	xml_setpropf(node, "size_in_bytes", "%d", patch->size_in_bytes);
-	xml_setpropf(node, "start_sector", "%s", patch->start_sector);
-	xml_setpropf(node, "value", "%s", patch->value);
+	xml_setpropf(node, "SECTOR_SIZE_IN_BYTES", "%d", patch.sector_size);
+	xml_setpropf(node, "byte_offset", "%d", patch.byte_offset);
+	xml_setpropf(node, "filename", "%s", patch.filename);
+	xml_setpropf(node, "physical_partition_number", "%d", patch.partition);
+	xml_setpropf(node, "size_in_bytes", "%d", patch.size_in_bytes);
+	xml_setpropf(node, "start_sector", "%s", patch.start_sector);
+	xml_setpropf(node, "value", "%s", patch.value);
 
 	ret = Firehose::write(doc);
 	if (ret < 0)
@@ -393,7 +711,7 @@ int Firehose::apply_patch(std::shared_ptr<patch::Patch>& patch) {
 
 	ret = Firehose::read(-1, firehose_nop_parser);
 	if (ret)
-		std::cerr << "[APPLY PATCH] " << ret << std::endl;
+		logger::error("[APPLY PATCH] %d", ret);
 
 out:
 	xmlFreeDoc(doc);
@@ -416,7 +734,7 @@ int Firehose::send_single_tag(xmlNode* node) {
 
 	ret = Firehose::read(-1, firehose_nop_parser);
 	if (ret) {
-		std::cerr << "[UFS] " << __func__ << " err " << ret << std::endl;
+		logger::error("[UFS] %s err %d", __func__, ret);
 		ret = -EINVAL;
 	}
 
@@ -425,75 +743,74 @@ out:
 	return ret;
 }
 
-int Firehose::apply_ufs_common(std::shared_ptr<ufs::Common>& ufs) {
+int Firehose::apply_ufs_common(const ufs::Common& ufs) {
 	xmlNode* node_to_send;
 	int ret;
 
 	node_to_send = xmlNewNode(NULL, (xmlChar*)"ufs");
 
-	xml_setpropf(node_to_send, "bNumberLU", "%d", ufs->bNumberLU);
-	xml_setpropf(node_to_send, "bBootEnable", "%d", ufs->bBootEnable);
-	xml_setpropf(node_to_send, "bDescrAccessEn", "%d", ufs->bDescrAccessEn);
-	xml_setpropf(node_to_send, "bInitPowerMode", "%d", ufs->bInitPowerMode);
-	xml_setpropf(node_to_send, "bHighPriorityLUN", "%d", ufs->bHighPriorityLUN);
+	xml_setpropf(node_to_send, "bNumberLU", "%d", ufs.bNumberLU);
+	xml_setpropf(node_to_send, "bBootEnable", "%d", ufs.bBootEnable);
+	xml_setpropf(node_to_send, "bDescrAccessEn", "%d", ufs.bDescrAccessEn);
+	xml_setpropf(node_to_send, "bInitPowerMode", "%d", ufs.bInitPowerMode);
+	xml_setpropf(node_to_send, "bHighPriorityLUN", "%d", ufs.bHighPriorityLUN);
 	xml_setpropf(node_to_send, "bSecureRemovalType", "%d",
-				 ufs->bSecureRemovalType);
+				 ufs.bSecureRemovalType);
 	xml_setpropf(node_to_send, "bInitActiveICCLevel", "%d",
-				 ufs->bInitActiveICCLevel);
+				 ufs.bInitActiveICCLevel);
 	xml_setpropf(node_to_send, "wPeriodicRTCUpdate", "%d",
-				 ufs->wPeriodicRTCUpdate);
+				 ufs.wPeriodicRTCUpdate);
 	xml_setpropf(node_to_send, "bConfigDescrLock", "%d",
-				 0 /*ufs->bConfigDescrLock*/);	// Safety, remove before fly
+				 0 /*ufs.bConfigDescrLock*/);	// Safety, remove before fly
 
 	ret = Firehose::send_single_tag(node_to_send);
 	if (ret)
-		std::cerr << "[APPLY UFS common] " << ret << std::endl;
+		logger::error("[APPLY UFS common] %d", ret);
 
 	return ret;
 }
 
-int Firehose::apply_ufs_body(std::shared_ptr<ufs::Body>& ufs) {
+int Firehose::apply_ufs_body(const ufs::Body& ufs) {
 	xmlNode* node_to_send;
 	int ret;
 
 	node_to_send = xmlNewNode(NULL, (xmlChar*)"ufs");
 
-	xml_setpropf(node_to_send, "LUNum", "%d", ufs->LUNum);
-	xml_setpropf(node_to_send, "bLUEnable", "%d", ufs->bLUEnable);
-	xml_setpropf(node_to_send, "bBootLunID", "%d", ufs->bBootLunID);
-	xml_setpropf(node_to_send, "size_in_kb", "%d", ufs->size_in_kb);
-	xml_setpropf(node_to_send, "bDataReliability", "%d", ufs->bDataReliability);
-	xml_setpropf(node_to_send, "bLUWriteProtect", "%d", ufs->bLUWriteProtect);
-	xml_setpropf(node_to_send, "bMemoryType", "%d", ufs->bMemoryType);
+	xml_setpropf(node_to_send, "LUNum", "%d", ufs.LUNum);
+	xml_setpropf(node_to_send, "bLUEnable", "%d", ufs.bLUEnable);
+	xml_setpropf(node_to_send, "bBootLunID", "%d", ufs.bBootLunID);
+	xml_setpropf(node_to_send, "size_in_kb", "%d", ufs.size_in_kb);
+	xml_setpropf(node_to_send, "bDataReliability", "%d", ufs.bDataReliability);
+	xml_setpropf(node_to_send, "bLUWriteProtect", "%d", ufs.bLUWriteProtect);
+	xml_setpropf(node_to_send, "bMemoryType", "%d", ufs.bMemoryType);
 	xml_setpropf(node_to_send, "bLogicalBlockSize", "%d",
-				 ufs->bLogicalBlockSize);
+				 ufs.bLogicalBlockSize);
 	xml_setpropf(node_to_send, "bProvisioningType", "%d",
-				 ufs->bProvisioningType);
+				 ufs.bProvisioningType);
 	xml_setpropf(node_to_send, "wContextCapabilities", "%d",
-				 ufs->wContextCapabilities);
-	if (ufs->desc)
-		xml_setpropf(node_to_send, "desc", "%s", ufs->desc);
+				 ufs.wContextCapabilities);
+	if (ufs.desc)
+		xml_setpropf(node_to_send, "desc", "%s", ufs.desc);
 
 	ret = Firehose::send_single_tag(node_to_send);
 	if (ret)
-		std::cerr << "[APPLY UFS body] " << ret << std::endl;
+		logger::error("[APPLY UFS body] %d", ret);
 
 	return ret;
 }
 
-int Firehose::apply_ufs_epilogue(std::shared_ptr<ufs::Epilogue>& ufs,
-								 bool commit) {
+int Firehose::apply_ufs_epilogue(const ufs::Epilogue& ufs, bool commit) {
 	xmlNode* node_to_send;
 	int ret;
 
 	node_to_send = xmlNewNode(NULL, (xmlChar*)"ufs");
 
-	xml_setpropf(node_to_send, "LUNtoGrow", "%d", ufs->LUNtoGrow);
+	xml_setpropf(node_to_send, "LUNtoGrow", "%d", ufs.LUNtoGrow);
 	xml_setpropf(node_to_send, "commit", "%d", commit);
 
 	ret = Firehose::send_single_tag(node_to_send);
 	if (ret)
-		std::cerr << "[APPLY UFS epilogue] " << ret << std::endl;
+		logger::error("[APPLY UFS epilogue] %d", ret);
 
 	return ret;
 }
@@ -518,12 +835,11 @@ int Firehose::set_bootable(int part) {
 
 	ret = Firehose::read(-1, firehose_nop_parser);
 	if (ret) {
-		std::cerr << "failed to mark partition " << part << " as bootable"
-				  << std::endl;
+		logger::error("failed to mark partition %d as bootable", part);
 		return -1;
 	}
 
-	std::cout << "partition " << part << " is now bootable" << std::endl;
+	logger::info("partition %d is now bootable", part);
 	return 0;
 }
 
@@ -548,46 +864,385 @@ int Firehose::reset() {
 	return Firehose::read(-1, firehose_nop_parser);
 }
 
-int Firehose::run(const char* incdir, const char* storage) {
+static int firehose_ignore_parser(xmlNode* node) {
+	return 0;
+}
+
+/**
+ * wait_ready() - wait for the firehose programmer to accept commands
+ * @timeout:	overall deadline, in milliseconds
+ *
+ * Returns 0 once the programmer has answered a NOP, -ETIMEDOUT otherwise.
+ *
+ * The log messages printed while the programmer boots are drained, then NOPs
+ * are sent with an exponentially increasing wait for the answer until one is
+ * acknowledged. Answers to NOPs sent before the programmer was listening
+ * may trail the first one, so they are drained as well.
+ */
+int Firehose::wait_ready(unsigned timeout) {
+	Report::clock::time_point deadline;
+	xmlNode* root;
+	xmlDoc* doc;
+	int backoff = 10;
+	int ret;
+
+	deadline = Report::clock::now() + std::chrono::milliseconds(timeout);
+
+	doc = xmlNewDoc((xmlChar*)"1.0");
+	root = xmlNewNode(NULL, (xmlChar*)"data");
+	xmlDocSetRootElement(doc, root);
+	xmlNewChild(root, NULL, (xmlChar*)"nop", NULL);
+
+	for (;;) {
+		Firehose::read(backoff, firehose_ignore_parser, true);
+
+		ret = Firehose::write(doc);
+		if (ret == 0) {
+			ret = Firehose::read(backoff, firehose_nop_parser, true);
+			if (ret >= 0)
+				break;
+		}
+
+		if (Report::clock::now() >= deadline) {
+			logger::error("[FIREHOSE] programmer not responding");
+			xmlFreeDoc(doc);
+			return -ETIMEDOUT;
+		}
+
+		backoff = MIN(backoff * 2, 500);
+	}
+
+	xmlFreeDoc(doc);
+
+	while (Firehose::read(20, firehose_ignore_parser, true) >= 0)
+		;
+
+	report.ready_ms = report.elapsed_ms();
+
+	return 0;
+}
+
+/**
+ * recover() - get the programmer to take commands again after a failed
+ * transfer
+ * @reset:	reset the USB device instead of only clearing the endpoints,
+ *		and configure the programmer again in case it started over
+ *
+ * Returns 0 once the programmer answers, negative errno otherwise.
+ */
+int Firehose::recover(bool reset) {
+	bool duplex = reader.running();
+	double ready_ms = report.ready_ms;
+	xmlNode* nodes;
+	int ret;
+
+	/* Anything received so far belongs to the failed transfer */
+	reader.stop();
+	while (reader.pop(&nodes, 0) != -ETIMEDOUT)
+		if (nodes)
+			xmlFreeDoc(nodes->doc);
+	rx_pos = 0;
+	rx_len = 0;
+
+	ret = usb.recover(reset);
+	if (ret < 0 && ret != -ENOTSUP) {
+		logger::error("[FIREHOSE] unable to recover the USB link: %s",
+					  strerror(-ret));
+		return ret;
+	}
+
+	if (duplex)
+		reader.start(usb, options.debug);
+
+	ret = Firehose::wait_ready(reset ? FIREHOSE_READY_TIMEOUT
+									 : FIREHOSE_RECOVER_TIMEOUT);
+	report.ready_ms = ready_ms;
+	if (ret < 0 || !reset)
+		return ret;
+
+	ret = Firehose::configure(false, options.storage);
+
+	return ret > 0 ? -EIO : ret;
+}
+
+/**
+ * ping() - tell whether a programmer is running and listening
+ *
+ * Returns 0 if a NOP is acknowledged within @timeout ms, negative errno
+ * otherwise.
+ */
+int Firehose::ping(unsigned timeout) {
+	xmlNode* root;
+	xmlDoc* doc;
+	int ret;
+
+	doc = xmlNewDoc((xmlChar*)"1.0");
+	root = xmlNewNode(NULL, (xmlChar*)"data");
+	xmlDocSetRootElement(doc, root);
+	xmlNewChild(root, NULL, (xmlChar*)"nop", NULL);
+
+	ret = Firehose::write(doc);
+	xmlFreeDoc(doc);
+	if (ret < 0)
+		return ret;
+
+	ret = Firehose::read(timeout, firehose_nop_parser, true);
+
+	return ret < 0 ? ret : 0;
+}
+
+/**
+ * disk_sectors() - query the size of a LUN
+ * @partition:		physical partition number of the LUN
+ * @sector_size:	expected sector size
+ * @sectors:		receives the number of sectors
+ *
+ * Returns 0 on success, negative errno if the programmer didn't tell.
+ */
+int Firehose::disk_sectors(unsigned partition,
+						   unsigned sector_size,
+						   uint64_t* sectors) {
+	unsigned long long block_size = 0;
+	unsigned long long total = 0;
+	const char* p;
+	xmlNode* root;
+	xmlNode* node;
+	xmlDoc* doc;
+	int ret;
+
+	doc = xmlNewDoc((xmlChar*)"1.0");
+	root = xmlNewNode(NULL, (xmlChar*)"data");
+	xmlDocSetRootElement(doc, root);
+
+	node = xmlNewChild(root, NULL, (xmlChar*)"getstorageinfo", NULL);
+	xml_setpropf(node, "physical_partition_number", "%u", partition);
+
+	ret = Firehose::write(doc);
+	xmlFreeDoc(doc);
+	if (ret < 0)
+		return ret;
+
+	/* The storage info comes as JSON in a log message */
+	log_parser = [&](const char* msg) {
+		p = strstr(msg, "\"total_blocks\":");
+		if (p)
+			total = strtoull(p + strlen("\"total_blocks\":"), NULL, 10);
+		p = strstr(msg, "\"block_size\":");
+		if (p)
+			block_size = strtoull(p + strlen("\"block_size\":"), NULL, 10);
+	};
+	ret = Firehose::read(-1, firehose_nop_parser);
+	log_parser = nullptr;
+	if (ret)
+		return ret < 0 ? ret : -EIO;
+
+	if (!total || (block_size && block_size != sector_size))
+		return -ENOTSUP;
+
+	*sectors = total;
+	return 0;
+}
+
+/**
+ * patch_on_host() - apply the DISK patches to the GPT images before flashing
+ *
+ * LUNs for which this isn't possible are left to the regular patch pass.
+ */
+void Firehose::patch_on_host(const plan::Plan& plan) {
+	std::vector<patch::Region> regions;
+	std::vector<unsigned> partitions;
+	uint64_t sectors;
+	int ret;
+
+	for (auto& patch : plan.patches) {
+		if (!patch.filename || strcmp(patch.filename, "DISK") ||
+			std::find(partitions.begin(), partitions.end(), patch.partition) !=
+				partitions.end())
+			continue;
+
+		partitions.push_back(patch.partition);
+
+		ret = Firehose::disk_sectors(patch.partition, patch.sector_size,
+									 &sectors);
+		if (!ret) {
+			regions.clear();
+			ret = patch::apply_on_host(plan.patches, plan.programs,
+									   patch.partition, sectors, regions);
+		}
+
+		if (ret < 0) {
+			logger::info("[PATCH] LUN %u patched by the device: %s",
+						 patch.partition, strerror(-ret));
+			continue;
+		}
+
+		logger::info("[PATCH] LUN %u patched on the host, %zu images",
+					 patch.partition, regions.size());
+
+		host_partitions.push_back(patch.partition);
+		for (auto& region : regions)
+			host_regions.push_back(std::move(region));
+	}
+}
+
+Firehose::~Firehose() {
+	xmlNode* nodes;
+	xmlNode* node;
+
+	reader.stop();
+
+	/* Logs that arrived after the last response */
+	while (reader.pop(&nodes, 0) != -ETIMEDOUT) {
+		if (!nodes)
+			continue;
+
+		for (node = nodes; node; node = node->next)
+			if (xmlStrcmp(node->name, (xmlChar*)"log") == 0)
+				Firehose::response_log(node);
+
+		xmlFreeDoc(nodes->doc);
+	}
+}
+
+/**
+ * check_layout() - tell whether the programmer sees the LUNs flashed by
+ * @plan as just provisioned
+ *
+ * Returns 0 if each has its provisioned size, give or take the rounding to
+ * allocation units, negative errno otherwise.
+ */
+int Firehose::check_layout(const plan::Plan& plan) {
+	std::vector<unsigned> checked;
+	uint64_t expected;
+	uint64_t sectors;
+	uint64_t bytes;
+	int ret;
+
+	for (auto& program : plan.programs) {
+		if (std::find(checked.begin(), checked.end(), program.partition) !=
+			checked.end())
+			continue;
+		checked.push_back(program.partition);
+
+		ret = Firehose::disk_sectors(program.partition, program.sector_size,
+									 &sectors);
+		if (ret < 0)
+			return ret;
+
+		for (auto& body : plan.ufs.bodies) {
+			if (body.LUNum != program.partition || !body.size_in_kb ||
+				body.LUNum == plan.ufs.epilogue->LUNtoGrow)
+				continue;
+
+			expected = (uint64_t)body.size_in_kb * 1024;
+			bytes = sectors * program.sector_size;
+			if (bytes < expected || bytes > expected + expected / 64) {
+				logger::info("[UFS] LUN %u has %llu kB, %u kB provisioned",
+							 body.LUNum, (unsigned long long)bytes / 1024,
+							 body.size_in_kb);
+				return -ESTALE;
+			}
+		}
+	}
+
+	return 0;
+}
+
+int Firehose::run(const plan::Plan& plan, prefetch::Prefetcher* prefetch) {
+	const char* storage = options.storage;
+	bool configured = false;
 	int bootable;
 	int ret;
 
-	/* Wait for the firehose payload to boot */
-	sleep(3);
+	if (usb.duplex())
+		reader.start(usb, options.debug);
 
-	Firehose::read(1000, NULL);
+	if (phase)
+		phase("ready");
+	ret = Firehose::wait_ready(FIREHOSE_READY_TIMEOUT);
+	if (ret)
+		return ret;
 
-	if (ufs::need_provisioning()) {
+	if (ufs::need_provisioning(plan.ufs) && !provisioned) {
+		if (phase)
+			phase("configure");
 		ret = Firehose::configure(true, storage);
 		if (ret)
 			return ret;
-		ret = ufs::provisioning_execute(this);
+		report.configure_ms = report.elapsed_ms();
+		if (phase)
+			phase("ufs");
+		ret = ufs::provisioning_execute(plan.ufs, this);
+		/* The LUNs may be laid out differently now */
+		if (history)
+			history->clear();
 		if (!ret)
-			std::cout << "UFS provisioning succeeded" << std::endl;
+			logger::info("UFS provisioning succeeded");
 		else
-			std::cout << "UFS provisioning failed" << std::endl;
-		return ret;
+			logger::info("UFS provisioning failed");
+		if (ret || !options.flash_after_provisioning ||
+			plan.programs.empty()) {
+			report.print();
+			return ret;
+		}
+
+		/* Carry on if the programmer already uses the new layout */
+		if (phase)
+			phase("configure");
+		ret = Firehose::configure(false, storage);
+		if (!ret)
+			ret = Firehose::check_layout(plan);
+		if (ret) {
+			logger::info("[UFS] restarting the device for the new layout");
+			if (phase)
+				phase("reset");
+			Firehose::reset();
+			return -ERESTART;
+		}
+		configured = true;
 	}
 
-	ret = Firehose::configure(false, storage);
-	if (ret)
-		return ret;
+	if (!configured) {
+		if (phase)
+			phase("configure");
+		ret = Firehose::configure(false, storage);
+		if (ret)
+			return ret;
+		report.configure_ms = report.elapsed_ms();
+	}
 
-	ret = program::execute(this, incdir);
+	if (options.host_patch)
+		Firehose::patch_on_host(plan);
+
+	this->prefetch = prefetch;
+	if (phase)
+		phase("program");
+	ret = program::execute(plan.programs, this, options.direct_io, prefetch,
+						   shared);
 	if (ret)
 		return ret;
 
-	ret = patch::execute(this);
+	if (phase)
+		phase("patch");
+	ret = patch::execute(plan.patches, this);
 	if (ret)
 		return ret;
 
-	bootable = program::find_bootable_partition();
+	bootable = program::find_bootable_partition(plan.programs);
 	if (bootable < 0)
-		std::cerr << "no boot partition found" << std::endl;
+		logger::warn("no boot partition found");
 	else
 		Firehose::set_bootable(bootable);
 
-	Firehose::reset();
+	if (options.no_reset) {
+		logger::info("[FIREHOSE] leaving the programmer running");
+	} else {
+		if (phase)
+			phase("reset");
+		Firehose::reset();
+	}
+
+	report.print();
 
 	return 0;
 }
@@ -0,0 +1,289 @@
+#include "history.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "digest.h"
+#include "image.h"
+#include "logger.h"
+#include "sha256.h"
+
+namespace history {
+
+#define HISTORY_MAGIC "qdl-history 1"
+
+/* Numeric start sector of @record, false for an expression */
+static bool start_of(const std::string& start_sector, uint64_t* start) {
+	char* end;
+
+	*start = strtoull(start_sector.c_str(), &end, 10);
+
+	return !start_sector.empty() && !*end;
+}
+
+/* Whether @record covers any of the @sectors written by @program */
+static bool overlaps(const Record& record,
+					 const program::Program& program,
+					 uint64_t sectors) {
+	uint64_t first;
+	uint64_t start;
+
+	if (record.partition != program.partition)
+		return false;
+	if (record.start_sector == program.start_sector)
+		return true;
+
+	/* Ranges relative to the end of the disk can't be compared */
+	if (!start_of(record.start_sector, &first) ||
+		!start_of(program.start_sector, &start))
+		return true;
+
+	first *= record.sector_size;
+	start *= program.sector_size;
+
+	return first < start + sectors * program.sector_size &&
+		   start < first + record.sectors * record.sector_size;
+}
+
+/**
+ * open() - load the history of the device with @serial from @dir
+ *
+ * Returns 0 on success, negative errno if the history exists but can't be
+ * read. A device without history starts with an empty one.
+ */
+int History::open(const char* dir, uint32_t serial) {
+	char line[1024];
+	char start[256];
+	char prints[768];
+	Record record;
+	char* save;
+	char* print;
+	FILE* fp;
+	int ret;
+
+	snprintf(line, sizeof(line), "/%08" PRIx32, serial);
+	file = std::string(dir) + line;
+	records.clear();
+	dirty = false;
+
+	mkdir(dir, 0755);
+
+	fp = fopen(file.c_str(), "r");
+	if (!fp) {
+		if (errno == ENOENT)
+			return 0;
+
+		ret = -errno;
+		logger::error("[HISTORY] unable to read %s: %s", file.c_str(),
+					  strerror(errno));
+		file.clear();
+		return ret;
+	}
+
+	if (!fgets(line, sizeof(line), fp) ||
+		strncmp(line, HISTORY_MAGIC "\n", sizeof(line))) {
+		logger::warn("[HISTORY] ignoring %s, unknown format", file.c_str());
+		fclose(fp);
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%u %u %255s %" SCNu64 " %767s", &record.partition,
+				   &record.sector_size, start, &record.sectors, prints) != 5 ||
+			!record.sector_size) {
+			logger::warn("[HISTORY] %s: ignoring malformed line",
+						 file.c_str());
+			continue;
+		}
+
+		/* Comma separated */
+		record.start_sector = start;
+		record.fingerprints.clear();
+		for (print = strtok_r(prints, ",", &save); print;
+			 print = strtok_r(NULL, ",", &save))
+			record.fingerprints.push_back(print);
+		records.push_back(record);
+	}
+	fclose(fp);
+
+	logger::info("[HISTORY] device %08" PRIx32 ": %zu partitions recorded",
+				 serial, records.size());
+
+	return 0;
+}
+
+/**
+ * unchanged() - tell whether the @sectors of @program were last written
+ * with an image of one of the @fingerprints
+ */
+bool History::unchanged(const program::Program& program,
+						uint64_t sectors,
+						const std::vector<std::string>& fingerprints) const {
+	for (auto& record : records) {
+		if (record.partition != program.partition ||
+			record.sector_size != program.sector_size ||
+			record.start_sector != program.start_sector ||
+			record.sectors != sectors)
+			continue;
+
+		for (auto& fingerprint : fingerprints)
+			for (auto& recorded : record.fingerprints)
+				if (recorded == fingerprint)
+					return true;
+	}
+
+	return false;
+}
+
+/**
+ * forget() - drop the records overlapping the @sectors about to be written
+ * by @program, on disk right away
+ *
+ * Returns 0 on success, negative errno if the history couldn't be updated.
+ */
+int History::forget(const program::Program& program, uint64_t sectors) {
+	size_t kept = 0;
+	size_t i;
+
+	for (i = 0; i < records.size(); i++) {
+		if (overlaps(records[i], program, sectors))
+			continue;
+		if (kept != i)
+			records[kept] = std::move(records[i]);
+		kept++;
+	}
+
+	if (kept == records.size())
+		return 0;
+
+	records.resize(kept);
+	dirty = true;
+
+	return History::save();
+}
+
+/**
+ * record() - remember that @program wrote @sectors of the image with
+ * @fingerprints, saved with the next save()
+ */
+void History::record(const program::Program& program,
+					 uint64_t sectors,
+					 const std::vector<std::string>& fingerprints) {
+	History::forget(program, sectors);
+
+	records.push_back({program.partition, program.sector_size,
+					   program.start_sector, sectors, fingerprints});
+	dirty = true;
+}
+
+/**
+ * clear() - forget everything, as after reprovisioning the storage
+ */
+int History::clear() {
+	if (records.empty())
+		return 0;
+
+	records.clear();
+	dirty = true;
+
+	return History::save();
+}
+
+/**
+ * save() - write the history back, if it changed
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int History::save() {
+	std::string tmp = file + ".XXXXXX";
+	std::string prints;
+	bool ok = true;
+	FILE* fp;
+	int ret;
+	int fd;
+
+	if (!dirty || file.empty())
+		return 0;
+
+	fd = mkstemp(&tmp[0]);
+	if (fd < 0) {
+		ret = -errno;
+		logger::error("[HISTORY] unable to write %s: %s", file.c_str(),
+					  strerror(errno));
+		return ret;
+	}
+	fchmod(fd, 0644);
+
+	fp = fdopen(fd, "w");
+	ok &= fprintf(fp, HISTORY_MAGIC "\n") > 0;
+	for (auto& record : records) {
+		prints.clear();
+		for (auto& print : record.fingerprints)
+			prints += (prints.empty() ? "" : ",") + print;
+
+		ok &= fprintf(fp, "%u %u %s %" PRIu64 " %s\n", record.partition,
+					  record.sector_size, record.start_sector.c_str(),
+					  record.sectors, prints.c_str()) > 0;
+	}
+	ok &= fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+	ok &= fclose(fp) == 0;
+
+	if (!ok || rename(tmp.c_str(), file.c_str()) < 0) {
+		unlink(tmp.c_str());
+		logger::error("[HISTORY] unable to write %s", file.c_str());
+		return -EIO;
+	}
+
+	dirty = false;
+
+	return 0;
+}
+
+/**
+ * fingerprints() - the fingerprints of the image at @path, best first
+ *
+ * The digest is only known once the digest cache hashed the image; all are
+ * returned, and recorded, so a later run matches either way.
+ */
+std::vector<std::string> fingerprints(const char* path) {
+	std::vector<std::string> out;
+	uint8_t sum[SHA256_DIGEST_SIZE];
+	digest::Sum id;
+	image::Stamp stamp;
+	Sha256 sha;
+
+	auto entry = digest::find(path);
+	if (entry)
+		out.push_back("sha256:" + digest::hex(entry->file));
+
+	if (image::stamp(path, stamp) == 0) {
+		sha.update(path, strlen(path));
+		sha.update(&stamp, sizeof(stamp));
+		sha.final(sum);
+		std::copy(sum, sum + sizeof(sum), id.begin());
+		out.push_back("file:" + digest::hex(id));
+	}
+
+	return out;
+}
+
+/**
+ * fingerprint() - the fingerprint of contents built in memory
+ */
+std::string fingerprint(const std::vector<char>& data) {
+	digest::Sum sum;
+	Sha256 sha;
+
+	sha.update(data.data(), data.size());
+	sha.final(sum.data());
+
+	return "data:" + digest::hex(sum);
+}
+
+}  // namespace history
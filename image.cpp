@@ -0,0 +1,319 @@
+/*
+ * Image sources
+ *
+ * Images are normally read through the page cache. When flashing many
+ * devices with different builds that evicts everything else on the host,
+ * so reads can instead bypass the cache using O_DIRECT. Direct reads need
+ * the buffer, the file offset and the length aligned; the chunk requested
+ * is widened to aligned boundaries and the caller is handed a pointer into
+ * the middle of the buffer. Filesystems rejecting O_DIRECT fall back to
+ * buffered reads.
+ */
+#include "image.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "archive.h"
+#include "logger.h"
+#include "lru.h"
+
+#define ROUND_UP(x, a) (((x) + (a)-1) & ~((a)-1))
+
+namespace image {
+
+/* Idle buffers kept around for reuse, by size */
+#define POOL_MAX_IDLE 8
+
+static std::mutex pool_lock;
+static std::multimap<size_t, char*> pool;
+
+static void release(size_t size, char* buf) {
+	std::lock_guard<std::mutex> guard(pool_lock);
+
+	if (pool.size() >= POOL_MAX_IDLE) {
+		free(buf);
+		return;
+	}
+
+	pool.emplace(size, buf);
+}
+
+/**
+ * alloc() - allocate an aligned buffer from the pool
+ * @size:	size of the buffer, rounded up to the alignment
+ *
+ * The buffer returns to the pool once the last reference is dropped.
+ */
+std::shared_ptr<char> alloc(size_t size) {
+	void* buf = NULL;
+
+	size = ROUND_UP(size, (size_t)IMAGE_DIRECT_ALIGN);
+
+	{
+		std::lock_guard<std::mutex> guard(pool_lock);
+		auto it = pool.find(size);
+		if (it != pool.end()) {
+			buf = it->second;
+			pool.erase(it);
+		}
+	}
+
+	if (!buf && posix_memalign(&buf, IMAGE_DIRECT_ALIGN, size))
+		return nullptr;
+
+	return std::shared_ptr<char>((char*)buf,
+								 [size](char* p) { release(size, p); });
+}
+
+/* Open image file, shared by all sources reading it when cached */
+struct Handle {
+	Handle(int fd, const Stamp& id, bool direct)
+		: fd(fd), id(id), direct(direct) {}
+	~Handle() { close(fd); }
+
+	int fd;
+	Stamp id;
+	std::atomic<bool> direct;
+};
+
+static Lru<std::string, Handle> handles(0);
+static std::atomic<size_t> handles_max;
+
+static void stamp_fd(const struct stat& sb, Stamp& out) {
+	out.dev = sb.st_dev;
+	out.ino = sb.st_ino;
+	out.size = sb.st_size;
+	out.mtime_ns = sb.st_mtim.tv_sec * 1000000000LL + sb.st_mtim.tv_nsec;
+}
+
+/**
+ * stamp() - get the identity of the file at @path
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int stamp(const char* path, Stamp& out) {
+	std::string member;
+	std::string file;
+	struct stat sb;
+	int ret;
+
+	/* Members of an archive are as current as the archive */
+	if (stat(path, &sb) < 0) {
+		ret = -errno;
+		if (archive::split(path, file, member))
+			return stamp(file.c_str(), out);
+		return ret;
+	}
+
+	stamp_fd(sb, out);
+
+	return 0;
+}
+
+class File : public Source {
+   public:
+	File(const char* path, std::shared_ptr<Handle> handle)
+		: path(path), handle(std::move(handle)) {}
+
+	uint64_t size() const { return handle->id.size; }
+	ssize_t read(uint64_t offset, size_t len, const char** data);
+
+   private:
+	int reserve(size_t len);
+	ssize_t fill(uint64_t offset, size_t len, bool direct);
+
+	const char* path;
+	std::shared_ptr<Handle> handle;
+
+	std::shared_ptr<char> buf;
+	size_t buf_size = 0;
+};
+
+int File::reserve(size_t len) {
+	if (len <= buf_size)
+		return 0;
+
+	buf = alloc(len);
+	if (!buf) {
+		buf_size = 0;
+		return -ENOMEM;
+	}
+	buf_size = ROUND_UP(len, (size_t)IMAGE_DIRECT_ALIGN);
+
+	return 0;
+}
+
+/* Read up to @len bytes at @offset to the start of the buffer */
+ssize_t File::fill(uint64_t offset, size_t len, bool direct) {
+	size_t got = 0;
+	ssize_t n;
+
+	while (got < len) {
+		n = pread(handle->fd, buf.get() + got, len - got, offset + got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		if (n == 0)
+			break;
+		got += n;
+
+		/* Direct reads only come up short at the end of the file */
+		if (direct)
+			break;
+	}
+
+	return got;
+}
+
+ssize_t File::read(uint64_t offset, size_t len, const char** data) {
+	bool direct = handle->direct;
+	uint64_t start = offset;
+	size_t head = 0;
+	size_t span = len;
+	ssize_t n;
+	int ret;
+
+	/* Aligned reads are valid buffered too, in case another user of the
+	 * handle falls back in the meantime */
+	if (direct) {
+		start = offset & ~(uint64_t)(IMAGE_DIRECT_ALIGN - 1);
+		head = offset - start;
+		span = ROUND_UP(head + len, (size_t)IMAGE_DIRECT_ALIGN);
+	}
+
+	ret = reserve(span);
+	if (ret < 0)
+		return ret;
+
+	n = fill(start, span, direct);
+	if (n == -EINVAL && direct) {
+		logger::info("[IMAGE] direct I/O rejected for %s, using buffered reads",
+					 path);
+		fcntl(handle->fd, F_SETFL, fcntl(handle->fd, F_GETFL) & ~O_DIRECT);
+		handle->direct = false;
+		return read(offset, len, data);
+	}
+	if (n < 0)
+		return n;
+
+	/* Image data in the chunk, the rest is padding */
+	n = (size_t)n > head ? std::min<size_t>(n - head, len) : 0;
+	memset(buf.get() + head + n, 0, len - n);
+
+	*data = buf.get() + head;
+
+	return n;
+}
+
+ssize_t Memory::read(uint64_t offset, size_t len, const char** out) {
+	size_t n;
+
+	if (offset + len <= data->size()) {
+		*out = data->data() + offset;
+		return len;
+	}
+
+	/* The end of the data, padded with zeroes */
+	n = offset < data->size() ? data->size() - offset : 0;
+	tail.assign(len, 0);
+	if (n)
+		memcpy(tail.data(), data->data() + offset, n);
+
+	*out = tail.data();
+
+	return n;
+}
+
+static std::shared_ptr<Handle> open_handle(const char* path, bool direct) {
+	struct stat sb;
+	Stamp id;
+	int fd = -1;
+
+	if (direct) {
+		fd = ::open(path, O_RDONLY | O_DIRECT);
+		if (fd < 0 && errno == EINVAL)
+			logger::info(
+				"[IMAGE] direct I/O not supported for %s, using buffered "
+				"reads",
+				path);
+		if (fd < 0)
+			direct = false;
+	}
+
+	if (fd < 0)
+		fd = ::open(path, O_RDONLY);
+	if (fd < 0)
+		return nullptr;
+
+	if (fstat(fd, &sb) < 0) {
+		close(fd);
+		return nullptr;
+	}
+
+	stamp_fd(sb, id);
+
+	return std::make_shared<Handle>(fd, id, direct);
+}
+
+/**
+ * open() - open an image file
+ * @path:	path of the image
+ * @direct:	bypass the page cache if the filesystem allows it
+ *
+ * Returns the source, or NULL with errno set.
+ *
+ * With the handle cache enabled an already open descriptor is reused as long
+ * as the file at @path is unchanged; all reads are positioned, so sources on
+ * different threads can share it. @path may name a member of an archive, see
+ * archive.h.
+ */
+std::unique_ptr<Source> open(const char* path, bool direct) {
+	std::shared_ptr<Handle> handle;
+	std::string key;
+	Stamp id;
+
+	if (handles_max) {
+		key = std::string(direct ? "D:" : "B:") + path;
+		handle = handles.get(key);
+		if (handle && (stamp(path, id) < 0 || id != handle->id)) {
+			handles.erase(key);
+			handle = nullptr;
+		}
+	}
+
+	if (!handle) {
+		handle = open_handle(path, direct);
+		if (!handle && (errno == ENOENT || errno == ENOTDIR) &&
+			strstr(path, ARCHIVE_SEPARATOR))
+			return archive::open_member(path, direct);
+		if (!handle)
+			return nullptr;
+
+		if (handles_max)
+			handles.put(key, handle);
+	}
+
+	return std::unique_ptr<Source>(new File(path, handle));
+}
+
+/**
+ * set_cache_size() - keep up to @entries image files open for reuse
+ */
+void set_cache_size(size_t entries) {
+	handles.resize(entries);
+	handles_max = entries;
+}
+
+}  // namespace image
@@ -0,0 +1,67 @@
+#pragma once
+
+#ifndef __ARCHIVE_H__
+#define __ARCHIVE_H__
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "image.h"
+
+/*
+ * Build archives
+ *
+ * A tar or zip archive can be given where a directory of images is expected
+ * (--include) and its members are flashed without extracting them. The
+ * member offsets are indexed once per archive; a member is then addressed as
+ * "<archive>!/<member>" and read through image::open() like any file, stored
+ * members straight from the archive and deflated zip members through zlib.
+ * Compressed tarballs can't be read at random and aren't supported.
+ */
+
+#define ARCHIVE_SEPARATOR "!/"
+
+namespace archive {
+
+struct Entry {
+	std::string name;
+	/* Offset of the data in the archive, its size and size as stored */
+	uint64_t offset;
+	uint64_t size;
+	uint64_t csize;
+	bool deflated;
+};
+
+class Archive {
+   public:
+	const Entry* find(const char* name) const;
+	const std::vector<Entry>& entries() const { return members; }
+	const char* path() const { return file.c_str(); }
+
+	void add(Entry entry);
+
+   private:
+	friend std::shared_ptr<const Archive> open(const char* path);
+
+	std::string file;
+	image::Stamp id;
+	std::vector<Entry> members;
+	/* Index in @members by name, and by the name without directories */
+	std::unordered_map<std::string, size_t> names;
+	std::unordered_map<std::string, size_t> basenames;
+};
+
+std::shared_ptr<const Archive> open(const char* path);
+bool split(const char* path, std::string& file, std::string& member);
+int locate(const char* path,
+		   std::shared_ptr<const Archive>& archive,
+		   const Entry** entry);
+std::string resolve(const std::vector<const char*>& incdirs, const char* name);
+std::unique_ptr<image::Source> open_member(const char* path, bool direct);
+
+}  // namespace archive
+
+#endif
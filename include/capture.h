@@ -0,0 +1,128 @@
+#pragma once
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "transport.h"
+
+/*
+ * Wire capture
+ *
+ * A Recorder sits between the protocol code and the real transport and logs
+ * every bulk transfer to a file: direction, time since the start of the
+ * capture, result and payload. Payloads larger than CAPTURE_INLINE_MAX, in
+ * practice image data, are stored as a 64-bit hash to keep captures small
+ * and cheap to write. Records are queued and written by a background thread.
+ *
+ * Reads and writes are recorded in the order the protocol code issued them,
+ * so the Recorder doesn't offer a duplex transport (see duplex.h) even if
+ * the device does.
+ *
+ * A Player reads a capture back and acts as the device: reads return the
+ * recorded responses, writes are checked against the recorded payloads. It
+ * can pace the responses like the original device or answer immediately.
+ *
+ * The file starts with CAPTURE_MAGIC followed by Record headers, each one
+ * followed by @length bytes of payload, all in host byte order.
+ */
+
+#define CAPTURE_MAGIC "QDLCAP1"
+#define CAPTURE_INLINE_MAX 4096
+
+namespace capture {
+
+enum : uint8_t {
+	DIR_OUT = 0,
+	DIR_IN = 1,
+};
+
+enum : uint8_t {
+	/* The payload is the hash of the transferred data */
+	FLAG_HASHED = 1,
+};
+
+struct Record {
+	uint64_t time_ns;
+	/* Bytes transferred, or negative errno */
+	int32_t result;
+	/* Bytes of payload following the record */
+	uint32_t length;
+	uint8_t dir;
+	uint8_t flags;
+	uint8_t reserved[6];
+};
+
+uint64_t hash(const void* buf, size_t len);
+
+class Recorder : public Transport {
+   public:
+	explicit Recorder(Transport& inner) : inner(inner) {}
+	~Recorder();
+
+	int open(const char* path);
+
+	int read(void* buf, size_t len, unsigned int timeout) override;
+	int write(const void* buf, size_t len, bool eot) override;
+	int recover(bool reset) override { return inner.recover(reset); }
+	int reconnect(unsigned timeout) override {
+		return inner.reconnect(timeout);
+	}
+
+   private:
+	void record(uint8_t dir, int result, const void* buf, size_t len);
+	void writer();
+
+	Transport& inner;
+	FILE* fp = NULL;
+	std::chrono::steady_clock::time_point start;
+
+	std::mutex lock;
+	std::condition_variable cond;
+	std::deque<std::vector<char>> queue;
+	bool stop = false;
+
+	std::thread thread;
+};
+
+class Player : public Transport {
+   public:
+	int open(const char* path, bool realtime);
+
+	int read(void* buf, size_t len, unsigned int timeout) override;
+	int write(const void* buf, size_t len, bool eot) override;
+	/* The capture goes on with the device as it came back */
+	int reconnect(unsigned timeout) override { return 0; }
+
+	/* Writes not matching the capture, and the first one of them */
+	unsigned mismatches = 0;
+	size_t first_mismatch = 0;
+	/* Records not consumed by the replayed session */
+	size_t remaining() const { return records.size() - pos; }
+
+   private:
+	struct Entry {
+		Record rec;
+		std::vector<char> payload;
+	};
+
+	void pace(const Record& rec);
+
+	std::vector<Entry> records;
+	size_t pos = 0;
+	bool realtime = false;
+	std::chrono::steady_clock::time_point last;
+};
+
+}  // namespace capture
+
+#endif
@@ -0,0 +1,57 @@
+#pragma once
+
+#ifndef __DIGEST_H__
+#define __DIGEST_H__
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "image.h"
+#include "sha256.h"
+
+/*
+ * Image digest cache
+ *
+ * SHA-256 digests of every DIGEST_CHUNK_SIZE chunk of an image, plus a
+ * digest of the whole image, keyed by the identity of the file (device,
+ * inode, size and modification time). The whole image digest is the SHA-256
+ * of the chunk digests, so that all chunks can be hashed in parallel; it is
+ * not the same as the output of sha256sum. Archive members are keyed by the
+ * identity of the archive and their offset in it.
+ *
+ * Entries are kept in memory and, with a cache directory set, on disk, so a
+ * build is hashed once per station rather than once per run.
+ */
+
+#define DIGEST_CHUNK_SIZE (1024 * 1024)
+/* Threads hashing next to flashing, leaving the CPUs to the sessions */
+#define DIGEST_BACKGROUND_WORKERS 2
+
+namespace digest {
+
+using Sum = std::array<uint8_t, SHA256_DIGEST_SIZE>;
+
+struct Entry {
+	image::Stamp id;
+	/* Offset of an archive member in the archive, 0 for a file */
+	uint64_t offset = 0;
+	Sum file;
+	std::vector<Sum> chunks;
+};
+
+void set_dir(const char* path);
+std::string dir();
+std::shared_ptr<const Entry> find(const char* path);
+int fill(const std::vector<const char*>& paths,
+		 unsigned workers,
+		 bool direct = false,
+		 const std::atomic<bool>* stop = NULL);
+std::string hex(const Sum& sum);
+
+}  // namespace digest
+
+#endif
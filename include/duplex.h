@@ -0,0 +1,67 @@
+#pragma once
+
+#ifndef __DUPLEX_H__
+#define __DUPLEX_H__
+
+#include <libxml/tree.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "transport.h"
+
+/*
+ * Full-duplex Firehose receive path
+ *
+ * A Reader keeps a read posted on the IN endpoint at all times from its own
+ * thread, splits what arrives into <data> packets, parses them and queues
+ * them for the protocol code. The device can thereby send its logs while a
+ * large program transfer is going on instead of stalling on them, and an
+ * ACK is picked up as soon as it arrives rather than on the next poll.
+ *
+ * Only used with transports that allow reads concurrent with writes, see
+ * Transport::duplex().
+ */
+
+#define DUPLEX_POLL_MS 100
+
+namespace duplex {
+
+class Reader {
+   public:
+	~Reader();
+
+	void start(Transport& usb, bool debug);
+	void stop();
+	bool running() const { return thread.joinable(); }
+
+	int pop(xmlNode** nodes, unsigned timeout);
+
+   private:
+	struct Packet {
+		/* First child node of the <data>, NULL if it didn't parse */
+		xmlNode* nodes;
+		int error;
+	};
+
+	void reader();
+
+	Transport* usb = nullptr;
+	bool debug = false;
+	char prefix[64];
+
+	std::mutex lock;
+	std::condition_variable cond;
+	std::deque<Packet> queue;
+	/* Transport error that stopped the reader, as negative errno */
+	int error = 0;
+	bool quit = false;
+
+	std::thread thread;
+};
+
+}  // namespace duplex
+
+#endif
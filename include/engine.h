@@ -0,0 +1,110 @@
+#pragma once
+
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+#include <ucontext.h>
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "qdl.h"
+#include "transport.h"
+
+struct usbdevfs_urb;
+
+/*
+ * Single threaded protocol engine
+ *
+ * Each session runs as a coroutine with its own small stack. The protocol
+ * code is unchanged: where it would block in a USB transfer, engine::Usb
+ * submits asynchronous URBs and switches back to the engine, whose epoll
+ * loop reaps completed URBs from all devices and resumes the sessions they
+ * belong to. One thread thereby drives any number of devices, with memory
+ * bounded by the coroutine stacks and the transfers in flight.
+ *
+ * Sessions run in an engine must not block on anything but transfers; in
+ * particular topology scheduling (see topology.h) is not available.
+ */
+
+namespace engine {
+
+using clock = std::chrono::steady_clock;
+
+struct Fiber;
+
+/* Transfers a coroutine waits for */
+struct Wait {
+	Fiber* fiber = nullptr;
+	Qdl* usb = nullptr;
+	std::vector<usbdevfs_urb*> urbs;
+	unsigned pending = 0;
+	int status = 0;
+	size_t actual = 0;
+	clock::time_point deadline;
+	bool expired = false;
+};
+
+class Engine {
+   public:
+	Engine();
+	Engine(const Engine&) = delete;
+	Engine& operator=(const Engine&) = delete;
+	~Engine();
+
+	void spawn(const char* name, std::function<void()> fn);
+	int run();
+
+	/* For engine::Usb, from within a coroutine */
+	int add(Qdl& usb);
+	void remove(Qdl& usb);
+	void wait(Wait& wait, unsigned timeout);
+	void sleep(unsigned ms);
+
+   private:
+	void resume(Fiber* fiber);
+	void reap(Qdl* usb);
+	int next_timeout();
+	void expire();
+
+	int epfd;
+	ucontext_t main;
+	Fiber* running = nullptr;
+	std::vector<std::unique_ptr<Fiber>> fibers;
+	std::vector<Wait*> waiting;
+	std::map<int, Qdl*> devices;
+
+	friend void trampoline();
+};
+
+/* Transport over a Qdl device, for sessions running in an Engine */
+class Usb : public Transport {
+   public:
+	Usb(Engine& engine, Qdl& usb);
+	~Usb();
+
+	int read(void* buf, size_t len, unsigned int timeout) override;
+	int write(const void* buf, size_t len, bool eot) override;
+	int recover(bool reset) override { return usb.recover(reset); }
+	int reconnect(unsigned timeout) override;
+
+	/* Wait @ms, letting the other coroutines run */
+	void sleep(unsigned ms) { engine.sleep(ms); }
+
+   private:
+	int transfer(bool in, void* buf, size_t len, bool eot, unsigned timeout);
+
+	Engine& engine;
+	Qdl& usb;
+	int registered;
+	std::vector<std::unique_ptr<usbdevfs_urb>> urbs;
+};
+
+}  // namespace engine
+
+#endif
@@ -0,0 +1,113 @@
+#pragma once
+
+#ifndef __FANOUT_H__
+#define __FANOUT_H__
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "image.h"
+#include "plan.h"
+#include "prefetch.h"
+
+/*
+ * Read-once image fan-out
+ *
+ * When a batch of devices is flashed with the same plan, each session joins
+ * a Group and reads the images through its Reader. Every block of
+ * FANOUT_BLOCK_SIZE is read from disk once into a reference counted buffer
+ * that all sessions flashing that image consume, and dropped once the last
+ * of them moved past it.
+ *
+ * The sessions may run apart by at most FANOUT_WINDOW blocks, counting those
+ * that haven't got to the image yet. The one ahead waits for the others up
+ * to the stall time, then detaches those still lagging, which continue with
+ * a private reader of their own. So do sessions that get to an image after
+ * its beginning was dropped.
+ */
+
+#define FANOUT_BLOCK_SIZE (1024 * 1024)
+#define FANOUT_WINDOW 64
+#define FANOUT_STALL_MS 2000
+#define FANOUT_POLL_MS 2
+
+namespace fanout {
+
+struct Block;
+struct Stream;
+class Group;
+class Member;
+
+/* One session's membership of a Group */
+class Reader {
+   public:
+	explicit Reader(Group& group) : group(group) {}
+	Reader(const Reader&) = delete;
+	Reader& operator=(const Reader&) = delete;
+	~Reader();
+
+	std::unique_ptr<image::Source> open(const char* path);
+
+   private:
+	Group& group;
+};
+
+class Group {
+   public:
+	using pause_fn = std::function<void(unsigned ms)>;
+
+	explicit Group(bool direct, unsigned stall_ms = FANOUT_STALL_MS)
+		: direct(direct), stall_ms(stall_ms) {}
+	Group(const Group&) = delete;
+	Group& operator=(const Group&) = delete;
+
+	std::unique_ptr<Reader> join();
+	void prefetch(std::shared_ptr<const plan::Plan> plan, size_t budget);
+	void set_pause(pause_fn pause) { this->pause = std::move(pause); }
+	void report();
+
+   private:
+	friend class Member;
+	friend class Reader;
+
+	std::unique_ptr<image::Source> open(const Reader* reader,
+										const char* path);
+	std::shared_ptr<const Block> get(Stream& stream,
+									 uint64_t index,
+									 std::unique_lock<std::mutex>& guard);
+	unsigned pending(const Stream& stream) const;
+	uint64_t position(const Stream& stream, const Member* member) const;
+	uint64_t needed(const Stream& stream) const;
+	void evict(Stream& stream);
+	void wait(std::unique_lock<std::mutex>& guard);
+
+	bool direct;
+	unsigned stall_ms;
+	/* How a session waits for the others, instead of blocking the thread */
+	pause_fn pause;
+
+	std::mutex lock;
+	std::condition_variable cond;
+	std::vector<const Reader*> readers;
+	std::map<std::string, std::shared_ptr<Stream>> streams;
+
+	/* Read ahead of the shared reads, which consume it */
+	std::shared_ptr<const plan::Plan> plan;
+	prefetch::Prefetcher prefetcher;
+
+	/* Bytes read from disk, bytes handed out, sessions detached */
+	uint64_t loaded = 0;
+	uint64_t served = 0;
+	unsigned detached = 0;
+};
+
+}  // namespace fanout
+
+#endif
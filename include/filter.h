@@ -0,0 +1,56 @@
+#pragma once
+
+#ifndef __FILTER_H__
+#define __FILTER_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "plan.h"
+#include "program.h"
+
+/*
+ * Partition filters
+ *
+ * --only and --skip take comma separated terms, each one of:
+ *
+ *	<N>		a physical partition (LUN) number
+ *	_<suffix>	an A/B slot, matching labels ending in it, e.g. _a
+ *	<glob>		a label, with fnmatch(3) wildcards
+ *
+ * A program is flashed when it matches any --only term, if there are any,
+ * and no --skip term. The terms are compiled once into a Matcher, which is
+ * applied to the plan as it's loaded: the patches of a LUN are kept only if
+ * the GPT images they fix up are, so programs and patches agree.
+ */
+
+/* What --firmware skips: the OS partitions, leaving the firmware */
+#define FILTER_FIRMWARE "system,cust,userdata,keystore,boot,recovery,sec"
+
+namespace filter {
+
+struct Term {
+	enum { PARTITION, SLOT, LABEL, GLOB } kind;
+	std::string text;
+	unsigned partition;
+};
+
+class Matcher {
+   public:
+	int compile(const std::vector<const char*>& only,
+				const std::vector<const char*>& skip);
+	bool empty() const { return only.empty() && skip.empty(); }
+	bool keep(const program::Program& program) const;
+
+   private:
+	std::vector<Term> only;
+	std::vector<Term> skip;
+};
+
+std::shared_ptr<const plan::Plan> apply(const Matcher& matcher,
+										std::shared_ptr<const plan::Plan> plan);
+
+}  // namespace filter
+
+#endif
@@ -1,25 +1,49 @@
 #pragma once
 
+#include <libxml/tree.h>
+
 #include <functional>
+#include <memory>
+#include <vector>
 
+#include "duplex.h"
+#include "fanout.h"
+#include "history.h"
+#include "image.h"
 #include "patch.h"
+#include "personalize.h"
+#include "plan.h"
+#include "prefetch.h"
 #include "program.h"
-#include "qdl.h"
+#include "report.h"
+#include "session.h"
+#include "transport.h"
 #include "ufs.h"
 
-struct Firehose : Qdl,
-				  virtual ufs::ufs_apply,
+struct Firehose : virtual ufs::ufs_apply,
 				  virtual patch::patch_apply,
 				  virtual program::program_apply {
-	int apply_ufs_common(std::shared_ptr<ufs::Common>& common);
-	int apply_ufs_body(std::shared_ptr<ufs::Body>&);
-	int apply_ufs_epilogue(std::shared_ptr<ufs::Epilogue>&, bool commit);
+	Firehose(Transport& usb, const Options& options, Report& report)
+		: usb(usb), options(options), report(report) {}
+	~Firehose();
+
+	int apply_ufs_common(const ufs::Common& common);
+	int apply_ufs_body(const ufs::Body&);
+	int apply_ufs_epilogue(const ufs::Epilogue&, bool commit);
 
-	int apply_patch(std::shared_ptr<patch::Patch>&);
+	int apply_patch(const patch::Patch&);
 
-	int apply_program(std::shared_ptr<program::Program>& program, int fd);
+	int apply_program(const program::Program& program, image::Source& source);
+	std::unique_ptr<image::Source> replace(const program::Program& program);
 
-	int run(const char* incdir, const char* storage);
+	int run(const plan::Plan& plan, prefetch::Prefetcher* prefetch);
+	int disk_sectors(unsigned partition,
+					 unsigned sector_size,
+					 uint64_t* sectors);
+	void patch_on_host(const plan::Plan& plan);
+	int wait_ready(unsigned timeout);
+	int recover(bool reset);
+	int ping(unsigned timeout);
 	int reset();
 	int set_bootable(int part);
 	int send_single_tag(xmlNode* node);
@@ -28,8 +52,60 @@ struct Firehose : Qdl,
 					   bool skip_storage_init,
 					   const char* storage);
 	int write(xmlDoc* doc);
-	int read(int wait, std::function<int(xmlNode*)>);
+	int read(int wait, std::function<int(xmlNode*)>, bool quiet = false);
+
+	Session::progress_fn progress;
+	Session::phase_fn phase;
+	/* Images are read through this if set, see fanout.h */
+	fanout::Reader* shared = nullptr;
+	/* Flash history of the device, if known, see history.h */
+	history::History* history = nullptr;
+	/* Contents built for the device, see personalize.h */
+	std::vector<personalize::Contents> personal;
+	/* The storage was provisioned before the device restarted */
+	bool provisioned = false;
 
 	static void response_log(xmlNode* node);
 	static xmlNode* response_parse(const char* buf, size_t len, int* error);
+	static int response_next(const char* buf,
+							 size_t len,
+							 size_t* pos,
+							 xmlNode** nodes);
+
+   private:
+	int receive(xmlNode** nodes, int timeout);
+	int check_layout(const plan::Plan& plan);
+	const personalize::Contents* personalized(
+		const program::Program& program) const;
+	int verify(const program::Program& program,
+			   image::Source& source,
+			   unsigned num_sectors);
+	int program_segment(const program::Program& program,
+						image::Source& source,
+						uint64_t start,
+						unsigned skip,
+						unsigned count,
+						unsigned total);
+
+	Transport& usb;
+	const Options& options;
+	Report& report;
+	prefetch::Prefetcher* prefetch = nullptr;
+
+	size_t max_payload_size = 1048576;
+	/* A <program> was acknowledged and is waiting for its data */
+	bool streaming = false;
+
+	/* Receive path, see duplex.h; without it reads land in rx */
+	duplex::Reader reader;
+	char rx[4096];
+	size_t rx_pos = 0;
+	size_t rx_len = 0;
+
+	/* Called for each <log> in responses, besides logging it */
+	std::function<void(const char*)> log_parser;
+
+	/* GPT images patched on the host, and the LUNs they cover */
+	std::vector<patch::Region> host_regions;
+	std::vector<unsigned> host_partitions;
 };
@@ -0,0 +1,71 @@
+#pragma once
+
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "program.h"
+
+/*
+ * Flash history
+ *
+ * With a history directory, the serial number of each device is read in
+ * Sahara command mode and the directory keeps a file per serial, listing
+ * the partition ranges qdl wrote to that device and a fingerprint of the
+ * image written to each. Programs whose range and image match the history
+ * are skipped without asking the device.
+ *
+ * A range is dropped from the history on disk before it is written, and
+ * recorded again once the programmer acknowledged it, so an interrupted
+ * session never leaves a stale record behind. Changes made by anything else
+ * than qdl, such as the device itself writing to userdata, aren't seen:
+ * --verify-history has the programmer hash the start of each range first,
+ * and --force flashes everything and refreshes the history.
+ *
+ * The fingerprints of an image are its path and file identity and, once
+ * the digest cache has it, see digest.h, its digest. All are recorded, so
+ * a later run matches whether or not the image is hashed by then. Contents
+ * built for the device, see personalize.h, and GPT images patched on the
+ * host, see patch.h, are fingerprinted by their own digest.
+ */
+
+namespace history {
+
+struct Record {
+	unsigned partition;
+	unsigned sector_size;
+	std::string start_sector;
+	uint64_t sectors;
+	std::vector<std::string> fingerprints;
+};
+
+class History {
+   public:
+	int open(const char* dir, uint32_t serial);
+	bool active() const { return !file.empty(); }
+
+	bool unchanged(const program::Program& program,
+				   uint64_t sectors,
+				   const std::vector<std::string>& fingerprints) const;
+	int forget(const program::Program& program, uint64_t sectors);
+	void record(const program::Program& program,
+				uint64_t sectors,
+				const std::vector<std::string>& fingerprints);
+	int clear();
+	int save();
+
+   private:
+	std::string file;
+	std::vector<Record> records;
+	bool dirty = false;
+};
+
+std::vector<std::string> fingerprints(const char* path);
+std::string fingerprint(const std::vector<char>& data);
+
+}  // namespace history
+
+#endif
@@ -0,0 +1,80 @@
+#pragma once
+
+#ifndef __IMAGE_H__
+#define __IMAGE_H__
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/*
+ * Image sources
+ *
+ * apply_program() reads the image data through a Source, which hands out
+ * chunks from a buffer it owns. Data past the end of the image reads as
+ * zeroes, so the last chunk is always padded to whole sectors.
+ */
+
+namespace image {
+
+/* Alignment of direct I/O buffers, offsets and lengths */
+#define IMAGE_DIRECT_ALIGN 4096
+
+std::shared_ptr<char> alloc(size_t size);
+
+class Source {
+   public:
+	virtual ~Source() {}
+
+	virtual uint64_t size() const = 0;
+
+	/**
+	 * read() - read a chunk of the image
+	 * @offset:	byte offset in the image
+	 * @len:	length of the chunk, zero padded past the end of the image
+	 * @data:	receives a pointer to the chunk, valid until the next read
+	 *
+	 * Returns the number of bytes read from the image, or a negative errno.
+	 */
+	virtual ssize_t read(uint64_t offset, size_t len, const char** data) = 0;
+};
+
+/* Source over data held in memory, such as a cached programmer */
+class Memory : public Source {
+   public:
+	explicit Memory(std::shared_ptr<const std::vector<char>> data)
+		: data(std::move(data)) {}
+
+	uint64_t size() const { return data->size(); }
+	ssize_t read(uint64_t offset, size_t len, const char** out);
+
+   private:
+	std::shared_ptr<const std::vector<char>> data;
+	std::vector<char> tail;
+};
+
+/* Identity of a file, to tell whether cached data still matches it */
+struct Stamp {
+	uint64_t dev = 0;
+	uint64_t ino = 0;
+	uint64_t size = 0;
+	int64_t mtime_ns = 0;
+
+	bool operator==(const Stamp& other) const {
+		return dev == other.dev && ino == other.ino && size == other.size &&
+			   mtime_ns == other.mtime_ns;
+	}
+	bool operator!=(const Stamp& other) const { return !(*this == other); }
+};
+
+int stamp(const char* path, Stamp& out);
+
+std::unique_ptr<Source> open(const char* path, bool direct);
+void set_cache_size(size_t entries);
+
+}  // namespace image
+
+#endif
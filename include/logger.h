@@ -0,0 +1,46 @@
+#pragma once
+
+#ifndef __LOGGER_H__
+#define __LOGGER_H__
+
+/*
+ * Non-blocking logging
+ *
+ * Messages are formatted into a lock-free ring buffer by the calling thread
+ * and written out by a background thread, so the protocol loops never wait
+ * for the terminal or the disk. If the ring is full the message is dropped
+ * and counted instead.
+ *
+ * Messages at level info go to stdout, everything else to stderr. With a log
+ * directory configured, messages from threads that have set a device prefix
+ * are written to <dir>/<prefix>.log instead.
+ */
+
+namespace logger {
+
+enum class level {
+	debug,
+	info,
+	notice,
+	warn,
+	error,
+};
+
+void start(const char* log_dir);
+void flush();
+void set_prefix(const char* prefix);
+const char* prefix();
+void set_level(level lvl);
+
+void print(level lvl, const char* fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+void debug(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void info(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void notice(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void warn(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+void error(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+}  // namespace logger
+
+#endif
@@ -0,0 +1,85 @@
+#pragma once
+
+#ifndef __LRU_H__
+#define __LRU_H__
+
+#include <cstddef>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+/*
+ * Thread safe cache of shared objects with least recently used eviction.
+ * Evicting an entry only drops the reference held by the cache, users
+ * holding it keep it alive.
+ */
+template <typename Key, typename Value>
+class Lru {
+   public:
+	explicit Lru(size_t capacity) : capacity(capacity) {}
+
+	std::shared_ptr<Value> get(const Key& key) {
+		std::lock_guard<std::mutex> guard(lock);
+
+		auto it = index.find(key);
+		if (it == index.end())
+			return nullptr;
+
+		entries.splice(entries.begin(), entries, it->second);
+
+		return it->second->second;
+	}
+
+	void put(const Key& key, std::shared_ptr<Value> value) {
+		std::lock_guard<std::mutex> guard(lock);
+
+		auto it = index.find(key);
+		if (it != index.end()) {
+			it->second->second = std::move(value);
+			entries.splice(entries.begin(), entries, it->second);
+			return;
+		}
+
+		entries.emplace_front(key, std::move(value));
+		index.emplace(key, entries.begin());
+
+		evict();
+	}
+
+	void resize(size_t n) {
+		std::lock_guard<std::mutex> guard(lock);
+
+		capacity = n;
+		evict();
+	}
+
+	void erase(const Key& key) {
+		std::lock_guard<std::mutex> guard(lock);
+
+		auto it = index.find(key);
+		if (it == index.end())
+			return;
+
+		entries.erase(it->second);
+		index.erase(it);
+	}
+
+   private:
+	void evict() {
+		while (entries.size() > capacity) {
+			index.erase(entries.back().first);
+			entries.pop_back();
+		}
+	}
+
+	using Entry = std::pair<Key, std::shared_ptr<Value>>;
+
+	size_t capacity;
+	std::mutex lock;
+	std::list<Entry> entries;
+	std::unordered_map<Key, typename std::list<Entry>::iterator> index;
+};
+
+#endif
@@ -0,0 +1,60 @@
+#pragma once
+
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+
+#include <libxml/xmlreader.h>
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace plan {
+struct Plan;
+}
+
+namespace manifest {
+
+enum class type {
+	unknown,
+	patch,
+	program,
+	ufs,
+	contents,
+};
+
+/*
+ * Append-only string storage. Strings handed out stay valid for the lifetime
+ * of the arena, or of the arena they are spliced into.
+ */
+class Arena {
+   public:
+	const char* strdup(const char* s, size_t len);
+	void splice(Arena& other);
+	size_t used() const { return total; }
+
+   private:
+	static constexpr size_t block_size = 16384;
+
+	std::vector<std::unique_ptr<char[]>> blocks;
+	char* cur = nullptr;
+	size_t left = 0;
+	size_t total = 0;
+};
+
+bool has_attr(xmlTextReaderPtr reader, const char* attr);
+unsigned attr_as_unsigned(xmlTextReaderPtr reader,
+						  const char* attr,
+						  int* errors);
+const char* attr_as_string(xmlTextReaderPtr reader,
+						   const char* attr,
+						   int* errors,
+						   Arena& strings);
+
+int load(plan::Plan& plan,
+		 const std::vector<const char*>& files,
+		 bool finalize_provisioning);
+
+}  // namespace manifest
+
+#endif
@@ -1,8 +1,11 @@
 #ifndef __PATCH_H__
 #define __PATCH_H__
 
-#include <memory>
+#include <cstdint>
+#include <vector>
 
+#include "manifest.h"
+#include "program.h"
 #include "qdl.h"
 
 namespace patch {
@@ -16,17 +19,37 @@ struct Patch {
 	const char* start_sector;
 	const char* value;
 	const char* what;
-
-	std::shared_ptr<Patch> next;
 };
 
 struct patch_apply {
-	virtual int apply_patch(std::shared_ptr<Patch>&) = 0;
+	virtual int apply_patch(const Patch&) = 0;
+};
+
+int parse(xmlTextReaderPtr reader,
+		  manifest::Arena& strings,
+		  std::vector<Patch>& patches);
+int execute(const std::vector<Patch>& patches, patch_apply*);
+
+/* In-memory copy of the sectors a program writes, for patching on the host */
+struct Region {
+	const program::Program* program;
+	/* First sector written, and bytes written from @data at @skip */
+	uint64_t start;
+	uint64_t skip;
+	uint64_t length;
+	std::vector<char> data;
 };
 
-int load(const char* patch_file);
-int execute(std::shared_ptr<patch_apply>&);
-int execute(patch_apply*);
+int evaluate(const char* expr,
+			 uint64_t num_disk_sectors,
+			 unsigned sector_size,
+			 const std::vector<Region>& regions,
+			 uint64_t* value);
+int apply_on_host(const std::vector<Patch>& patches,
+				  const std::vector<program::Program>& programs,
+				  unsigned partition,
+				  uint64_t num_disk_sectors,
+				  std::vector<Region>& regions);
 
 }  // namespace patch
 #endif
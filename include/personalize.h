@@ -0,0 +1,91 @@
+#pragma once
+
+#ifndef __PERSONALIZE_H__
+#define __PERSONALIZE_H__
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "program.h"
+
+/*
+ * Per-device personalization
+ *
+ * Partitions holding data unique to each device, such as serial number
+ * blobs, calibration or provisioning keys, are built in memory by each
+ * session and programmed in place of the image named by the manifest,
+ * without writing any file.
+ *
+ * A template describes the contents, one directive per line:
+ *
+ *   partition <label>			following lines build <label>
+ *   base <file>			start from <file> rather than the image of
+ *					the manifest, or zeroes if it has none
+ *   size <bytes>			pad or truncate the contents
+ *   string <offset> <length> <text>	text, padded with NULs to <length>
+ *   u8|u16|u32|u64 <offset> <value>	little endian integer
+ *   hex <offset> <bytes>		bytes given as hex digits
+ *   file <offset> <file>		contents of a file, e.g. a key
+ *   crc32 <offset> <start> <length>	CRC-32 of the bytes built so far
+ *
+ * Directives apply in order; writes past the end grow the contents. Text,
+ * values and file names may refer to ${serial}, the serial number of the
+ * device as 8 hex digits, ${device}, its USB device, and to variables given
+ * with --var NAME=VALUE. Relative file names are taken from the directory of
+ * the template. Lines starting with '#' are comments.
+ *
+ * Library users can build or amend the contents with Session::on_personalize
+ * instead.
+ */
+
+namespace personalize {
+
+using Vars = std::map<std::string, std::string>;
+
+struct Field {
+	enum Kind { STRING, INTEGER, HEX, FILE, CRC32 } kind;
+	uint64_t offset;
+	/* Bytes of a STRING or INTEGER, or hashed by CRC32 from @start */
+	uint64_t length;
+	uint64_t start;
+	std::string value;
+	unsigned line;
+};
+
+struct Partition {
+	std::string label;
+	std::string base;
+	/* Size of the contents, 0 to keep the size of the base */
+	uint64_t size = 0;
+	std::vector<Field> fields;
+};
+
+class Template {
+   public:
+	int load(const char* path);
+	bool empty() const { return partitions.empty(); }
+	int build(const program::Program& program,
+			  const Vars& vars,
+			  std::vector<char>& data) const;
+
+   private:
+	std::string path;
+	/* Relative file names are taken from here */
+	std::string dir;
+	std::vector<Partition> partitions;
+};
+
+/* Contents programmed in place of the image of @program */
+struct Contents {
+	const program::Program* program;
+	std::shared_ptr<const std::vector<char>> data;
+};
+
+int expand(const std::string& text, const Vars& vars, std::string& out);
+
+}  // namespace personalize
+
+#endif
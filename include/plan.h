@@ -0,0 +1,43 @@
+#pragma once
+
+#ifndef __PLAN_H__
+#define __PLAN_H__
+
+#include <memory>
+#include <vector>
+
+#include "manifest.h"
+#include "patch.h"
+#include "program.h"
+#include "ufs.h"
+
+namespace plan {
+
+/*
+ * Everything to be flashed in one session, as loaded from the manifests or
+ * from a plan file. The strings of the entries live in @strings, or in
+ * @mapping when loaded from a plan file.
+ */
+struct Plan {
+	manifest::Arena strings;
+	std::shared_ptr<void> mapping;
+
+	std::vector<program::Program> programs;
+	std::vector<patch::Patch> patches;
+	ufs::Config ufs;
+};
+
+int compile(Plan& plan,
+			const char* plan_file,
+			const std::vector<const char*>& files,
+			const std::vector<const char*>& incdirs,
+			bool finalize_provisioning);
+int load(Plan& plan,
+		 const char* plan_file,
+		 const std::vector<const char*>& files,
+		 const std::vector<const char*>& incdirs,
+		 bool finalize_provisioning);
+
+}  // namespace plan
+
+#endif
@@ -0,0 +1,52 @@
+#pragma once
+
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "program.h"
+
+namespace prefetch {
+
+class Prefetcher {
+   public:
+	~Prefetcher();
+
+	void start(const std::vector<program::Program>& programs, size_t budget);
+	void consumed(size_t bytes);
+	void finished(size_t idx);
+	void pin(int cpu);
+
+   private:
+	struct Range {
+		const char* path;
+		uint64_t offset;
+		uint64_t end;
+	};
+
+	void worker();
+	bool wait_for_window(size_t len);
+
+	std::vector<Range> ranges;
+	/* Position of the end of each program in the stream of prefetched data */
+	std::vector<uint64_t> marks;
+
+	std::mutex lock;
+	std::condition_variable cond;
+	uint64_t issued = 0;
+	uint64_t done = 0;
+	size_t window = 0;
+	bool stop = false;
+
+	std::thread thread;
+};
+
+}  // namespace prefetch
+
+#endif
@@ -1,10 +1,24 @@
 #ifndef __PROGRAM_H__
 #define __PROGRAM_H__
 
+#include <sys/stat.h>
+
 #include <cstdbool>
+#include <cstdint>
+#include <functional>
 #include <memory>
+#include <vector>
+
+#include "image.h"
+#include "manifest.h"
+
+namespace prefetch {
+class Prefetcher;
+}
 
-#include "qdl.h"
+namespace fanout {
+class Reader;
+}
 
 namespace program {
 
@@ -17,16 +31,32 @@ struct Program {
 	unsigned partition;
 	const char* start_sector;
 
-	std::shared_ptr<Program> next;
+	const char* path;
+	uint64_t image_size;
 };
 
 struct program_apply {
-	virtual int apply_program(std::shared_ptr<Program>&, int) = 0;
+	virtual int apply_program(const Program&, image::Source&) = 0;
+	/* Source programmed instead of the image, e.g. built for the device */
+	virtual std::unique_ptr<image::Source> replace(const Program&) {
+		return nullptr;
+	}
 };
 
-int load(const char* program_file);
-int execute(program_apply*, const char* incdir);
-int find_bootable_partition();
+int parse(xmlTextReaderPtr reader,
+		  manifest::Arena& strings,
+		  std::vector<Program>& programs);
+using probe_fn = std::function<void(const char* path, const struct stat* sb)>;
+void resolve(std::vector<Program>& programs,
+			 manifest::Arena& strings,
+			 const std::vector<const char*>& incdirs,
+			 probe_fn probe = nullptr);
+int execute(const std::vector<Program>& programs,
+			program_apply*,
+			bool direct_io,
+			prefetch::Prefetcher* prefetch,
+			fanout::Reader* shared = nullptr);
+int find_bootable_partition(const std::vector<Program>& programs);
 
 }  // namespace program
 #endif
@@ -0,0 +1,63 @@
+#pragma once
+
+#ifndef __PROGRESS_H__
+#define __PROGRESS_H__
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/*
+ * Machine readable progress
+ *
+ * JSON objects, one per line, written to a file descriptor or a Unix socket
+ * for station software to follow a session:
+ *
+ *   {"event":"phase","device":"1-2","phase":"sahara","time":0.003}
+ *   {"event":"progress","device":"1-2","label":"system","done":N,
+ *    "total":N,"rate":N,"eta":12.5,"time":4.2}
+ *   {"event":"done","device":"1-2","result":0,"time":30.1}
+ *
+ * "device" is the USB device of the session, telling apart the sessions of
+ * a batch writing to the same stream.
+ * "done" and "total" count the bytes of the whole plan, "rate" is a moving
+ * average in bytes per second and "eta" is in seconds. Progress events are
+ * rate limited, so reporting every chunk costs a clock read.
+ */
+
+namespace progress {
+
+class Stream {
+   public:
+	Stream() = default;
+	Stream(const Stream&) = delete;
+	Stream& operator=(const Stream&) = delete;
+	~Stream();
+
+	int open(const char* spec);
+	void set_device(const char* name);
+
+	void phase(const char* name);
+	void update(const char* label, uint64_t done, uint64_t total);
+	void finish(int ret);
+
+   private:
+	using clock = std::chrono::steady_clock;
+
+	void emit(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+	double now() const;
+
+	int fd = -1;
+	bool owned = false;
+	/* JSON escaped */
+	std::string device;
+
+	clock::time_point start = clock::now();
+	clock::time_point last;
+	uint64_t last_done = 0;
+	double rate = 0;
+};
+
+}  // namespace progress
+
+#endif
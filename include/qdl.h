@@ -6,30 +6,65 @@
 #include <libxml/tree.h>
 
 #include <cstdbool>
+#include <cstdint>
+#include <functional>
 
-struct Qdl {
-	int read(void* buf, size_t len, unsigned int timeout);
-	int write(const void* buf, size_t len, bool eot);
+#include "transport.h"
 
-   protected:
+struct udev_device;
+struct usbdevfs_urb;
+
+/* USB transport to one EDL device */
+struct Qdl : Transport {
+	Qdl() = default;
+	Qdl(const Qdl&) = delete;
+	Qdl& operator=(const Qdl&) = delete;
+	~Qdl();
+
+	/* Lower ranked devices are tried first, @rank gets the sysname */
+	using rank_fn = std::function<unsigned(const char* sysname)>;
+
+	int open(const char* device, rank_fn rank = nullptr, int timeout = -1);
+	int read(void* buf, size_t len, unsigned int timeout) override;
+	int write(const void* buf, size_t len, bool eot) override;
+	bool duplex() const override { return true; }
+	int recover(bool reset) override;
+	int reconnect(unsigned timeout) override;
+	void disconnect();
+	bool gone() const;
+
+	/* Asynchronous transfers, for engine::Usb */
+	int fileno() const { return fd; }
+	int submit(struct usbdevfs_urb* urb,
+			   bool in,
+			   void* buf,
+			   size_t len,
+			   bool eot,
+			   void* context);
+	int discard(struct usbdevfs_urb* urb);
+	int reap(struct usbdevfs_urb** urb);
+
+	char name[32] = "";
+
+   private:
 	int parse_usb_desc(int fd, int* intf);
-	int usb_open();
-	int fd;
+	int claim(struct udev_device* dev, const char* device);
+	int fd = -1;
+	/* Device node, to tell when it went away */
+	char node[64] = "";
+	/* Claimed interface */
+	int intf = -1;
 
 	int in_ep;
 	int out_ep;
 
 	size_t in_maxpktsize;
 	size_t out_maxpktsize;
-
-	friend int main(int, char**);
 };
 
 void print_hex_dump(const char* prefix, const void* buf, size_t len);
+uint32_t crc32(uint32_t crc, const void* buf, size_t len);
 unsigned attr_as_unsigned(xmlNode* node, const char* attr, int* errors);
 const char* attr_as_string(xmlNode* node, const char* attr, int* errors);
 
-extern bool qdl_debug;
-extern bool fw_only;
-
 #endif
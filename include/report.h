@@ -0,0 +1,33 @@
+#pragma once
+
+#ifndef __REPORT_H__
+#define __REPORT_H__
+
+#include <chrono>
+#include <cstdint>
+
+/* Timing and volume figures of one flashing session */
+struct Report {
+	using clock = std::chrono::steady_clock;
+
+	clock::time_point start = clock::now();
+
+	double ready_ms = -1;
+	double configure_ms = -1;
+
+	unsigned programs = 0;
+	uint64_t bytes = 0;
+
+	/* Programs skipped as unchanged according to the flash history */
+	unsigned skipped = 0;
+	uint64_t skipped_bytes = 0;
+
+	/* Transfer errors recovered from, and the time spent on them */
+	unsigned retries = 0;
+	double retry_ms = 0;
+
+	double elapsed_ms() const;
+	void print() const;
+};
+
+#endif
@@ -1,11 +1,14 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 
-#include "firehose.h"
+#include "image.h"
+#include "transport.h"
 
+struct Sahara {
+	explicit Sahara(Transport& usb) : usb(usb) {}
 
-struct Sahara : Firehose {
 	struct Pkt {
 		uint32_t cmd;
 		uint32_t length;
@@ -42,15 +45,35 @@ struct Sahara : Firehose {
 				uint64_t offset;
 				uint64_t length;
 			} read64_req;
+			struct {
+				uint32_t mode;
+			} switch_mode;
+			struct {
+				uint32_t command;
+			} exec_req;
+			struct {
+				uint32_t command;
+				uint32_t length;
+			} exec_resp;
 		};
 	};
-	int run(char* prog_mbn);
+	int run(image::Source& mbn, const void* hello = NULL, size_t len = 0);
+
+	/* Read the serial number in command mode before the upload */
+	bool read_serial = false;
+	bool has_serial = false;
+	uint32_t serial = 0;
 
    private:
-	void hello(Pkt&);
-	int read_common(const char* mbn, off_t offset, size_t len);
-	void read(Pkt& pkt, const char* mbn);
-	void read64(Pkt& pkt, const char* mbn);
-	void eoi(Pkt& pkt);
+	int hello(Pkt&);
+	int command_ready();
+	int execute(Pkt& pkt);
+	int read_common(image::Source& mbn, uint64_t offset, size_t len);
+	int read(Pkt& pkt, image::Source& mbn);
+	int read64(Pkt& pkt, image::Source& mbn);
+	int eoi(Pkt& pkt);
 	int done(Pkt& pkt);
+
+	Transport& usb;
+	bool asked = false;
 };
@@ -0,0 +1,33 @@
+#pragma once
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <vector>
+
+#include "session.h"
+
+/*
+ * Job server
+ *
+ * A long running qdl listening on a Unix socket for flash jobs. Parsed
+ * plans, open image files and programmer images are kept in LRU caches, so
+ * a job only pays for parsing and opening what changed since an earlier
+ * job, and concurrent jobs on different devices share the same data.
+ *
+ * The protocol is line based. The client sends "key value" lines
+ * describing the job, terminated by "run"; the server answers with
+ * "device", "progress" and finally "done" lines.
+ */
+
+namespace server {
+
+int run(const char* socket_path);
+int submit(const char* socket_path,
+		   const Options& options,
+		   const char* prog_mbn,
+		   const std::vector<const char*>& files);
+
+}  // namespace server
+
+#endif
@@ -0,0 +1,146 @@
+#pragma once
+
+#ifndef __SESSION_H__
+#define __SESSION_H__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "capture.h"
+#include "engine.h"
+#include "fanout.h"
+#include "history.h"
+#include "image.h"
+#include "personalize.h"
+#include "plan.h"
+#include "prefetch.h"
+#include "program.h"
+#include "progress.h"
+#include "qdl.h"
+#include "report.h"
+#include "topology.h"
+
+struct Options {
+	const char* storage = "ufs";
+	/* Directories to look for images in, the first one having it wins */
+	std::vector<const char*> incdirs;
+	const char* plan_file = NULL;
+	/* USB device (sysname, e.g. "1-2") to flash, NULL for the first found */
+	const char* device = NULL;
+	/* File to capture the USB traffic to, see capture.h */
+	const char* capture = NULL;
+	/* "fd:<N>" or Unix socket to write JSON progress to, see progress.h */
+	const char* progress = NULL;
+	/*
+	 * Directory to keep image digests in, see digest.h; hashing needs it
+	 * given to digest::set_dir() at startup
+	 */
+	const char* digest_dir = NULL;
+	/* Directory to keep the flash history of devices in, see history.h */
+	const char* history_dir = NULL;
+	/* Template of the contents built per device, see personalize.h */
+	const char* personalize_file = NULL;
+	/* NAME=VALUE variables for the template */
+	std::vector<const char*> vars;
+
+	/* Partition filters, see filter.h */
+	std::vector<const char*> only;
+	std::vector<const char*> skip;
+
+	bool finalize_provisioning = false;
+	bool direct_io = false;
+	/* Leave the programmer running when done, for the next session */
+	bool no_reset = false;
+	/* Apply the GPT patches to the images instead of on the device */
+	bool host_patch = false;
+	/* Go on flashing once the UFS storage is provisioned */
+	bool flash_after_provisioning = false;
+	/* Flash partitions the history says are unchanged anyway */
+	bool force = false;
+	/* Have the device confirm the history before skipping a partition */
+	bool verify_history = false;
+	bool debug = false;
+
+	size_t prefetch_budget = 256 * 1024 * 1024;
+};
+
+/*
+ * One flashing session
+ *
+ * A session owns its plan, its device and all protocol state, and reports
+ * errors by return value, so any number of sessions can run concurrently on
+ * separate threads of one process, or as coroutines of one engine::Engine.
+ * A session is used once: load() the plan, open() a device, then flash() it.
+ * Plans are immutable once loaded and can be shared between sessions.
+ */
+class Session {
+   public:
+	using progress_fn = std::function<
+		void(const program::Program& program, uint64_t done, uint64_t total)>;
+	using complete_fn = std::function<void(int ret, const Report& report)>;
+	using phase_fn = std::function<void(const char* phase)>;
+	using personalize_fn = std::function<int(const program::Program& program,
+											 const personalize::Vars& vars,
+											 std::vector<char>& data)>;
+
+	explicit Session(const Options& options) : options(options) {}
+	~Session();
+
+	int compile(const std::vector<const char*>& files);
+	int load(const std::vector<const char*>& files);
+	int load(std::shared_ptr<const plan::Plan> plan);
+	void share(std::shared_ptr<fanout::Group> group);
+	int open();
+	int open(engine::Engine& engine);
+	int attach(Transport& transport);
+	int flash(const char* prog_mbn);
+	int flash(image::Source& programmer);
+
+	const char* device() const { return usb.name; }
+	std::shared_ptr<const plan::Plan> loaded() const { return plan; }
+
+	/* Called from the flashing thread after each chunk of a program */
+	progress_fn on_progress;
+	/* Called from the flashing thread as each phase starts */
+	phase_fn on_phase;
+	/* Called once flash() is done, successful or not */
+	complete_fn on_complete;
+	/*
+	 * Called for each program once the device is known, with @data built
+	 * from the template if it covers the program. Returns 1 to program
+	 * @data in place of the image, 0 to leave it, negative errno to fail.
+	 */
+	personalize_fn on_personalize;
+
+	Report report;
+
+   private:
+	int detect(std::vector<char>& hello);
+	int build_personal(const personalize::Vars& vars,
+					   std::vector<personalize::Contents>& personal);
+
+	Options options;
+	std::shared_ptr<const plan::Plan> plan;
+	std::shared_ptr<fanout::Group> group;
+	std::unique_ptr<fanout::Reader> shared;
+	prefetch::Prefetcher prefetch;
+	history::History history;
+	personalize::Template personal_template;
+	std::thread hashing;
+	/* Tells the hashing thread to give up, the session is going away */
+	std::atomic<bool> stopping{false};
+	progress::Stream stream;
+	/* Bytes of the plan, for progress::Stream */
+	uint64_t plan_bytes = 0;
+	Qdl usb;
+	std::unique_ptr<topology::Seat> seat;
+	std::unique_ptr<engine::Usb> async;
+	std::unique_ptr<capture::Recorder> recorder;
+	Transport* transport = &usb;
+};
+
+#endif
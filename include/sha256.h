@@ -0,0 +1,26 @@
+#pragma once
+
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#include <cstddef>
+#include <cstdint>
+
+#define SHA256_DIGEST_SIZE 32
+
+/* FIPS 180-4 SHA-256 */
+struct Sha256 {
+	Sha256();
+
+	void update(const void* buf, size_t len);
+	void final(uint8_t digest[SHA256_DIGEST_SIZE]);
+
+   private:
+	void block(const uint8_t* data);
+
+	uint32_t state[8];
+	uint64_t count = 0;
+	uint8_t buf[64];
+};
+
+#endif
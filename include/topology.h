@@ -0,0 +1,79 @@
+#pragma once
+
+#ifndef __TOPOLOGY_H__
+#define __TOPOLOGY_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "transport.h"
+
+/*
+ * USB topology aware scheduling
+ *
+ * Devices behind the same host controller share its bandwidth, so flashing
+ * more of them at once than the controller can feed only adds contention.
+ * With a limit set, bulk data transfers are capped per host controller,
+ * new sessions prefer devices on the least loaded controller, and each
+ * session's threads are pinned to a CPU close to its controller. Sessions
+ * running as coroutines of an engine share its thread, so they aren't pinned
+ * and wait for a transfer slot by yielding to the others.
+ */
+
+namespace topology {
+
+struct Location {
+	/* sysfs path of the host controller */
+	std::string controller;
+	unsigned bus = 0;
+	/* Port path from the root hub, e.g. "1.4" */
+	std::string port_path;
+	/* Link speed in Mbit/s */
+	unsigned speed = 0;
+};
+
+int locate(const char* sysname, Location& out);
+
+void set_limit(unsigned transfers);
+bool enabled();
+
+unsigned load(const char* sysname);
+
+struct Controller;
+
+/* Membership of one session in its controller's schedule */
+class Seat : public Transport {
+   public:
+	Seat(Transport& inner,
+		 const Location& location,
+		 std::function<void(unsigned)> sleep = nullptr);
+	~Seat();
+
+	int read(void* buf, size_t len, unsigned int timeout) override;
+	int write(const void* buf, size_t len, bool eot) override;
+	bool duplex() const override { return inner.duplex(); }
+	int recover(bool reset) override { return inner.recover(reset); }
+	int reconnect(unsigned timeout) override {
+		return inner.reconnect(timeout);
+	}
+
+	int cpu() const { return cpu_; }
+
+   private:
+	Transport& inner;
+	std::shared_ptr<Controller> controller;
+	/* Waits @ms without blocking the thread, for sessions on an engine */
+	std::function<void(unsigned)> sleep;
+	int cpu_ = -1;
+};
+
+int pin(int cpu);
+void report();
+
+}  // namespace topology
+
+#endif
@@ -0,0 +1,36 @@
+#pragma once
+
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+#include <cerrno>
+#include <cstddef>
+
+/*
+ * Byte pipe to a device in EDL mode, as used by the Sahara and Firehose
+ * protocol code. Both calls return the number of bytes transferred, or a
+ * negative value with errno set.
+ */
+struct Transport {
+	virtual ~Transport() {}
+
+	virtual int read(void* buf, size_t len, unsigned int timeout) = 0;
+	virtual int write(const void* buf, size_t len, bool eot) = 0;
+
+	/* Whether read() may be called from another thread during write() */
+	virtual bool duplex() const { return false; }
+
+	/*
+	 * Clear the link after a failed transfer, resetting the device if
+	 * @reset. Returns 0 on success, negative errno on failure.
+	 */
+	virtual int recover(bool reset) { return -ENOTSUP; }
+
+	/*
+	 * Find the device again after it restarted, waiting up to @timeout ms.
+	 * Returns 0 on success, negative errno on failure.
+	 */
+	virtual int reconnect(unsigned timeout) { return -ENOTSUP; }
+};
+
+#endif
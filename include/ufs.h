@@ -32,8 +32,10 @@
 #define __UFS_H__
 
 #include <cstdbool>
-#include <memory>
+#include <optional>
+#include <vector>
 
+#include "manifest.h"
 #include "qdl.h"
 
 namespace ufs {
@@ -62,8 +64,6 @@ struct Body {
 	unsigned bProvisioningType;
 	unsigned wContextCapabilities;
 	const char* desc;
-
-	std::shared_ptr<Body> next;
 };
 
 struct Epilogue {
@@ -71,16 +71,25 @@ struct Epilogue {
 	bool commit;
 };
 
+struct Config {
+	std::optional<Common> common;
+	std::vector<Body> bodies;
+	std::optional<Epilogue> epilogue;
+};
+
 struct ufs_apply {
-	virtual int apply_ufs_common(std::shared_ptr<Common>& common) = 0;
-	virtual int apply_ufs_body(std::shared_ptr<Body>& body) = 0;
-	virtual int apply_ufs_epilogue(std::shared_ptr<Epilogue>& epilogue,
-								   bool commit) = 0;
+	virtual int apply_ufs_common(const Common& common) = 0;
+	virtual int apply_ufs_body(const Body& body) = 0;
+	virtual int apply_ufs_epilogue(const Epilogue& epilogue, bool commit) = 0;
 };
 
-int load(const char* ufs_file, bool finalize_provisioning);
-int provisioning_execute(ufs_apply*);
-bool need_provisioning(void);
+int parse(xmlTextReaderPtr reader, manifest::Arena& strings, Config& config);
+int install(Config& dst,
+			Config& config,
+			const char* ufs_file,
+			bool finalize_provisioning);
+int provisioning_execute(const Config& config, ufs_apply*);
+bool need_provisioning(const Config& config);
 
 }  // namespace ufs
 
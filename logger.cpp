@@ -0,0 +1,285 @@
+#include "logger.h"
+
+#include <sys/stat.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace logger {
+
+#define RING_SIZE 4096
+#define TEXT_SIZE 480
+#define PREFIX_SIZE 24
+
+/*
+ * Bounded multi-producer single-consumer ring, each slot carries a sequence
+ * number telling whether it is free for the producer claiming position
+ * @pos (seq == pos) or filled for the consumer (seq == pos + 1).
+ */
+struct Slot {
+	std::atomic<size_t> seq;
+	level lvl;
+	char prefix[PREFIX_SIZE];
+	/* Messages not fitting in @text are allocated */
+	char* heap;
+	char text[TEXT_SIZE];
+};
+
+static Slot ring[RING_SIZE];
+static std::atomic<size_t> head;
+static size_t tail;
+static std::atomic<size_t> dropped;
+/* Messages below this level are discarded at the call site */
+static std::atomic<level> threshold{level::debug};
+
+static std::atomic<bool> running;
+static std::atomic<bool> sleeping;
+
+/* Never destroyed, the writer may still run while the process exits */
+static std::mutex& wake_lock = *new std::mutex;
+static std::condition_variable& wake = *new std::condition_variable;
+static std::string& dir = *new std::string;
+static std::map<std::string, FILE*>& files = *new std::map<std::string, FILE*>;
+
+static thread_local char thread_prefix[PREFIX_SIZE];
+
+static FILE* stream_for(level lvl) {
+	return lvl == level::info ? stdout : stderr;
+}
+
+static FILE* file_for(const char* prefix, level lvl) {
+	FILE* fp;
+
+	if (dir.empty() || !prefix[0])
+		return stream_for(lvl);
+
+	auto it = files.find(prefix);
+	if (it != files.end())
+		return it->second;
+
+	fp = fopen((dir + "/" + prefix + ".log").c_str(), "a");
+	if (!fp)
+		fp = stream_for(lvl);
+	files.emplace(prefix, fp);
+
+	return fp;
+}
+
+static void emit(FILE* fp, const char* prefix, const char* text) {
+	/* The prefix is implied by the file name for per device logs */
+	if (prefix[0] && (fp == stdout || fp == stderr))
+		fprintf(fp, "[%s] %s\n", prefix, text);
+	else
+		fprintf(fp, "%s\n", text);
+}
+
+static size_t drain() {
+	size_t count = 0;
+	size_t seq;
+	Slot* slot;
+	FILE* fp;
+
+	for (;;) {
+		slot = &ring[tail % RING_SIZE];
+		seq = slot->seq.load(std::memory_order_acquire);
+		if (seq != tail + 1)
+			break;
+
+		fp = file_for(slot->prefix, slot->lvl);
+		emit(fp, slot->prefix, slot->heap ? slot->heap : slot->text);
+		free(slot->heap);
+		slot->heap = NULL;
+
+		slot->seq.store(tail + RING_SIZE, std::memory_order_release);
+		tail++;
+		count++;
+	}
+
+	if (count) {
+		fflush(stdout);
+		fflush(stderr);
+		for (auto& file : files)
+			fflush(file.second);
+	}
+
+	return count;
+}
+
+static void worker() {
+	size_t n;
+
+	for (;;) {
+		drain();
+
+		n = dropped.exchange(0);
+		if (n) {
+			fprintf(stderr, "[LOG] %zu messages dropped\n", n);
+			fflush(stderr);
+		}
+
+		std::unique_lock<std::mutex> guard(wake_lock);
+		sleeping = true;
+		if (ring[tail % RING_SIZE].seq.load(std::memory_order_acquire) !=
+			tail + 1)
+			wake.wait_for(guard, std::chrono::milliseconds(50));
+		sleeping = false;
+	}
+}
+
+static void flush_at_exit() {
+	flush();
+}
+
+/**
+ * start() - start the background writer
+ * @log_dir:	directory for per device logs, or NULL for the terminal only
+ */
+void start(const char* log_dir) {
+	size_t i;
+
+	if (running)
+		return;
+
+	if (log_dir) {
+		mkdir(log_dir, 0755);
+		dir = log_dir;
+	}
+
+	for (i = 0; i < RING_SIZE; i++)
+		ring[i].seq.store(i, std::memory_order_relaxed);
+
+	running = true;
+	std::thread(worker).detach();
+
+	atexit(flush_at_exit);
+}
+
+/**
+ * flush() - wait for all messages logged so far to be written
+ */
+void flush() {
+	size_t target = head.load();
+
+	if (!running)
+		return;
+
+	while (true) {
+		Slot* slot = &ring[(target - 1) % RING_SIZE];
+
+		if (!target ||
+			slot->seq.load(std::memory_order_acquire) >= target - 1 + RING_SIZE)
+			break;
+
+		wake.notify_one();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+/**
+ * set_prefix() - tag messages logged from the calling thread
+ */
+void set_prefix(const char* prefix) {
+	snprintf(thread_prefix, sizeof(thread_prefix), "%s", prefix ? prefix : "");
+}
+
+/**
+ * prefix() - tag of the calling thread, for threads working on its behalf
+ */
+const char* prefix() {
+	return thread_prefix;
+}
+
+/**
+ * set_level() - discard messages less severe than @lvl
+ */
+void set_level(level lvl) {
+	threshold = lvl;
+}
+
+static void vprint(level lvl, const char* fmt, va_list ap) {
+	size_t pos;
+	size_t seq;
+	Slot* slot;
+	va_list ap2;
+	int len;
+
+	if (lvl < threshold.load(std::memory_order_relaxed))
+		return;
+
+	if (!running) {
+		FILE* fp = stream_for(lvl);
+		char text[TEXT_SIZE];
+
+		vsnprintf(text, sizeof(text), fmt, ap);
+		emit(fp, thread_prefix, text);
+		return;
+	}
+
+	pos = head.load(std::memory_order_relaxed);
+	for (;;) {
+		slot = &ring[pos % RING_SIZE];
+		seq = slot->seq.load(std::memory_order_acquire);
+
+		if (seq == pos) {
+			if (head.compare_exchange_weak(pos, pos + 1,
+										   std::memory_order_relaxed))
+				break;
+		} else if (seq < pos) {
+			dropped++;
+			return;
+		} else {
+			pos = head.load(std::memory_order_relaxed);
+		}
+	}
+
+	slot->lvl = lvl;
+	memcpy(slot->prefix, thread_prefix, sizeof(slot->prefix));
+
+	va_copy(ap2, ap);
+	len = vsnprintf(slot->text, sizeof(slot->text), fmt, ap);
+	if (len >= (int)sizeof(slot->text)) {
+		slot->heap = (char*)malloc(len + 1);
+		if (slot->heap)
+			vsnprintf(slot->heap, len + 1, fmt, ap2);
+	}
+	va_end(ap2);
+
+	slot->seq.store(pos + 1, std::memory_order_release);
+
+	if (sleeping.load(std::memory_order_relaxed))
+		wake.notify_one();
+}
+
+void print(level lvl, const char* fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprint(lvl, fmt, ap);
+	va_end(ap);
+}
+
+#define LOG_FN(name, lvl)                  \
+	void name(const char* fmt, ...) {      \
+		va_list ap;                        \
+                                           \
+		va_start(ap, fmt);                 \
+		vprint(lvl, fmt, ap);              \
+		va_end(ap);                        \
+	}
+
+LOG_FN(debug, level::debug)
+LOG_FN(info, level::info)
+LOG_FN(notice, level::notice)
+LOG_FN(warn, level::warn)
+LOG_FN(error, level::error)
+
+}  // namespace logger
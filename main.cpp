@@ -0,0 +1,360 @@
+#include <getopt.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "digest.h"
+#include "engine.h"
+#include "fanout.h"
+#include "filter.h"
+#include "logger.h"
+#include "server.h"
+#include "session.h"
+#include "topology.h"
+
+static void print_usage() {
+	extern const char* __progname;
+	std::cerr << __progname
+			  << " [--debug] [--firmware] [--only <FILTER>]... "
+				 "[--skip <FILTER>]... [--storage <emmc|ufs>] "
+				 "[--finalize-provisioning] [--flash-after-provisioning] "
+				 "[--plan <FILE>] "
+				 "[--prefetch-budget <MiB>] [--direct-io] [--host-patch] "
+				 "[--no-reset] [--progress <fd:N|SOCKET>] [--usb-slots <N>] "
+				 "[--digest-cache <DIR>] [--history <DIR> [--force] "
+				 "[--verify-history]] [--personalize <FILE> "
+				 "[--var <NAME=VALUE>]...] [--log-dir <DIR>] "
+				 "[--device <USB device>] [--devices <DEV,DEV,...>] "
+				 "[--capture <FILE>] "
+				 "[--include <PATH>]... <prog.mbn> [<program> <patch> ...]"
+			  << std::endl
+			  << __progname
+			  << " --compile --plan <FILE> [--finalize-provisioning] "
+				 "[--include <PATH>]... <program> <patch> ..."
+			  << std::endl
+			  << __progname
+			  << " --daemon <SOCKET> [--usb-slots <N>] [--digest-cache <DIR>] "
+				 "[--log-dir <DIR>]"
+			  << std::endl
+			  << __progname
+			  << " --connect <SOCKET> [options] <prog.mbn> "
+				 "[<program> <patch> ...]"
+			  << std::endl;
+}
+
+/*
+ * Flash all of the comma separated @devices with @plan, as coroutines of one
+ * engine thread reading each image once through @group
+ */
+static int flash_devices(const Options& options,
+						 std::shared_ptr<const plan::Plan> plan,
+						 std::shared_ptr<fanout::Group> group,
+						 char* devices,
+						 const char* prog_mbn) {
+	std::vector<std::unique_ptr<Session>> sessions;
+	std::vector<const char*> paths;
+	std::vector<std::string> names;
+	std::atomic<bool> stop{false};
+	std::thread hashing;
+	engine::Engine engine;
+	Options opts = options;
+	int failed = 0;
+	char* save;
+	char* tok;
+	int ret;
+
+	for (tok = strtok_r(devices, ",", &save); tok;
+		 tok = strtok_r(NULL, ",", &save))
+		names.push_back(tok);
+
+	/* The coroutine ahead yields while the others catch up */
+	group->set_pause([&engine](unsigned ms) { engine.sleep(ms); });
+	if (!options.direct_io)
+		group->prefetch(plan, options.prefetch_budget);
+
+	/*
+	 * Each session has its own copy of the options, @plan is filtered and
+	 * the images are hashed once for the batch
+	 */
+	opts.only.clear();
+	opts.skip.clear();
+	opts.digest_dir = NULL;
+	for (auto& name : names) {
+		opts.device = name.c_str();
+		sessions.emplace_back(new Session(opts));
+		sessions.back()->share(group);
+
+		ret = sessions.back()->load(plan);
+		if (ret < 0)
+			return ret;
+
+		ret = sessions.back()->open(engine);
+		if (ret < 0)
+			return ret;
+	}
+
+	for (auto& session : sessions) {
+		Session* s = session.get();
+
+		engine.spawn(s->device(), [s, prog_mbn, &failed] {
+			if (s->flash(prog_mbn) < 0)
+				failed++;
+		});
+	}
+
+	if (options.digest_dir) {
+		for (auto& program : plan->programs)
+			if (program.path)
+				paths.push_back(program.path);
+
+		hashing = std::thread([&] {
+			digest::fill(paths, DIGEST_BACKGROUND_WORKERS, options.direct_io,
+						 &stop);
+		});
+	}
+
+	ret = engine.run();
+
+	stop = true;
+	if (hashing.joinable())
+		hashing.join();
+	if (ret < 0)
+		return ret;
+
+	group->report();
+	topology::report();
+
+	if (failed) {
+		logger::error("%d of %zu devices failed", failed, sessions.size());
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	std::vector<const char*> files;
+	Options options;
+	char* prog_mbn;
+	char* log_dir = NULL;
+	char* daemon_socket = NULL;
+	char* server_socket = NULL;
+	char* devices = NULL;
+	std::shared_ptr<fanout::Group> group;
+	bool compile = false;
+	int ret;
+	int opt;
+
+	static struct option long_options[] = {
+		{"debug", no_argument, 0, 'd'},
+		{"include", required_argument, 0, 'i'},
+		{"finalize-provisioning", no_argument, 0, 'l'},
+		{"flash-after-provisioning", no_argument, 0, 'A'},
+		{"storage", required_argument, 0, 's'},
+		{"help", no_argument, 0, 'h'},
+		{"firmware", no_argument, 0, 'f'},
+		{"only", required_argument, 0, 'O'},
+		{"skip", required_argument, 0, 'K'},
+		{"plan", required_argument, 0, 'p'},
+		{"compile", no_argument, 0, 'c'},
+		{"prefetch-budget", required_argument, 0, 'P'},
+		{"direct-io", no_argument, 0, 'D'},
+		{"host-patch", no_argument, 0, 'H'},
+		{"no-reset", no_argument, 0, 'N'},
+		{"progress", required_argument, 0, 'R'},
+		{"usb-slots", required_argument, 0, 'U'},
+		{"digest-cache", required_argument, 0, 'G'},
+		{"log-dir", required_argument, 0, 'L'},
+		{"device", required_argument, 0, 'u'},
+		{"devices", required_argument, 0, 'M'},
+		{"daemon", required_argument, 0, 'S'},
+		{"connect", required_argument, 0, 'C'},
+		{"capture", required_argument, 0, 'W'},
+		{"history", required_argument, 0, 'Y'},
+		{"force", no_argument, 0, 'F'},
+		{"verify-history", no_argument, 0, 'V'},
+		{"personalize", required_argument, 0, 'T'},
+		{"var", required_argument, 0, 'E'},
+		{0, 0, 0, 0}};
+
+	while ((opt = getopt_long(argc, argv, "fdi:", long_options, NULL)) !=
+		   -1) {
+		switch (opt) {
+			case 'd':
+				options.debug = true;
+				break;
+			case 'i':
+				options.incdirs.push_back(optarg);
+				break;
+			case 'l':
+				options.finalize_provisioning = true;
+				break;
+			case 'A':
+				options.flash_after_provisioning = true;
+				break;
+			case 's':
+				options.storage = optarg;
+				break;
+			case 'f':
+				options.skip.push_back(FILTER_FIRMWARE);
+				break;
+			case 'O':
+				options.only.push_back(optarg);
+				break;
+			case 'K':
+				options.skip.push_back(optarg);
+				break;
+			case 'p':
+				options.plan_file = optarg;
+				break;
+			case 'c':
+				compile = true;
+				break;
+			case 'P':
+				options.prefetch_budget =
+					strtoul(optarg, NULL, 10) * 1024 * 1024;
+				break;
+			case 'D':
+				options.direct_io = true;
+				break;
+			case 'H':
+				options.host_patch = true;
+				break;
+			case 'N':
+				options.no_reset = true;
+				break;
+			case 'R':
+				options.progress = optarg;
+				break;
+			case 'U':
+				topology::set_limit(strtoul(optarg, NULL, 10));
+				break;
+			case 'G':
+				options.digest_dir = optarg;
+				break;
+			case 'L':
+				log_dir = optarg;
+				break;
+			case 'u':
+				options.device = optarg;
+				break;
+			case 'M':
+				devices = optarg;
+				break;
+			case 'S':
+				daemon_socket = optarg;
+				break;
+			case 'C':
+				server_socket = optarg;
+				break;
+			case 'W':
+				options.capture = optarg;
+				break;
+			case 'Y':
+				options.history_dir = optarg;
+				break;
+			case 'F':
+				options.force = true;
+				break;
+			case 'V':
+				options.verify_history = true;
+				break;
+			case 'T':
+				options.personalize_file = optarg;
+				break;
+			case 'E':
+				if (!strchr(optarg, '=')) {
+					print_usage();
+					return 1;
+				}
+				options.vars.push_back(optarg);
+				break;
+			case 'h':
+				print_usage();
+				return 0;
+			default:
+				print_usage();
+				return 1;
+		}
+	}
+
+	logger::start(log_dir);
+
+	/* Once for all sessions, the daemon's jobs may not change it */
+	digest::set_dir(options.digest_dir);
+
+	if (daemon_socket)
+		return server::run(daemon_socket) < 0 ? 1 : 0;
+
+	/*
+	 * With --devices this session only loads the plan, the group prefetches
+	 * for the batch. It doesn't join the group, the others would wait for
+	 * it at every image, nor hash or report progress.
+	 */
+	Options loading = options;
+	if (devices) {
+		loading.prefetch_budget = 0;
+		loading.digest_dir = NULL;
+		loading.progress = NULL;
+	}
+
+	Session session(loading);
+
+	if (compile) {
+		if (!options.plan_file || optind >= argc) {
+			print_usage();
+			return 1;
+		}
+
+		files.assign(argv + optind, argv + argc);
+		ret = session.compile(files);
+		return ret < 0 ? 1 : 0;
+	}
+
+	/* at least 2 non optional args required, unless a plan is used */
+	if ((optind + (options.plan_file ? 1 : 2)) > argc) {
+		print_usage();
+		return 1;
+	}
+
+	prog_mbn = argv[optind++];
+	files.assign(argv + optind, argv + argc);
+
+	if (server_socket) {
+		ret = server::submit(server_socket, options, prog_mbn, files);
+		return ret < 0 ? 1 : 0;
+	}
+
+	ret = session.load(files);
+	if (ret < 0)
+		return 1;
+
+	if (devices) {
+		group = std::make_shared<fanout::Group>(options.direct_io);
+		return flash_devices(options, session.loaded(), group, devices,
+							 prog_mbn) < 0
+				   ? 1
+				   : 0;
+	}
+
+	ret = session.open();
+	if (ret < 0)
+		return 1;
+
+	/* Per device log files are named after the USB device */
+	if (log_dir)
+		logger::set_prefix(session.device());
+
+	ret = session.flash(prog_mbn);
+	if (ret < 0)
+		return 1;
+
+	return 0;
+}
@@ -0,0 +1,269 @@
+#include "manifest.h"
+
+#include <libxml/parser.h>
+#include <libxml/xmlreader.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include "logger.h"
+#include "patch.h"
+#include "plan.h"
+#include "program.h"
+#include "ufs.h"
+
+namespace manifest {
+
+const char* Arena::strdup(const char* s, size_t len) {
+	char* p;
+
+	/* Large strings get a block of their own, keeping the current one */
+	if (len + 1 > block_size / 4) {
+		blocks.emplace_back(new char[len + 1]);
+		p = blocks.back().get();
+	} else {
+		if (len + 1 > left) {
+			blocks.emplace_back(new char[block_size]);
+			cur = blocks.back().get();
+			left = block_size;
+		}
+		p = cur;
+		cur += len + 1;
+		left -= len + 1;
+	}
+
+	memcpy(p, s, len);
+	p[len] = '\0';
+	total += len + 1;
+
+	return p;
+}
+
+void Arena::splice(Arena& other) {
+	std::move(other.blocks.begin(), other.blocks.end(),
+			  std::back_inserter(blocks));
+	total += other.total;
+
+	other.blocks.clear();
+	other.cur = nullptr;
+	other.left = 0;
+	other.total = 0;
+}
+
+static const xmlChar* attr_value(xmlTextReaderPtr reader, const char* attr) {
+	if (xmlTextReaderMoveToAttribute(reader, (xmlChar*)attr) != 1)
+		return NULL;
+
+	return xmlTextReaderConstValue(reader);
+}
+
+bool has_attr(xmlTextReaderPtr reader, const char* attr) {
+	return !!attr_value(reader, attr);
+}
+
+unsigned attr_as_unsigned(xmlTextReaderPtr reader,
+						  const char* attr,
+						  int* errors) {
+	const xmlChar* value;
+
+	value = attr_value(reader, attr);
+	if (!value) {
+		(*errors)++;
+		return 0;
+	}
+
+	return (unsigned int)strtoul((char*)value, NULL, 10);
+}
+
+const char* attr_as_string(xmlTextReaderPtr reader,
+						   const char* attr,
+						   int* errors,
+						   Arena& strings) {
+	const xmlChar* value;
+
+	value = attr_value(reader, attr);
+	if (!value) {
+		(*errors)++;
+		return NULL;
+	}
+
+	if (value[0] == '\0')
+		return NULL;
+
+	return strings.strdup((char*)value, xmlStrlen(value));
+}
+
+struct File {
+	const char* path;
+	type kind = type::unknown;
+	int ret = 0;
+
+	Arena strings;
+	std::vector<program::Program> programs;
+	std::vector<patch::Patch> patches;
+	ufs::Config ufs;
+};
+
+/*
+ * Single pass over one XML file: the root element (and for <data> the first
+ * <program> or <ufs> child) determines the type, each following top level
+ * element is handed straight to the parser of that type.
+ */
+static void load_file(File& file) {
+	xmlTextReaderPtr reader;
+	const xmlChar* name;
+	bool is_data = false;
+	int depth;
+	int ret;
+
+	reader = xmlReaderForFile(file.path, NULL, 0);
+	if (!reader) {
+		logger::error("[MANIFEST] failed to open %s", file.path);
+		file.ret = -EINVAL;
+		return;
+	}
+
+	while ((ret = xmlTextReaderRead(reader)) == 1) {
+		if (xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT)
+			continue;
+
+		depth = xmlTextReaderDepth(reader);
+		name = xmlTextReaderConstName(reader);
+
+		if (depth == 0) {
+			if (!xmlStrcmp(name, (xmlChar*)"patches"))
+				file.kind = type::patch;
+			else if (!xmlStrcmp(name, (xmlChar*)"data"))
+				is_data = true;
+			else if (!xmlStrcmp(name, (xmlChar*)"contents"))
+				file.kind = type::contents;
+
+			if (!is_data && file.kind != type::patch)
+				break;
+			continue;
+		}
+
+		if (depth != 1)
+			continue;
+
+		if (is_data && file.kind == type::unknown) {
+			if (!xmlStrcmp(name, (xmlChar*)"program"))
+				file.kind = type::program;
+			else if (!xmlStrcmp(name, (xmlChar*)"ufs"))
+				file.kind = type::ufs;
+			else
+				continue;
+		}
+
+		switch (file.kind) {
+			case type::patch:
+				ret = patch::parse(reader, file.strings, file.patches);
+				break;
+			case type::program:
+				ret = program::parse(reader, file.strings, file.programs);
+				break;
+			case type::ufs:
+				ret = ufs::parse(reader, file.strings, file.ufs);
+				break;
+			default:
+				ret = 0;
+				break;
+		}
+
+		if (ret < 0) {
+			file.ret = ret;
+			break;
+		}
+	}
+
+	if (ret < 0 && !file.ret) {
+		logger::error("[MANIFEST] failed to parse %s", file.path);
+		file.ret = -EINVAL;
+	}
+
+	xmlFreeTextReader(reader);
+}
+
+/**
+ * load() - parse a set of rawprogram, patch and UFS provisioning files
+ * @plan:	plan the entries are appended to
+ *
+ * Returns 0 on success, negative errno on failure.
+ *
+ * Files are parsed concurrently, but their entries are installed in command
+ * line order so the flashing order is unaffected.
+ */
+int load(plan::Plan& plan,
+		 const std::vector<const char*>& files,
+		 bool finalize_provisioning) {
+	std::vector<std::thread> workers;
+	std::vector<File> parsed(files.size());
+	std::atomic<size_t> next(0);
+	unsigned jobs;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < files.size(); i++)
+		parsed[i].path = files[i];
+
+	xmlInitParser();
+
+	jobs = std::max(1u, std::thread::hardware_concurrency());
+	jobs = std::min<size_t>(jobs, files.size());
+
+	for (i = 1; i < jobs; i++) {
+		workers.emplace_back([&] {
+			for (size_t j; (j = next++) < parsed.size();)
+				load_file(parsed[j]);
+		});
+	}
+
+	for (size_t j; (j = next++) < parsed.size();)
+		load_file(parsed[j]);
+
+	for (auto& worker : workers)
+		worker.join();
+
+	for (auto& file : parsed) {
+		if (file.ret < 0) {
+			logger::error("[MANIFEST] failed to load %s", file.path);
+			return file.ret;
+		}
+
+		switch (file.kind) {
+			case type::patch:
+				plan.patches.insert(plan.patches.end(), file.patches.begin(),
+									file.patches.end());
+				break;
+			case type::program:
+				plan.programs.insert(plan.programs.end(),
+									 file.programs.begin(),
+									 file.programs.end());
+				break;
+			case type::ufs:
+				ret = ufs::install(plan.ufs, file.ufs, file.path,
+								   finalize_provisioning);
+				if (ret < 0)
+					return ret;
+				break;
+			case type::contents:
+				logger::error("[MANIFEST] %s type not yet supported",
+							  file.path);
+				return -EINVAL;
+			default:
+				logger::error("[MANIFEST] failed to detect file type of %s",
+							  file.path);
+				return -EINVAL;
+		}
+
+		plan.strings.splice(file.strings);
+	}
+
+	return 0;
+}
+
+}  // namespace manifest
@@ -1,86 +1,439 @@
 #include "patch.h"
 
-#include <libxml/parser.h>
-#include <libxml/tree.h>
-
+#include <cctype>
 #include <cerrno>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
-#include <iostream>
 
-namespace patch {
+#include "image.h"
+#include "logger.h"
 
-static std::shared_ptr<Patch> patches;
-static std::shared_ptr<Patch> patches_last;
+namespace patch {
 
-int load(const char* patch_file) {
-	std::shared_ptr<Patch> patch;
-	xmlNode* node;
-	xmlNode* root;
-	xmlDoc* doc;
+int parse(xmlTextReaderPtr reader,
+		  manifest::Arena& strings,
+		  std::vector<Patch>& out) {
+	const xmlChar* name;
+	Patch patch;
 	int errors;
 
-	doc = xmlReadFile(patch_file, NULL, 0);
-	if (!doc) {
-		std::cerr << "[PATCH] failed to parse " << patch_file << std::endl;
-		return -EINVAL;
+	name = xmlTextReaderConstName(reader);
+	if (xmlStrcmp(name, (xmlChar*)"patch")) {
+		logger::warn("[PATCH] unrecognized tag \"%s\", ignoring", name);
+		return 0;
 	}
 
-	root = xmlDocGetRootElement(doc);
-	for (node = root->children; node; node = node->next) {
-		if (node->type != XML_ELEMENT_NODE)
-			continue;
+	errors = 0;
+
+	patch.sector_size =
+		manifest::attr_as_unsigned(reader, "SECTOR_SIZE_IN_BYTES", &errors);
+	patch.byte_offset =
+		manifest::attr_as_unsigned(reader, "byte_offset", &errors);
+	patch.filename =
+		manifest::attr_as_string(reader, "filename", &errors, strings);
+	patch.partition = manifest::attr_as_unsigned(
+		reader, "physical_partition_number", &errors);
+	patch.size_in_bytes =
+		manifest::attr_as_unsigned(reader, "size_in_bytes", &errors);
+	patch.start_sector =
+		manifest::attr_as_string(reader, "start_sector", &errors, strings);
+	patch.value = manifest::attr_as_string(reader, "value", &errors, strings);
+	patch.what = manifest::attr_as_string(reader, "what", &errors, strings);
+
+	if (errors) {
+		logger::error("[PATCH] errors while parsing patch");
+		return 0;
+	}
+
+	out.push_back(patch);
+
+	return 0;
+}
+
+int execute(const std::vector<Patch>& patches, patch_apply* dev) {
+	int ret;
 
-		if (xmlStrcmp(node->name, (xmlChar*)"patch")) {
-			std::cerr << "[PATCH] unrecognized tag \"" << node->name
-					  << "\", ignoring" << std::endl;
+	for (auto& patch : patches) {
+		if (!patch.filename || strcmp(patch.filename, "DISK"))
 			continue;
-		}
 
-		errors = 0;
+		ret = dev->apply_patch(patch);
+		if (ret)
+			return ret;
+	}
 
-		patch = std::make_shared<Patch>();
+	return 0;
+}
 
-		patch->sector_size =
-			attr_as_unsigned(node, "SECTOR_SIZE_IN_BYTES", &errors);
-		patch->byte_offset = attr_as_unsigned(node, "byte_offset", &errors);
-		patch->filename = attr_as_string(node, "filename", &errors);
-		patch->partition =
-			attr_as_unsigned(node, "physical_partition_number", &errors);
-		patch->size_in_bytes = attr_as_unsigned(node, "size_in_bytes", &errors);
-		patch->start_sector = attr_as_string(node, "start_sector", &errors);
-		patch->value = attr_as_string(node, "value", &errors);
-		patch->what = attr_as_string(node, "what", &errors);
+/*
+ * Host side patching
+ *
+ * The DISK patches fix up the GPT images once the size of the LUN is known:
+ * last usable LBA, location of the backup header and the CRCs over headers
+ * and partition entries. Given the number of sectors, they can be applied
+ * to in-memory copies of the GPT images before these are programmed, which
+ * saves the round trip per patch.
+ *
+ * Expressions are sums and products of numbers (optionally followed by a
+ * '.'), NUM_DISK_SECTORS, and CRC32(<sector>, <bytes>) over patched data.
+ */
 
-		if (errors) {
-			std::cerr << "[PATCH] errors while parsing patch" << std::endl;
+/* Limits what is loaded into memory, GPT images are a few sectors */
+#define HOST_PATCH_MAX_IMAGE (4 * 1024 * 1024)
+
+struct Parser {
+	const char* p;
+	uint64_t num_disk_sectors;
+	unsigned sector_size;
+	const std::vector<Region>& regions;
+	int error;
+};
+
+/*
+ * Index of the region holding @len bytes at byte @offset of the LUN
+ *
+ * Offsets and lengths come from the manifests, compared without adding
+ * them so that huge ones can't wrap around.
+ */
+static int find_region(const std::vector<Region>& regions,
+					   unsigned sector_size,
+					   uint64_t offset,
+					   uint64_t len) {
+	const Region* region;
+	uint64_t base;
+	uint64_t size;
+	size_t i;
+
+	for (i = 0; i < regions.size(); i++) {
+		region = &regions[i];
+		base = region->start * sector_size;
+		if (offset < base || len > region->length ||
+			offset - base > region->length - len)
 			continue;
-		}
 
-		if (patches) {
-			patches_last->next = patch;
-			patches_last = patch;
+		/* The image may be shorter than the range written */
+		if (region->skip > region->data.size())
+			continue;
+		size = region->data.size() - region->skip;
+		if (len > size || offset - base > size - len)
+			continue;
+
+		return i;
+	}
+
+	return -1;
+}
+
+static uint64_t parse_expr(Parser& ps);
+
+static void skip_space(Parser& ps) {
+	while (isspace((unsigned char)*ps.p))
+		ps.p++;
+}
+
+static bool consume(Parser& ps, const char* token) {
+	size_t len = strlen(token);
+
+	skip_space(ps);
+	if (strncmp(ps.p, token, len))
+		return false;
+
+	ps.p += len;
+	return true;
+}
+
+static uint64_t parse_crc32(Parser& ps) {
+	const Region* region;
+	uint64_t sector;
+	uint64_t offset;
+	uint64_t len;
+	int idx;
+
+	if (!consume(ps, "(")) {
+		ps.error = -EINVAL;
+		return 0;
+	}
+	sector = parse_expr(ps);
+	if (!consume(ps, ",")) {
+		ps.error = -EINVAL;
+		return 0;
+	}
+	len = parse_expr(ps);
+	if (!consume(ps, ")")) {
+		ps.error = -EINVAL;
+		return 0;
+	}
+
+	if (ps.error)
+		return 0;
+
+	if (!ps.sector_size || len > HOST_PATCH_MAX_IMAGE ||
+		sector > UINT64_MAX / ps.sector_size) {
+		ps.error = -EINVAL;
+		return 0;
+	}
+
+	offset = sector * ps.sector_size;
+	idx = find_region(ps.regions, ps.sector_size, offset, len);
+	if (idx < 0) {
+		ps.error = -ENOTSUP;
+		return 0;
+	}
+
+	region = &ps.regions[idx];
+	offset = region->skip + offset - region->start * ps.sector_size;
+	return crc32(0, region->data.data() + offset, len);
+}
+
+static uint64_t parse_factor(Parser& ps) {
+	uint64_t value;
+	char* end;
+
+	skip_space(ps);
+
+	if (consume(ps, "NUM_DISK_SECTORS"))
+		return ps.num_disk_sectors;
+
+	if (consume(ps, "CRC32"))
+		return parse_crc32(ps);
+
+	if (consume(ps, "(")) {
+		value = parse_expr(ps);
+		if (!consume(ps, ")"))
+			ps.error = -EINVAL;
+		return value;
+	}
+
+	if (!isdigit((unsigned char)*ps.p)) {
+		ps.error = -EINVAL;
+		return 0;
+	}
+
+	/* Decimal, as the programmer reads them: "010" is ten, not eight */
+	value = strtoull(ps.p, &end, 10);
+	ps.p = end;
+	if (*ps.p == '.')
+		ps.p++;
+
+	return value;
+}
+
+static uint64_t parse_term(Parser& ps) {
+	uint64_t value;
+	uint64_t rhs;
+
+	value = parse_factor(ps);
+	while (!ps.error) {
+		if (consume(ps, "*")) {
+			value *= parse_factor(ps);
+		} else if (consume(ps, "/")) {
+			rhs = parse_factor(ps);
+			if (!rhs) {
+				ps.error = -EINVAL;
+				return 0;
+			}
+			value /= rhs;
 		} else {
-			patches = patch;
-			patches_last = patch;
+			break;
 		}
 	}
 
-	xmlFreeDoc(doc);
+	return value;
+}
+
+static uint64_t parse_expr(Parser& ps) {
+	uint64_t value;
+
+	value = parse_term(ps);
+	while (!ps.error) {
+		if (consume(ps, "+"))
+			value += parse_term(ps);
+		else if (consume(ps, "-"))
+			value -= parse_term(ps);
+		else
+			break;
+	}
+
+	return value;
+}
+
+/**
+ * evaluate() - evaluate a patch expression
+ * @expr:		the start_sector or value of a patch
+ * @num_disk_sectors:	size of the LUN, in sectors
+ * @sector_size:	sector size of the LUN
+ * @regions:		data available to CRC32()
+ * @value:		result
+ *
+ * Returns 0 on success, -EINVAL on syntax errors and -ENOTSUP if a CRC32()
+ * covers data not in @regions.
+ */
+int evaluate(const char* expr,
+			 uint64_t num_disk_sectors,
+			 unsigned sector_size,
+			 const std::vector<Region>& regions,
+			 uint64_t* value) {
+	Parser ps = {expr, num_disk_sectors, sector_size, regions, 0};
+
+	*value = parse_expr(ps);
+	skip_space(ps);
+	if (!ps.error && *ps.p)
+		ps.error = -EINVAL;
+
+	return ps.error;
+}
+
+static int load_region(const program::Program& program,
+					   uint64_t num_disk_sectors,
+					   std::vector<Region>& regions) {
+	std::unique_ptr<image::Source> source;
+	uint64_t num_sectors;
+	const char* data;
+	Region region;
+	ssize_t n;
+	int ret;
+
+	if (program.image_size > HOST_PATCH_MAX_IMAGE)
+		return -ENOTSUP;
+
+	ret = evaluate(program.start_sector, num_disk_sectors,
+				   program.sector_size, regions, &region.start);
+	if (ret < 0)
+		return ret;
+
+	source = image::open(program.path, false);
+	if (!source)
+		return -errno;
+
+	n = source->read(0, program.image_size, &data);
+	if (n != (ssize_t)program.image_size)
+		return n < 0 ? n : -EIO;
+	region.data.assign(data, data + n);
+
+	/* Same extent as apply_program() will write */
+	num_sectors = (program.image_size + program.sector_size - 1) /
+				  program.sector_size;
+	if (program.num_sectors && num_sectors > program.num_sectors)
+		num_sectors = program.num_sectors;
+
+	region.program = &program;
+	region.skip = (uint64_t)program.file_offset * program.sector_size;
+	region.length = num_sectors * program.sector_size;
+	regions.push_back(std::move(region));
 
 	return 0;
 }
 
-int execute(patch_apply* dev) {
-	std::shared_ptr<Patch> patch;
+static bool covers(const program::Program& program,
+				   uint64_t num_disk_sectors,
+				   uint64_t sector) {
+	std::vector<Region> none;
+	uint64_t num_sectors;
+	uint64_t start;
+
+	if (evaluate(program.start_sector, num_disk_sectors, program.sector_size,
+				 none, &start) < 0)
+		return false;
+
+	num_sectors = (program.image_size + program.sector_size - 1) /
+				  program.sector_size;
+	if (program.num_sectors && num_sectors > program.num_sectors)
+		num_sectors = program.num_sectors;
+
+	return sector >= start && sector < start + num_sectors;
+}
+
+/**
+ * apply_on_host() - apply the DISK patches of one LUN to the GPT images
+ * @patches:		all patches of the plan
+ * @programs:		all programs of the plan
+ * @partition:		physical partition (LUN) to patch
+ * @num_disk_sectors:	size of the LUN, in sectors
+ * @regions:		receives the patched images, keyed by program
+ *
+ * The images of the programs written to the patched sectors are loaded and
+ * patched in patch order, so CRCs cover the data patched before them.
+ *
+ * Returns 0 on success, or negative errno if any patch of the LUN can't be
+ * applied on the host, in which case all of them should go to the device.
+ */
+int apply_on_host(const std::vector<Patch>& patches,
+				  const std::vector<program::Program>& programs,
+				  unsigned partition,
+				  uint64_t num_disk_sectors,
+				  std::vector<Region>& regions) {
+	Region* region;
+	uint64_t sector;
+	uint64_t offset;
+	uint64_t value;
+	bool loaded;
+	unsigned i;
 	int ret;
 
-	for (patch = patches; patch.get(); patch = patch->next) {
-		if (strcmp(patch->filename, "DISK"))
+	for (auto& patch : patches) {
+		if (!patch.filename || strcmp(patch.filename, "DISK") ||
+			patch.partition != partition)
 			continue;
 
-		ret = dev->apply_patch(patch);
-		if (ret)
+		if (patch.size_in_bytes > sizeof(value))
+			return -ENOTSUP;
+
+		ret = evaluate(patch.start_sector, num_disk_sectors, patch.sector_size,
+					   regions, &sector);
+		if (ret < 0)
 			return ret;
+
+		loaded = false;
+		for (auto& region : regions)
+			loaded |= region.program->sector_size == patch.sector_size &&
+					  covers(*region.program, num_disk_sectors, sector);
+		if (loaded)
+			continue;
+
+		for (auto& program : programs) {
+			if (program.partition != partition || !program.path ||
+				program.sector_size != patch.sector_size ||
+				!covers(program, num_disk_sectors, sector))
+				continue;
+
+			ret = load_region(program, num_disk_sectors, regions);
+			if (ret < 0)
+				return ret;
+			break;
+		}
+	}
+
+	for (auto& patch : patches) {
+		if (!patch.filename || strcmp(patch.filename, "DISK") ||
+			patch.partition != partition)
+			continue;
+
+		ret = evaluate(patch.start_sector, num_disk_sectors, patch.sector_size,
+					   regions, &sector);
+		if (ret < 0)
+			return ret;
+
+		if (!patch.sector_size ||
+			sector > (UINT64_MAX - patch.byte_offset) / patch.sector_size)
+			return -EINVAL;
+
+		offset = sector * patch.sector_size + patch.byte_offset;
+		ret = find_region(regions, patch.sector_size, offset,
+						  patch.size_in_bytes);
+		if (ret < 0)
+			return -ENOTSUP;
+		region = &regions[ret];
+
+		ret = evaluate(patch.value, num_disk_sectors, patch.sector_size,
+					   regions, &value);
+		if (ret < 0)
+			return ret;
+
+		/* Little endian, as GPT */
+		offset = region->skip + offset - region->start * patch.sector_size;
+		for (i = 0; i < patch.size_in_bytes; i++)
+			region->data[offset + i] = value >> (8 * i);
 	}
 
 	return 0;
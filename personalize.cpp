@@ -0,0 +1,332 @@
+#include "personalize.h"
+
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "image.h"
+#include "logger.h"
+#include "qdl.h"
+
+namespace personalize {
+
+/* Split off the next word of @line */
+static std::string word(const char** line) {
+	const char* p = *line;
+	const char* start;
+
+	while (isspace(*p))
+		p++;
+	start = p;
+	while (*p && !isspace(*p))
+		p++;
+	*line = p;
+
+	return std::string(start, p - start);
+}
+
+static bool number(const std::string& text, uint64_t* value) {
+	char* end;
+
+	errno = 0;
+	*value = strtoull(text.c_str(), &end, 0);
+
+	return !text.empty() && !*end && !errno;
+}
+
+/* The rest of @line, without surrounding white space */
+static std::string rest(const char* line) {
+	const char* end;
+
+	while (isspace(*line))
+		line++;
+	end = line + strlen(line);
+	while (end > line && isspace(end[-1]))
+		end--;
+
+	return std::string(line, end - line);
+}
+
+/* Read @name, relative to @dir, whole into @data */
+static int read_file(const std::string& dir,
+					 const std::string& name,
+					 std::vector<char>& data) {
+	std::unique_ptr<image::Source> source;
+	std::string path = name;
+	const char* chunk;
+	ssize_t n;
+
+	if (name[0] != '/' && !dir.empty())
+		path = dir + "/" + name;
+
+	source = image::open(path.c_str(), false);
+	if (!source) {
+		logger::error("[PERSONALIZE] unable to open %s", path.c_str());
+		return -ENOENT;
+	}
+
+	data.resize(source->size());
+	if (data.empty())
+		return 0;
+
+	n = source->read(0, data.size(), &chunk);
+	if (n < 0)
+		return n;
+
+	memcpy(data.data(), chunk, data.size());
+
+	return 0;
+}
+
+static int parse_field(const std::string& kind,
+					   const char* line,
+					   Field& field) {
+	if (!number(word(&line), &field.offset))
+		return -EINVAL;
+
+	if (kind == "string") {
+		field.kind = Field::STRING;
+		if (!number(word(&line), &field.length))
+			return -EINVAL;
+	} else if (kind == "u8" || kind == "u16" || kind == "u32" ||
+			   kind == "u64") {
+		field.kind = Field::INTEGER;
+		field.length = strtoul(kind.c_str() + 1, NULL, 10) / 8;
+	} else if (kind == "hex") {
+		field.kind = Field::HEX;
+	} else if (kind == "file") {
+		field.kind = Field::FILE;
+	} else if (kind == "crc32") {
+		field.kind = Field::CRC32;
+		if (!number(word(&line), &field.start) ||
+			!number(word(&line), &field.length))
+			return -EINVAL;
+		return rest(line).empty() ? 0 : -EINVAL;
+	} else {
+		return -EINVAL;
+	}
+
+	field.value = rest(line);
+
+	return field.value.empty() ? -EINVAL : 0;
+}
+
+/**
+ * load() - parse the personalization template at @path
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int Template::load(const char* path) {
+	Partition* partition = NULL;
+	std::string directive;
+	char buf[1024];
+	unsigned line = 0;
+	const char* p;
+	Field field;
+	FILE* fp;
+	int ret = 0;
+
+	this->path = path;
+	partitions.clear();
+
+	p = strrchr(path, '/');
+	dir = p ? std::string(path, p - path) : "";
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		ret = -errno;
+		logger::error("[PERSONALIZE] unable to open %s: %s", path,
+					  strerror(errno));
+		return ret;
+	}
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		line++;
+		p = buf;
+		directive = word(&p);
+		if (directive.empty() || directive[0] == '#')
+			continue;
+
+		if (directive == "partition") {
+			partitions.emplace_back();
+			partition = &partitions.back();
+			partition->label = word(&p);
+			if (partition->label.empty() || !rest(p).empty())
+				ret = -EINVAL;
+		} else if (!partition) {
+			ret = -EINVAL;
+		} else if (directive == "base") {
+			partition->base = rest(p);
+			if (partition->base.empty())
+				ret = -EINVAL;
+		} else if (directive == "size") {
+			if (!number(word(&p), &partition->size) || !partition->size)
+				ret = -EINVAL;
+		} else {
+			field = Field();
+			field.line = line;
+			ret = parse_field(directive, p, field);
+			if (!ret)
+				partition->fields.push_back(field);
+		}
+
+		if (ret < 0) {
+			logger::error("[PERSONALIZE] %s:%u: invalid \"%s\"", path, line,
+						  rest(buf).c_str());
+			break;
+		}
+	}
+	fclose(fp);
+
+	return ret;
+}
+
+static int apply(const Field& field,
+				 const std::string& dir,
+				 const Vars& vars,
+				 std::vector<char>& data) {
+	std::vector<char> bytes;
+	std::string value;
+	uint64_t number_value;
+	uint32_t crc;
+	size_t i;
+	int ret;
+
+	if (field.kind == Field::CRC32) {
+		if (field.start + field.length > data.size())
+			return -ERANGE;
+
+		crc = crc32(0, data.data() + field.start, field.length);
+		for (i = 0; i < sizeof(crc); i++)
+			bytes.push_back(crc >> (8 * i));
+	} else {
+		ret = expand(field.value, vars, value);
+		if (ret < 0)
+			return ret;
+	}
+
+	switch (field.kind) {
+		case Field::STRING:
+			if (value.size() > field.length)
+				return -ERANGE;
+			bytes.assign(value.begin(), value.end());
+			bytes.resize(field.length);
+			break;
+		case Field::INTEGER:
+			if (!number(value, &number_value) ||
+				(field.length < 8 && number_value >> (8 * field.length)))
+				return -ERANGE;
+			for (i = 0; i < field.length; i++)
+				bytes.push_back(number_value >> (8 * i));
+			break;
+		case Field::HEX:
+			if (value.size() % 2 ||
+				value.find_first_not_of("0123456789abcdefABCDEF") !=
+					std::string::npos)
+				return -EINVAL;
+			for (i = 0; i < value.size(); i += 2)
+				bytes.push_back(strtoul(value.substr(i, 2).c_str(), NULL, 16));
+			break;
+		case Field::FILE:
+			ret = read_file(dir, value, bytes);
+			if (ret < 0)
+				return ret;
+			break;
+		case Field::CRC32:
+			break;
+	}
+
+	if (field.offset + bytes.size() > data.size())
+		data.resize(field.offset + bytes.size());
+	std::copy(bytes.begin(), bytes.end(), data.begin() + field.offset);
+
+	return 0;
+}
+
+/**
+ * build() - build the contents of @program for the device described by
+ * @vars into @data
+ *
+ * Returns 1 if @data holds the contents, 0 if the template doesn't cover
+ * @program, negative errno on failure.
+ */
+int Template::build(const program::Program& program,
+					const Vars& vars,
+					std::vector<char>& data) const {
+	std::string base;
+	int ret;
+
+	for (auto& partition : partitions) {
+		if (partition.label != program.label)
+			continue;
+
+		data.clear();
+		if (!partition.base.empty()) {
+			ret = expand(partition.base, vars, base);
+			if (ret < 0)
+				return ret;
+			ret = read_file(dir, base, data);
+		} else if (program.path) {
+			ret = read_file("", program.path, data);
+		} else {
+			ret = 0;
+		}
+		if (ret < 0)
+			return ret;
+
+		if (partition.size)
+			data.resize(partition.size);
+
+		for (auto& field : partition.fields) {
+			ret = apply(field, dir, vars, data);
+			if (ret < 0) {
+				logger::error("[PERSONALIZE] %s:%u: %s", path.c_str(),
+							  field.line, strerror(-ret));
+				return ret;
+			}
+		}
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * expand() - replace the ${NAME} references in @text with @vars
+ *
+ * Returns 0 on success, -EINVAL if a variable isn't set.
+ */
+int expand(const std::string& text, const Vars& vars, std::string& out) {
+	size_t start;
+	size_t end;
+	size_t pos;
+
+	out.clear();
+	for (pos = 0;; pos = end + 1) {
+		start = text.find("${", pos);
+		if (start == std::string::npos)
+			break;
+
+		end = text.find('}', start);
+		if (end == std::string::npos)
+			break;
+
+		auto it = vars.find(text.substr(start + 2, end - start - 2));
+		if (it == vars.end()) {
+			logger::error("[PERSONALIZE] %s is not set",
+						  text.substr(start, end - start + 1).c_str());
+			return -EINVAL;
+		}
+
+		out += text.substr(pos, start - pos);
+		out += it->second;
+	}
+	out += text.substr(pos);
+
+	return 0;
+}
+
+}  // namespace personalize
@@ -0,0 +1,646 @@
+/*
+ * Precompiled flash plan
+ *
+ * A plan file holds the parsed rawprogram, patch and UFS entries together
+ * with the resolved image paths and sizes, in a flat format that is used
+ * directly from an mmap()ed copy of the file. It also records a stat
+ * fingerprint of every input (the XML files, the images and the candidate
+ * image paths that didn't exist) so that a plan that no longer matches the
+ * files on disk is detected and recompiled.
+ */
+#include "plan.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+#include "logger.h"
+#include "manifest.h"
+#include "patch.h"
+#include "program.h"
+#include "ufs.h"
+
+namespace plan {
+
+static const char plan_magic[8] = {'Q', 'D', 'L', 'P', 'L', 'A', 'N', '\0'};
+static const uint32_t plan_version = 1;
+static const uint32_t no_string = UINT32_MAX;
+
+enum : uint32_t {
+	PLAN_FINALIZE_PROVISIONING = 1 << 0,
+	PLAN_HAS_UFS = 1 << 1,
+};
+
+enum : uint32_t {
+	SOURCE_MANIFEST,
+	SOURCE_IMAGE,
+	SOURCE_ABSENT,
+};
+
+struct Header {
+	char magic[8];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t cwd;
+	uint32_t incdir;
+	uint32_t n_sources;
+	uint32_t n_programs;
+	uint32_t n_patches;
+	uint32_t n_ufs_bodies;
+	uint64_t sources;
+	uint64_t programs;
+	uint64_t patches;
+	uint64_t ufs;
+	uint64_t ufs_bodies;
+	uint64_t strings;
+	uint64_t size;
+};
+
+struct SourceRec {
+	uint32_t kind;
+	uint32_t path;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_ns;
+	int64_t ctime_ns;
+};
+
+struct ProgramRec {
+	uint32_t sector_size;
+	uint32_t file_offset;
+	uint32_t filename;
+	uint32_t label;
+	uint32_t num_sectors;
+	uint32_t partition;
+	uint32_t start_sector;
+	uint32_t path;
+	uint64_t image_size;
+};
+
+struct PatchRec {
+	uint32_t sector_size;
+	uint32_t byte_offset;
+	uint32_t filename;
+	uint32_t partition;
+	uint32_t size_in_bytes;
+	uint32_t start_sector;
+	uint32_t value;
+	uint32_t what;
+};
+
+struct UfsRec {
+	uint32_t bNumberLU;
+	uint32_t bBootEnable;
+	uint32_t bDescrAccessEn;
+	uint32_t bInitPowerMode;
+	uint32_t bHighPriorityLUN;
+	uint32_t bSecureRemovalType;
+	uint32_t bInitActiveICCLevel;
+	uint32_t wPeriodicRTCUpdate;
+	uint32_t bConfigDescrLock;
+	uint32_t LUNtoGrow;
+};
+
+struct UfsBodyRec {
+	uint32_t LUNum;
+	uint32_t bLUEnable;
+	uint32_t bBootLunID;
+	uint32_t size_in_kb;
+	uint32_t bDataReliability;
+	uint32_t bLUWriteProtect;
+	uint32_t bMemoryType;
+	uint32_t bLogicalBlockSize;
+	uint32_t bProvisioningType;
+	uint32_t wContextCapabilities;
+	uint32_t desc;
+	uint32_t reserved;
+};
+
+static_assert(sizeof(Header) % 8 == 0, "plan header must be 8 byte aligned");
+static_assert(sizeof(SourceRec) % 8 == 0,
+			  "plan source must be 8 byte aligned");
+static_assert(sizeof(ProgramRec) % 8 == 0,
+			  "plan program must be 8 byte aligned");
+static_assert(sizeof(PatchRec) % 8 == 0, "plan patch must be 8 byte aligned");
+static_assert(sizeof(UfsRec) % 8 == 0, "plan ufs must be 8 byte aligned");
+static_assert(sizeof(UfsBodyRec) % 8 == 0,
+			  "plan ufs body must be 8 byte aligned");
+
+static void fingerprint(SourceRec& rec, uint32_t kind, const struct stat* sb) {
+	memset(&rec, 0, sizeof(rec));
+	rec.kind = kind;
+	if (!sb)
+		return;
+
+	rec.dev = sb->st_dev;
+	rec.ino = sb->st_ino;
+	rec.size = sb->st_size;
+	rec.mtime_ns = sb->st_mtim.tv_sec * 1000000000LL + sb->st_mtim.tv_nsec;
+	rec.ctime_ns = sb->st_ctim.tv_sec * 1000000000LL + sb->st_ctim.tv_nsec;
+}
+
+struct Writer {
+	std::string strings;
+	std::unordered_map<std::string, uint32_t> offsets;
+
+	uint32_t str(const char* s) {
+		if (!s)
+			return no_string;
+
+		auto it = offsets.find(s);
+		if (it != offsets.end())
+			return it->second;
+
+		uint32_t offset = strings.size();
+		strings.append(s, strlen(s) + 1);
+		offsets.emplace(s, offset);
+
+		return offset;
+	}
+};
+
+/* The include directories as recorded in the header, one per line */
+static std::string join(const std::vector<const char*>& incdirs) {
+	std::string out;
+
+	for (auto dir : incdirs) {
+		if (!out.empty())
+			out += '\n';
+		out += dir;
+	}
+
+	return out;
+}
+
+template <typename T>
+static void append(std::string& out, const std::vector<T>& recs) {
+	out.append((const char*)recs.data(), recs.size() * sizeof(T));
+}
+
+static int write_plan(const Plan& plan,
+					  const char* plan_file,
+					  std::vector<SourceRec>& sources,
+					  std::vector<std::string>& source_paths,
+					  const std::vector<const char*>& incdirs,
+					  bool finalize_provisioning) {
+	std::vector<ProgramRec> programs;
+	std::vector<UfsBodyRec> bodies;
+	std::vector<PatchRec> patches;
+	std::string tmp_file;
+	std::string out;
+	char cwd[PATH_MAX];
+	Writer w;
+	Header hdr = {};
+	UfsRec ufs = {};
+	size_t i;
+	ssize_t n;
+	int fd;
+
+	if (!getcwd(cwd, sizeof(cwd)))
+		return -errno;
+
+	memcpy(hdr.magic, plan_magic, sizeof(hdr.magic));
+	hdr.version = plan_version;
+	hdr.cwd = w.str(cwd);
+	hdr.incdir = incdirs.empty() ? no_string : w.str(join(incdirs).c_str());
+	if (finalize_provisioning)
+		hdr.flags |= PLAN_FINALIZE_PROVISIONING;
+
+	for (i = 0; i < sources.size(); i++)
+		sources[i].path = w.str(source_paths[i].c_str());
+
+	for (auto& program : plan.programs) {
+		ProgramRec rec = {};
+
+		rec.sector_size = program.sector_size;
+		rec.file_offset = program.file_offset;
+		rec.filename = w.str(program.filename);
+		rec.label = w.str(program.label);
+		rec.num_sectors = program.num_sectors;
+		rec.partition = program.partition;
+		rec.start_sector = w.str(program.start_sector);
+		rec.path = w.str(program.path);
+		rec.image_size = program.image_size;
+		programs.push_back(rec);
+	}
+
+	for (auto& patch : plan.patches) {
+		PatchRec rec = {};
+
+		rec.sector_size = patch.sector_size;
+		rec.byte_offset = patch.byte_offset;
+		rec.filename = w.str(patch.filename);
+		rec.partition = patch.partition;
+		rec.size_in_bytes = patch.size_in_bytes;
+		rec.start_sector = w.str(patch.start_sector);
+		rec.value = w.str(patch.value);
+		rec.what = w.str(patch.what);
+		patches.push_back(rec);
+	}
+
+	auto& config = plan.ufs;
+	if (config.common) {
+		hdr.flags |= PLAN_HAS_UFS;
+		ufs.bNumberLU = config.common->bNumberLU;
+		ufs.bBootEnable = config.common->bBootEnable;
+		ufs.bDescrAccessEn = config.common->bDescrAccessEn;
+		ufs.bInitPowerMode = config.common->bInitPowerMode;
+		ufs.bHighPriorityLUN = config.common->bHighPriorityLUN;
+		ufs.bSecureRemovalType = config.common->bSecureRemovalType;
+		ufs.bInitActiveICCLevel = config.common->bInitActiveICCLevel;
+		ufs.wPeriodicRTCUpdate = config.common->wPeriodicRTCUpdate;
+		ufs.bConfigDescrLock = config.common->bConfigDescrLock;
+		ufs.LUNtoGrow = config.epilogue->LUNtoGrow;
+
+		for (auto& body : config.bodies) {
+			UfsBodyRec rec = {};
+
+			rec.LUNum = body.LUNum;
+			rec.bLUEnable = body.bLUEnable;
+			rec.bBootLunID = body.bBootLunID;
+			rec.size_in_kb = body.size_in_kb;
+			rec.bDataReliability = body.bDataReliability;
+			rec.bLUWriteProtect = body.bLUWriteProtect;
+			rec.bMemoryType = body.bMemoryType;
+			rec.bLogicalBlockSize = body.bLogicalBlockSize;
+			rec.bProvisioningType = body.bProvisioningType;
+			rec.wContextCapabilities = body.wContextCapabilities;
+			rec.desc = w.str(body.desc);
+			bodies.push_back(rec);
+		}
+	}
+
+	hdr.n_sources = sources.size();
+	hdr.n_programs = programs.size();
+	hdr.n_patches = patches.size();
+	hdr.n_ufs_bodies = bodies.size();
+
+	hdr.sources = sizeof(hdr);
+	hdr.programs = hdr.sources + sources.size() * sizeof(SourceRec);
+	hdr.patches = hdr.programs + programs.size() * sizeof(ProgramRec);
+	hdr.ufs = hdr.patches + patches.size() * sizeof(PatchRec);
+	hdr.ufs_bodies = hdr.ufs + sizeof(UfsRec);
+	hdr.strings = hdr.ufs_bodies + bodies.size() * sizeof(UfsBodyRec);
+	hdr.size = hdr.strings + w.strings.size();
+
+	out.reserve(hdr.size);
+	out.append((const char*)&hdr, sizeof(hdr));
+	append(out, sources);
+	append(out, programs);
+	append(out, patches);
+	out.append((const char*)&ufs, sizeof(ufs));
+	append(out, bodies);
+	out.append(w.strings);
+
+	/* Write to a temporary and rename, so a reader never sees a partial plan */
+	tmp_file = std::string(plan_file) + ".XXXXXX";
+	fd = mkstemp(&tmp_file[0]);
+	if (fd < 0)
+		return -errno;
+	fchmod(fd, 0644);
+
+	n = ::write(fd, out.data(), out.size());
+	if (n != (ssize_t)out.size() || fsync(fd) < 0) {
+		close(fd);
+		unlink(tmp_file.c_str());
+		return n < 0 ? -errno : -EIO;
+	}
+	close(fd);
+
+	if (rename(tmp_file.c_str(), plan_file) < 0) {
+		unlink(tmp_file.c_str());
+		return -errno;
+	}
+
+	return 0;
+}
+
+/**
+ * compile() - parse, resolve and validate a flash plan and store it
+ *
+ * Returns 0 on success, negative errno on failure.
+ *
+ * On success the manifests are loaded and resolved in memory as well, so the
+ * caller can continue flashing without reading back @plan_file.
+ */
+int compile(Plan& plan,
+			const char* plan_file,
+			const std::vector<const char*>& files,
+			const std::vector<const char*>& incdirs,
+			bool finalize_provisioning) {
+	std::vector<std::string> source_paths;
+	std::vector<SourceRec> sources;
+	struct stat sb;
+	SourceRec rec;
+	int ret;
+
+	if (files.empty()) {
+		logger::error("[PLAN] no manifests given to compile %s", plan_file);
+		return -EINVAL;
+	}
+
+	for (auto file : files) {
+		if (stat(file, &sb) < 0) {
+			ret = -errno;
+			logger::error("[PLAN] unable to stat %s", file);
+			return ret;
+		}
+
+		fingerprint(rec, SOURCE_MANIFEST, &sb);
+		sources.push_back(rec);
+		source_paths.push_back(file);
+	}
+
+	ret = manifest::load(plan, files, finalize_provisioning);
+	if (ret < 0)
+		return ret;
+
+	program::resolve(plan.programs, plan.strings, incdirs,
+					 [&](const char* path, const struct stat* sb) {
+						 fingerprint(rec, sb ? SOURCE_IMAGE : SOURCE_ABSENT,
+									 sb);
+						 sources.push_back(rec);
+						 source_paths.push_back(path);
+					 });
+
+	for (auto& program : plan.programs) {
+		if (!program.filename)
+			continue;
+
+		if (!program.path) {
+			logger::warn("[PLAN] %s not found", program.filename);
+			continue;
+		}
+
+		logger::info("[PLAN] %s: %s", program.label, program.path);
+
+		if (program.num_sectors &&
+			program.image_size >
+				(uint64_t)program.num_sectors * program.sector_size) {
+			logger::warn(
+				"[PLAN] %s (%llu bytes) exceeds partition %s (%llu bytes) and "
+				"will be truncated",
+				program.path, (unsigned long long)program.image_size,
+				program.label,
+				(unsigned long long)program.num_sectors * program.sector_size);
+		}
+	}
+
+	ret = write_plan(plan, plan_file, sources, source_paths, incdirs,
+					 finalize_provisioning);
+	if (ret < 0) {
+		logger::error("[PLAN] failed to write %s: %s", plan_file,
+					  strerror(-ret));
+		return ret;
+	}
+
+	logger::notice("[PLAN] compiled %zu programs and %zu patches into %s",
+				   plan.programs.size(), plan.patches.size(),
+				   plan_file);
+
+	return 0;
+}
+
+static bool fresh(const SourceRec& rec, const char* path) {
+	struct stat sb;
+	SourceRec now;
+
+	if (stat(path, &sb) < 0 || !S_ISREG(sb.st_mode))
+		return rec.kind == SOURCE_ABSENT;
+	if (rec.kind == SOURCE_ABSENT)
+		return false;
+
+	fingerprint(now, rec.kind, &sb);
+
+	return now.dev == rec.dev && now.ino == rec.ino && now.size == rec.size &&
+		   now.mtime_ns == rec.mtime_ns && now.ctime_ns == rec.ctime_ns;
+}
+
+/*
+ * Map @plan_file and, if it is intact and still matches the arguments and
+ * the files on disk, install its entries in @plan. On return @manifests holds
+ * the manifest list recorded in the plan, if the plan could be read at all;
+ * it points into the mapping which @plan keeps alive.
+ */
+static int try_load(Plan& plan,
+					const char* plan_file,
+					const std::vector<const char*>& files,
+					const std::vector<const char*>& incdirs,
+					bool finalize_provisioning,
+					std::vector<const char*>& manifests) {
+	const UfsBodyRec* bodies;
+	const ProgramRec* programs;
+	const SourceRec* sources;
+	const PatchRec* patches;
+	const Header* hdr;
+	const UfsRec* ufs;
+	const char* strings;
+	char cwd[PATH_MAX];
+	struct stat sb;
+	uint32_t i;
+	void* ptr;
+	int fd;
+
+	fd = open(plan_file, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof(Header)) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	ptr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED)
+		return -errno;
+
+	hdr = (const Header*)ptr;
+	if (memcmp(hdr->magic, plan_magic, sizeof(plan_magic)) ||
+		hdr->version != plan_version || hdr->size != (uint64_t)sb.st_size ||
+		hdr->sources != sizeof(Header) ||
+		hdr->programs !=
+			hdr->sources + (uint64_t)hdr->n_sources * sizeof(SourceRec) ||
+		hdr->patches !=
+			hdr->programs + (uint64_t)hdr->n_programs * sizeof(ProgramRec) ||
+		hdr->ufs !=
+			hdr->patches + (uint64_t)hdr->n_patches * sizeof(PatchRec) ||
+		hdr->ufs_bodies != hdr->ufs + sizeof(UfsRec) ||
+		hdr->strings != hdr->ufs_bodies +
+							(uint64_t)hdr->n_ufs_bodies * sizeof(UfsBodyRec) ||
+		hdr->strings > hdr->size ||
+		(hdr->size > hdr->strings && ((char*)ptr)[hdr->size - 1] != '\0')) {
+		munmap(ptr, sb.st_size);
+		return -EINVAL;
+	}
+
+	/* Keep the mapping even if stale, @manifests points into it */
+	plan.mapping = std::shared_ptr<void>(
+		ptr, [size = sb.st_size](void* p) { munmap(p, size); });
+
+	sources = (const SourceRec*)((char*)ptr + hdr->sources);
+	programs = (const ProgramRec*)((char*)ptr + hdr->programs);
+	patches = (const PatchRec*)((char*)ptr + hdr->patches);
+	ufs = (const UfsRec*)((char*)ptr + hdr->ufs);
+	bodies = (const UfsBodyRec*)((char*)ptr + hdr->ufs_bodies);
+	strings = (char*)ptr + hdr->strings;
+
+	auto str = [&](uint32_t offset) -> const char* {
+		if (offset == no_string || offset >= hdr->size - hdr->strings)
+			return NULL;
+		return strings + offset;
+	};
+
+	for (i = 0; i < hdr->n_sources; i++) {
+		if (sources[i].kind == SOURCE_MANIFEST && str(sources[i].path))
+			manifests.push_back(str(sources[i].path));
+	}
+
+	/* The plan must have been compiled for the same invocation... */
+	if (!files.empty() && files.size() != manifests.size())
+		goto stale;
+	for (i = 0; i < files.size(); i++) {
+		if (strcmp(files[i], manifests[i]))
+			goto stale;
+	}
+	if (!getcwd(cwd, sizeof(cwd)) || !str(hdr->cwd) ||
+		strcmp(cwd, str(hdr->cwd)))
+		goto stale;
+	if (incdirs.empty() != !str(hdr->incdir) ||
+		(str(hdr->incdir) && join(incdirs) != str(hdr->incdir)))
+		goto stale;
+	if (!finalize_provisioning != !(hdr->flags & PLAN_FINALIZE_PROVISIONING))
+		goto stale;
+
+	/* ...and none of the files it was compiled from may have changed */
+	for (i = 0; i < hdr->n_sources; i++) {
+		if (!str(sources[i].path) || !fresh(sources[i], str(sources[i].path)))
+			goto stale;
+	}
+
+	{
+		ufs::Config config;
+		int ret;
+
+		for (i = 0; i < hdr->n_programs; i++) {
+			const ProgramRec& rec = programs[i];
+			program::Program program;
+
+			program.sector_size = rec.sector_size;
+			program.file_offset = rec.file_offset;
+			program.filename = str(rec.filename);
+			program.label = str(rec.label);
+			program.num_sectors = rec.num_sectors;
+			program.partition = rec.partition;
+			program.start_sector = str(rec.start_sector);
+			program.path = str(rec.path);
+			program.image_size = rec.image_size;
+			plan.programs.push_back(program);
+		}
+
+		for (i = 0; i < hdr->n_patches; i++) {
+			const PatchRec& rec = patches[i];
+			patch::Patch patch;
+
+			patch.sector_size = rec.sector_size;
+			patch.byte_offset = rec.byte_offset;
+			patch.filename = str(rec.filename);
+			patch.partition = rec.partition;
+			patch.size_in_bytes = rec.size_in_bytes;
+			patch.start_sector = str(rec.start_sector);
+			patch.value = str(rec.value);
+			patch.what = str(rec.what);
+			plan.patches.push_back(patch);
+		}
+
+		if (hdr->flags & PLAN_HAS_UFS) {
+			config.common.emplace();
+			config.common->bNumberLU = ufs->bNumberLU;
+			config.common->bBootEnable = ufs->bBootEnable;
+			config.common->bDescrAccessEn = ufs->bDescrAccessEn;
+			config.common->bInitPowerMode = ufs->bInitPowerMode;
+			config.common->bHighPriorityLUN = ufs->bHighPriorityLUN;
+			config.common->bSecureRemovalType = ufs->bSecureRemovalType;
+			config.common->bInitActiveICCLevel = ufs->bInitActiveICCLevel;
+			config.common->wPeriodicRTCUpdate = ufs->wPeriodicRTCUpdate;
+			config.common->bConfigDescrLock = ufs->bConfigDescrLock;
+			config.epilogue.emplace();
+			config.epilogue->LUNtoGrow = ufs->LUNtoGrow;
+
+			for (i = 0; i < hdr->n_ufs_bodies; i++) {
+				const UfsBodyRec& rec = bodies[i];
+				ufs::Body body;
+
+				body.LUNum = rec.LUNum;
+				body.bLUEnable = rec.bLUEnable;
+				body.bBootLunID = rec.bBootLunID;
+				body.size_in_kb = rec.size_in_kb;
+				body.bDataReliability = rec.bDataReliability;
+				body.bLUWriteProtect = rec.bLUWriteProtect;
+				body.bMemoryType = rec.bMemoryType;
+				body.bLogicalBlockSize = rec.bLogicalBlockSize;
+				body.bProvisioningType = rec.bProvisioningType;
+				body.wContextCapabilities = rec.wContextCapabilities;
+				body.desc = str(rec.desc);
+				config.bodies.push_back(body);
+			}
+
+			ret = ufs::install(plan.ufs, config, plan_file,
+							   finalize_provisioning);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	return 0;
+
+stale:
+	return -ESTALE;
+}
+
+/**
+ * load() - use the flash plan in @plan_file, compiling it when needed
+ *
+ * Returns 0 on success, negative errno on failure.
+ *
+ * If @files is empty the manifests recorded in the plan are used. A missing,
+ * corrupt or outdated plan is recompiled from the manifests.
+ */
+int load(Plan& plan,
+		 const char* plan_file,
+		 const std::vector<const char*>& files,
+		 const std::vector<const char*>& incdirs,
+		 bool finalize_provisioning) {
+	std::vector<const char*> manifests;
+	int ret;
+
+	ret = try_load(plan, plan_file, files, incdirs, finalize_provisioning,
+				   manifests);
+	if (ret == 0)
+		return 0;
+
+	if (ret == -ESTALE)
+		logger::notice("[PLAN] %s is outdated", plan_file);
+	else if (ret != -ENOENT)
+		logger::warn("[PLAN] unable to use %s: %s", plan_file, strerror(-ret));
+
+	/* Drop anything installed by a plan failing half way */
+	plan.programs.clear();
+	plan.patches.clear();
+	plan.ufs = ufs::Config();
+
+	return compile(plan, plan_file, files.empty() ? manifests : files,
+				   incdirs, finalize_provisioning);
+}
+
+}  // namespace plan
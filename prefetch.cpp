@@ -0,0 +1,169 @@
+/*
+ * Image prefetch
+ *
+ * While the programmer is uploaded and boots nothing reads the images, so a
+ * background thread walks the plan in flashing order and asks the kernel to
+ * read the images into the page cache ahead of apply_program(). The amount
+ * of data prefetched but not yet consumed is bounded by a budget, the window
+ * slides forward as apply_program() reports the bytes it has read.
+ */
+#include "prefetch.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "archive.h"
+
+namespace prefetch {
+
+static const size_t chunk_size = 8 * 1024 * 1024;
+
+Prefetcher::~Prefetcher() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stop = true;
+	}
+	cond.notify_one();
+
+	if (thread.joinable())
+		thread.join();
+}
+
+bool Prefetcher::wait_for_window(size_t len) {
+	std::unique_lock<std::mutex> guard(lock);
+
+	cond.wait(guard,
+			  [this, len] { return stop || issued + len <= done + window; });
+	issued += len;
+
+	return !stop;
+}
+
+void Prefetcher::worker() {
+	std::shared_ptr<const archive::Archive> archive;
+	const archive::Entry* entry;
+	uint64_t base;
+	uint64_t offset;
+	size_t len;
+	int fd;
+
+	for (auto& range : ranges) {
+		if (range.offset >= range.end)
+			continue;
+
+		/* Members of an archive, deflated ones in proportion */
+		entry = NULL;
+		fd = open(range.path, O_RDONLY);
+		if (fd < 0 && archive::locate(range.path, archive, &entry) == 0)
+			fd = open(archive->path(), O_RDONLY);
+		if (fd < 0) {
+			/* It will be skipped when flashing as well */
+			std::lock_guard<std::mutex> guard(lock);
+			issued += range.end - range.offset;
+			continue;
+		}
+
+		for (offset = range.offset; offset < range.end; offset += len) {
+			len = std::min<uint64_t>(chunk_size, range.end - offset);
+
+			if (!wait_for_window(len)) {
+				close(fd);
+				return;
+			}
+			if (entry) {
+				/* 128 bits, as offset * csize overflows for large members */
+				base = entry->offset +
+					   (unsigned __int128)offset * entry->csize / entry->size;
+				posix_fadvise(
+					fd, base,
+					(unsigned __int128)len * entry->csize / entry->size + 1,
+					POSIX_FADV_WILLNEED);
+			} else {
+				posix_fadvise(fd, offset, len, POSIX_FADV_WILLNEED);
+			}
+		}
+
+		close(fd);
+	}
+}
+
+/**
+ * start() - start prefetching the images of the resolved programs
+ * @programs:	programs in flashing order, must outlive the prefetcher
+ * @budget:	maximum number of bytes prefetched ahead of the flashing
+ */
+void Prefetcher::start(const std::vector<program::Program>& programs,
+					   size_t budget) {
+	uint64_t total = 0;
+	Range range;
+
+	if (!budget || thread.joinable())
+		return;
+
+	for (auto& program : programs) {
+		range.path = program.path;
+		range.offset = (uint64_t)program.file_offset * program.sector_size;
+		range.end = program.path ? program.image_size : 0;
+		if (program.num_sectors)
+			range.end = std::min<uint64_t>(
+				range.end, range.offset + (uint64_t)program.num_sectors *
+											  program.sector_size);
+		if (range.offset < range.end)
+			total += range.end - range.offset;
+
+		ranges.push_back(range);
+		marks.push_back(total);
+	}
+
+	window = std::max(budget, chunk_size);
+
+	thread = std::thread(&Prefetcher::worker, this);
+}
+
+/**
+ * consumed() - report image data read by the flashing loop
+ */
+void Prefetcher::consumed(size_t bytes) {
+	if (!window)
+		return;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		done += bytes;
+	}
+	cond.notify_one();
+}
+
+/**
+ * finished() - report that program @idx has been flashed or skipped
+ */
+void Prefetcher::finished(size_t idx) {
+	if (!window || idx >= marks.size())
+		return;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		done = std::max(done, marks[idx]);
+	}
+	cond.notify_one();
+}
+
+/**
+ * pin() - run the prefetch thread on @cpu
+ */
+void Prefetcher::pin(int cpu) {
+	cpu_set_t set;
+
+	if (!thread.joinable() || cpu < 0)
+		return;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+}
+
+}  // namespace prefetch
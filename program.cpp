@@ -30,113 +30,255 @@
  */
 #include "program.h"
 
+#include <dirent.h>
 #include <fcntl.h>
-#include <libxml/parser.h>
-#include <libxml/tree.h>
 #include <unistd.h>
 
 #include <cerrno>
 #include <cstring>
-#include <iostream>
-#include <sstream>
+#include <string>
+#include <unordered_map>
 
-#include "qdl.h"
+#include "archive.h"
+#include "fanout.h"
+#include "logger.h"
+#include "prefetch.h"
 
 namespace program {
 
-static std::shared_ptr<Program> programes;
-static std::shared_ptr<Program> programes_last;
-
-int load(const char* program_file) {
-	std::shared_ptr<Program> program;
-	xmlNode* node;
-	xmlNode* root;
-	xmlDoc* doc;
+int parse(xmlTextReaderPtr reader,
+		  manifest::Arena& strings,
+		  std::vector<Program>& programs) {
+	Program program;
+	const xmlChar* name;
 	int errors;
 
-	doc = xmlReadFile(program_file, NULL, 0);
-	if (!doc) {
-		std::cerr << "[PROGRAM] failed to parse " << program_file << std::endl;
-		return -EINVAL;
+	name = xmlTextReaderConstName(reader);
+	if (xmlStrcmp(name, (xmlChar*)"program")) {
+		logger::warn("[PROGRAM] unrecognized tag \"%s\", ignoring", name);
+		return 0;
+	}
+
+	errors = 0;
+
+	program.sector_size =
+		manifest::attr_as_unsigned(reader, "SECTOR_SIZE_IN_BYTES", &errors);
+	program.file_offset =
+		manifest::attr_as_unsigned(reader, "file_sector_offset", &errors);
+	program.filename =
+		manifest::attr_as_string(reader, "filename", &errors, strings);
+	program.label = manifest::attr_as_string(reader, "label", &errors, strings);
+	program.num_sectors =
+		manifest::attr_as_unsigned(reader, "num_partition_sectors", &errors);
+	program.partition = manifest::attr_as_unsigned(
+		reader, "physical_partition_number", &errors);
+	program.start_sector =
+		manifest::attr_as_string(reader, "start_sector", &errors, strings);
+	program.path = NULL;
+	program.image_size = 0;
+
+	if (errors) {
+		logger::error("[PROGRAM] errors while parsing program");
+		return 0;
+	}
+
+	programs.push_back(program);
+
+	return 0;
+}
+
+static bool probe_path(Program& program, const char* path, probe_fn& probe) {
+	struct stat sb;
+
+	if (stat(path, &sb) < 0 || !S_ISREG(sb.st_mode)) {
+		if (probe)
+			probe(path, NULL);
+		return false;
 	}
 
-	root = xmlDocGetRootElement(doc);
-	for (node = root->children; node; node = node->next) {
-		if (node->type != XML_ELEMENT_NODE)
+	if (probe)
+		probe(path, &sb);
+
+	program.path = path;
+	program.image_size = sb.st_size;
+
+	return true;
+}
+
+/* Take the image of @program from the @archive at @incdir */
+static bool probe_member(Program& program,
+						 const char* incdir,
+						 const archive::Archive& archive,
+						 manifest::Arena& strings) {
+	const archive::Entry* entry;
+	std::string tmp;
+
+	entry = archive.find(program.filename);
+	if (!entry)
+		return false;
+
+	tmp = std::string(incdir) + ARCHIVE_SEPARATOR + entry->name;
+	program.path = strings.strdup(tmp.c_str(), tmp.size());
+	program.image_size = entry->size;
+
+	return true;
+}
+
+/*
+ * Scan @incdirs once into a map from file name to the index of the first
+ * directory holding it. Those that are archives are indexed into @archives,
+ * and passed to @probe as a whole.
+ */
+static void scan(const std::vector<const char*>& incdirs,
+				 std::unordered_map<std::string, size_t>& index,
+				 std::vector<std::shared_ptr<const archive::Archive>>& archives,
+				 probe_fn& probe) {
+	struct dirent* de;
+	struct stat sb;
+	size_t slash;
+	size_t i;
+	DIR* dir;
+
+	archives.assign(incdirs.size(), nullptr);
+
+	for (i = 0; i < incdirs.size(); i++) {
+		if (stat(incdirs[i], &sb) == 0 && S_ISREG(sb.st_mode)) {
+			archives[i] = archive::open(incdirs[i]);
+			if (!archives[i])
+				continue;
+
+			if (probe)
+				probe(incdirs[i], &sb);
+
+			for (auto& entry : archives[i]->entries()) {
+				slash = entry.name.rfind('/');
+				index.emplace(slash == std::string::npos
+								  ? entry.name
+								  : entry.name.substr(slash + 1),
+							  i);
+			}
 			continue;
+		}
 
-		if (xmlStrcmp(node->name, (xmlChar*)"program")) {
-			std::cerr << "[PROGRAM] unrecognized tag \"" << node->name
-					  << "\", ignoring" << std::endl;
+		dir = opendir(incdirs[i]);
+		if (!dir) {
+			logger::warn("[PROGRAM] unable to read %s: %s", incdirs[i],
+						 strerror(errno));
 			continue;
 		}
 
-		errors = 0;
+		while ((de = readdir(dir)) != NULL) {
+			if (de->d_type != DT_REG && de->d_type != DT_LNK &&
+				de->d_type != DT_UNKNOWN)
+				continue;
+
+			index.emplace(de->d_name, i);
+		}
+
+		closedir(dir);
+	}
+}
 
-		program = std::make_shared<Program>();
+/**
+ * resolve() - locate the image file of each program
+ *
+ * Images are looked up in the @incdirs in order, the first one having the
+ * file wins, and then relative to the current directory. The directories
+ * are read once up front rather than probed for every program, and those
+ * that are tar or zip archives are indexed instead, see archive.h. Programs
+ * whose image can't be found are left with a NULL path and are skipped by
+ * execute(). @probe, if given, is told about every path looked at, found or
+ * not, including the directories earlier in the list not having the file.
+ */
+void resolve(std::vector<Program>& programs,
+			 manifest::Arena& strings,
+			 const std::vector<const char*>& incdirs,
+			 probe_fn probe) {
+	std::vector<std::shared_ptr<const archive::Archive>> archives;
+	std::unordered_map<std::string, size_t> index;
+	std::string tmp;
+	size_t first;
+	size_t i;
 
-		program->sector_size =
-			attr_as_unsigned(node, "SECTOR_SIZE_IN_BYTES", &errors);
-		program->file_offset =
-			attr_as_unsigned(node, "file_sector_offset", &errors);
-		program->filename = attr_as_string(node, "filename", &errors);
-		program->label = attr_as_string(node, "label", &errors);
-		program->num_sectors =
-			attr_as_unsigned(node, "num_partition_sectors", &errors);
-		program->partition =
-			attr_as_unsigned(node, "physical_partition_number", &errors);
-		program->start_sector = attr_as_string(node, "start_sector", &errors);
+	scan(incdirs, index, archives, probe);
 
-		if (errors) {
-			std::cerr << "[PROGRAM] errors while parsing program" << std::endl;
+	for (auto& program : programs) {
+		program.path = NULL;
+		program.image_size = 0;
+
+		if (!program.filename)
 			continue;
-		}
 
-		if (programes) {
-			programes_last->next = program;
-			programes_last = program;
+		/* Names with a directory part aren't indexed, probe each */
+		if (strchr(program.filename, '/')) {
+			first = 0;
 		} else {
-			programes = program;
-			programes_last = program;
+			auto it = index.find(program.filename);
+			first = it == index.end() ? incdirs.size() : it->second;
+
+			for (i = 0; probe && i < first; i++) {
+				if (archives[i])
+					continue;
+				tmp = std::string(incdirs[i]) + "/" + program.filename;
+				probe(tmp.c_str(), NULL);
+			}
 		}
-	}
 
-	xmlFreeDoc(doc);
+		for (i = first; i < incdirs.size(); i++) {
+			if (archives[i]) {
+				if (probe_member(program, incdirs[i], *archives[i], strings))
+					break;
+				continue;
+			}
 
-	return 0;
+			tmp = std::string(incdirs[i]) + "/" + program.filename;
+			if (probe_path(program, strings.strdup(tmp.c_str(), tmp.size()),
+						   probe))
+				break;
+		}
+		if (program.path)
+			continue;
+
+		probe_path(program, program.filename, probe);
+	}
 }
 
-int execute(program_apply* ptr, const char* incdir) {
-	std::shared_ptr<Program> program;
-	const char* filename;
-	char tmp[PATH_MAX + 1];
+int execute(const std::vector<Program>& programs,
+			program_apply* ptr,
+			bool direct_io,
+			prefetch::Prefetcher* prefetch,
+			fanout::Reader* shared) {
+	std::unique_ptr<image::Source> replacement;
+	std::unique_ptr<image::Source> source;
 	int ret;
-	int fd;
 
-	for (program = programes; program; program = program->next) {
-		if (!program->filename)
+	for (auto& program : programs) {
+		replacement = ptr->replace(program);
+		if (!program.filename && !replacement)
 			continue;
 
-		filename = program->filename;
-		if (incdir) {
-			std::stringstream ss;
-			ss << incdir << "/" << filename;
-			strncpy(tmp, ss.str().c_str(), PATH_MAX);
-			if (access(tmp, F_OK) != -1)
-				filename = tmp;
-		}
-
-		fd = open(filename, O_RDONLY);
+		if (!program.path)
+			source = nullptr;
+		else if (shared)
+			source = shared->open(program.path);
+		else if (!replacement)
+			source = image::open(program.path, direct_io);
 
-		if (fd < 0) {
-			std::cout << "Unable to open " << program->filename << "...ignoring"
-					  << std::endl;
+		/* Opened anyway, so the sessions sharing reads don't wait for us */
+		if (replacement)
+			source = std::move(replacement);
+		if (!source) {
+			logger::info("Unable to open %s...ignoring", program.filename);
+			if (prefetch)
+				prefetch->finished(&program - programs.data());
 			continue;
 		}
 
-		ret = ptr->apply_program(program, fd);
+		ret = ptr->apply_program(program, *source);
+		if (prefetch)
+			prefetch->finished(&program - programs.data());
 
-		close(fd);
+		source.reset();
 		if (ret)
 			return ret;
 	}
@@ -153,20 +295,19 @@ int execute(program_apply* ptr, const char* incdir) {
  * and return the partition number for this. If more than one line matches
  * we're assuming our logic is flawed and return an error.
  */
-int find_bootable_partition(void) {
-	std::shared_ptr<Program> program;
+int find_bootable_partition(const std::vector<Program>& programs) {
 	const char* label;
 	int part = -ENOENT;
 
-	for (program = programes; program; program = program->next) {
-		label = program->label;
+	for (auto& program : programs) {
+		label = program.label;
 
 		if (!strcmp(label, "xbl") || !strcmp(label, "xbl_a") ||
 			!strcmp(label, "sbl1")) {
 			if (part != -ENOENT)
 				return -EINVAL;
 
-			part = program->partition;
+			part = program.partition;
 		}
 	}
 
@@ -0,0 +1,189 @@
+#include "progress.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "logger.h"
+
+/* Minimum time between two progress events */
+#define PROGRESS_INTERVAL std::chrono::milliseconds(250)
+/* Weight of the latest sample in the throughput average */
+#define PROGRESS_EWMA_ALPHA 0.2
+
+namespace progress {
+
+Stream::~Stream() {
+	if (owned)
+		close(fd);
+}
+
+/**
+ * open() - start writing events to @spec
+ * @spec:	"fd:<N>" for an open file descriptor, or the path of a listening
+ *		Unix socket
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int Stream::open(const char* spec) {
+	struct sockaddr_un addr = {};
+	int ret;
+
+	if (!strncmp(spec, "fd:", 3)) {
+		fd = atoi(spec + 3);
+		return fcntl(fd, F_GETFD) < 0 ? -EBADF : 0;
+	}
+
+	if (strlen(spec) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, spec);
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		ret = -errno;
+		logger::error("[PROGRESS] unable to connect to %s: %s", spec,
+					  strerror(errno));
+		close(fd);
+		fd = -1;
+		return ret;
+	}
+
+	/* A stalled reader must not stall the flashing, events are dropped */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	owned = true;
+
+	return 0;
+}
+
+double Stream::now() const {
+	return std::chrono::duration<double>(clock::now() - start).count();
+}
+
+void Stream::emit(const char* fmt, ...) {
+	struct pollfd pfd;
+	char line[512];
+	va_list ap;
+	int len;
+
+	if (fd < 0)
+		return;
+
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+	va_end(ap);
+
+	if (len < 0 || len >= (int)sizeof(line) - 1)
+		return;
+	line[len++] = '\n';
+
+	if (owned) {
+		send(fd, line, len, MSG_NOSIGNAL);
+		return;
+	}
+
+	/* Not ours to make non-blocking, drop the event rather than wait */
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLOUT))
+		return;
+
+	if (::write(fd, line, len) < 0 && errno == EPIPE)
+		fd = -1;
+}
+
+/* @text as the contents of a JSON string */
+static std::string escape(const char* text) {
+	std::string out;
+	char hex[8];
+
+	for (; *text; text++) {
+		if (*text == '"' || *text == '\\') {
+			out += '\\';
+			out += *text;
+		} else if ((unsigned char)*text < 0x20) {
+			snprintf(hex, sizeof(hex), "\\u%04x", *text);
+			out += hex;
+		} else {
+			out += *text;
+		}
+	}
+
+	return out;
+}
+
+/**
+ * set_device() - name the USB device of the session in the events
+ */
+void Stream::set_device(const char* name) {
+	device = escape(name ? name : "");
+}
+
+void Stream::phase(const char* name) {
+	emit("{\"event\":\"phase\",\"device\":\"%s\",\"phase\":\"%s\","
+		 "\"time\":%.3f}",
+		 device.c_str(), name, now());
+}
+
+/**
+ * update() - report @done out of @total bytes of the plan flashed
+ * @label:	partition being flashed
+ *
+ * Called for every chunk; an event is only written every
+ * PROGRESS_INTERVAL, and for the last chunk.
+ */
+void Stream::update(const char* label, uint64_t done, uint64_t total) {
+	clock::time_point t = clock::now();
+	double elapsed;
+	double sample;
+	double eta;
+
+	if (fd < 0)
+		return;
+
+	if (last == clock::time_point()) {
+		last = t;
+		last_done = done;
+		return;
+	}
+
+	if (t - last < PROGRESS_INTERVAL && done < total)
+		return;
+
+	elapsed = std::chrono::duration<double>(t - last).count();
+	if (elapsed > 0 && done >= last_done) {
+		sample = (done - last_done) / elapsed;
+		rate = rate ? rate + PROGRESS_EWMA_ALPHA * (sample - rate) : sample;
+	}
+	last = t;
+	last_done = done;
+
+	eta = rate > 0 && total > done ? (total - done) / rate : 0;
+
+	emit("{\"event\":\"progress\",\"device\":\"%s\",\"label\":\"%s\","
+		 "\"done\":%llu,\"total\":%llu,\"rate\":%.0f,\"eta\":%.1f,"
+		 "\"time\":%.3f}",
+		 device.c_str(), escape(label ? label : "").c_str(),
+		 (unsigned long long)done, (unsigned long long)total, rate, eta,
+		 std::chrono::duration<double>(t - start).count());
+}
+
+void Stream::finish(int ret) {
+	emit("{\"event\":\"done\",\"device\":\"%s\",\"result\":%d,"
+		 "\"time\":%.3f}",
+		 device.c_str(), ret, now());
+}
+
+}  // namespace progress
@@ -1,84 +1,29 @@
 #include "qdl.h"
 
-#include <dirent.h>
-#include <err.h>
 #include <fcntl.h>
-#include <getopt.h>
 #include <libudev.h>
-#include <libxml/parser.h>
-#include <libxml/tree.h>
 #include <linux/usb/ch9.h>
 #include <linux/usbdevice_fs.h>
-#include <poll.h>
 #include <sys/ioctl.h>
+#include <sys/select.h>
 #include <sys/types.h>
-#include <termios.h>
 #include <unistd.h>
 
-#include <cassert>
-#include <cctype>
+#include <algorithm>
 #include <cerrno>
+#include <chrono>
 #include <cstdbool>
 #include <cstdint>
 #include <cstdio>
-#include <cstdlib>
 #include <cstring>
-#include <iostream>
-#include <memory>
-
-#include "firehose.h"
-#include "patch.h"
-#include "program.h"
-#include "sahara.h"
-#include "ufs.h"
-
-bool qdl_debug;
-bool fw_only;
-
-enum class qdl_file {
-	unknown,
-	patch,
-	program,
-	ufs,
-	contents,
-};
-
-static qdl_file detect_type(const char* xml_file) {
-	xmlNode* root;
-	xmlDoc* doc;
-	xmlNode* node;
-	qdl_file type = qdl_file::unknown;
-
-	doc = xmlReadFile(xml_file, NULL, 0);
-	if (!doc) {
-		std::cerr << "[PATCH] failed to parse " << xml_file << std::endl;
-		return qdl_file::unknown;
-	}
-
-	root = xmlDocGetRootElement(doc);
-	if (!xmlStrcmp(root->name, (xmlChar*)"patches")) {
-		type = qdl_file::patch;
-	} else if (!xmlStrcmp(root->name, (xmlChar*)"data")) {
-		for (node = root->children; node; node = node->next) {
-			if (node->type != XML_ELEMENT_NODE)
-				continue;
-			if (!xmlStrcmp(node->name, (xmlChar*)"program")) {
-				type = qdl_file::program;
-				break;
-			}
-			if (!xmlStrcmp(node->name, (xmlChar*)"ufs")) {
-				type = qdl_file::ufs;
-				break;
-			}
-		}
-	} else if (!xmlStrcmp(root->name, (xmlChar*)"contents")) {
-		type = qdl_file::contents;
-	}
+#include <string>
+#include <utility>
+#include <vector>
 
-	xmlFreeDoc(doc);
+#include "logger.h"
 
-	return type;
-}
+/* Interval of checking for the device to go away and come back, ms */
+#define QDL_RECONNECT_POLL 100
 
 int Qdl::parse_usb_desc(int fd, int* intf) {
 	const struct usb_interface_descriptor* ifc;
@@ -179,7 +124,6 @@ int Qdl::parse_usb_desc(int fd, int* intf) {
 		if (ifc->bInterfaceProtocol != 0xff && ifc->bInterfaceProtocol != 16)
 			continue;
 
-		this->fd = fd;
 		this->in_ep = in;
 		this->out_ep = out;
 		this->in_maxpktsize = in_size;
@@ -193,24 +137,94 @@ int Qdl::parse_usb_desc(int fd, int* intf) {
 	return -ENOENT;
 }
 
-int Qdl::usb_open() {
+Qdl::~Qdl() {
+	if (fd >= 0)
+		close(fd);
+}
+
+/*
+ * Take @dev if it is an EDL device, matching @device if given, and claim its
+ * interface.
+ */
+int Qdl::claim(struct udev_device* dev, const char* device) {
+	const char* dev_node;
+	const char* sysname;
+	usbdevfs_ioctl cmd;
+	int intf = -1;
+	int ret;
+	int fd;
+
+	dev_node = udev_device_get_devnode(dev);
+	sysname = udev_device_get_sysname(dev) ?: "";
+	if (!dev_node)
+		return -ENODEV;
+
+	if (device && strcmp(device, sysname))
+		return -ENODEV;
+
+	fd = ::open(dev_node, O_RDWR);
+	if (fd < 0)
+		return -errno;
+
+	ret = Qdl::parse_usb_desc(fd, &intf);
+	if (ret)
+		goto err;
+
+	cmd.ifno = intf;
+	cmd.ioctl_code = USBDEVFS_DISCONNECT;
+	cmd.data = NULL;
+
+	ret = ioctl(fd, USBDEVFS_IOCTL, &cmd);
+	if (ret && errno != ENODATA) {
+		ret = -errno;
+		logger::warn("%s: failed to disconnect kernel driver", sysname);
+		goto err;
+	}
+
+	/* Fails if another session or process already has the device */
+	ret = ioctl(fd, USBDEVFS_CLAIMINTERFACE, &intf);
+	if (ret < 0) {
+		ret = -errno;
+		logger::warn("%s: failed to claim USB interface", sysname);
+		goto err;
+	}
+
+	this->fd = fd;
+	this->intf = intf;
+	snprintf(this->name, sizeof(this->name), "%s", sysname);
+	snprintf(this->node, sizeof(this->node), "%s", dev_node);
+
+	return 0;
+
+err:
+	close(fd);
+	return ret;
+}
+
+/**
+ * open() - open an EDL device, waiting for one to show up if needed
+ * @device:	sysname of the USB device to open, or NULL for any
+ * @timeout:	ms to wait for it, negative to wait for ever
+ */
+int Qdl::open(const char* device, rank_fn rank, int timeout) {
+	auto deadline =
+		std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+	std::vector<std::pair<unsigned, std::string>> candidates;
 	struct udev_enumerate* enumerate;
 	struct udev_list_entry* devices;
 	struct udev_list_entry* dev_list_entry;
 	struct udev_monitor* mon;
 	struct udev_device* dev;
-	const char* dev_node;
 	struct udev* udev;
 	const char* path;
-	usbdevfs_ioctl cmd;
 	int mon_fd;
-	int intf = -1;
 	int ret;
-	int fd;
 
 	udev = udev_new();
-	if (!udev)
-		err(1, "failed to initialize udev");
+	if (!udev) {
+		logger::error("failed to initialize udev");
+		return -ENOMEM;
+	}
 
 	mon = udev_monitor_new_from_netlink(udev, "udev");
 	udev_monitor_filter_add_match_subsystem_devtype(mon, "usb", NULL);
@@ -224,81 +238,89 @@ int Qdl::usb_open() {
 
 	udev_list_entry_foreach(dev_list_entry, devices) {
 		path = udev_list_entry_get_name(dev_list_entry);
-		dev = udev_device_new_from_syspath(udev, path);
-		dev_node = udev_device_get_devnode(dev);
-
-		if (!dev_node)
+		if (rank) {
+			candidates.emplace_back(rank(strrchr(path, '/') + 1), path);
 			continue;
+		}
 
-		fd = open(dev_node, O_RDWR);
-		if (fd < 0)
+		dev = udev_device_new_from_syspath(udev, path);
+		if (!dev)
 			continue;
 
-		ret = Qdl::parse_usb_desc(fd, &intf);
+		ret = Qdl::claim(dev, device);
+		udev_device_unref(dev);
 		if (!ret)
-			goto found;
+			goto out;
+	}
 
-		close(fd);
+	std::stable_sort(
+		candidates.begin(), candidates.end(),
+		[](const std::pair<unsigned, std::string>& a,
+		   const std::pair<unsigned, std::string>& b) {
+			return a.first < b.first;
+		});
+	for (auto& candidate : candidates) {
+		dev = udev_device_new_from_syspath(udev, candidate.second.c_str());
+		if (!dev)
+			continue;
+
+		ret = Qdl::claim(dev, device);
+		udev_device_unref(dev);
+		if (!ret)
+			goto out;
 	}
 
-	std::cerr << "Waiting for EDL device" << std::endl;
+	if (timeout)
+		logger::notice("Waiting for EDL device");
 
 	for (;;) {
+		struct timeval tv;
 		fd_set rfds;
+		long left;
 
 		FD_ZERO(&rfds);
 		FD_SET(mon_fd, &rfds);
 
-		ret = select(mon_fd + 1, &rfds, NULL, NULL, NULL);
-		if (ret < 0)
-			return -1;
+		left = std::chrono::duration_cast<std::chrono::milliseconds>(
+				   deadline - std::chrono::steady_clock::now())
+				   .count();
+		tv.tv_sec = std::max(left, 0L) / 1000;
+		tv.tv_usec = std::max(left, 0L) % 1000 * 1000;
+
+		ret = select(mon_fd + 1, &rfds, NULL, NULL, timeout < 0 ? NULL : &tv);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			ret = -errno;
+			break;
+		}
+		if (ret == 0) {
+			ret = -ETIMEDOUT;
+			break;
+		}
 
 		if (!FD_ISSET(mon_fd, &rfds))
 			continue;
 
 		dev = udev_monitor_receive_device(mon);
-		dev_node = udev_device_get_devnode(dev);
-
-		if (!dev_node)
+		if (!dev)
 			continue;
 
-		std::cout << dev_node << std::endl;
+		if (udev_device_get_devnode(dev))
+			logger::info("%s", udev_device_get_devnode(dev));
 
-		fd = open(dev_node, O_RDWR);
-		if (fd < 0)
-			continue;
-
-		ret = Qdl::parse_usb_desc(fd, &intf);
+		ret = Qdl::claim(dev, device);
+		udev_device_unref(dev);
 		if (!ret)
-			goto found;
-
-		close(fd);
+			break;
 	}
 
+out:
 	udev_enumerate_unref(enumerate);
 	udev_monitor_unref(mon);
 	udev_unref(udev);
 
-	return -ENOENT;
-
-found:
-	udev_enumerate_unref(enumerate);
-	udev_monitor_unref(mon);
-	udev_unref(udev);
-
-	cmd.ifno = intf;
-	cmd.ioctl_code = USBDEVFS_DISCONNECT;
-	cmd.data = NULL;
-
-	ret = ioctl(this->fd, USBDEVFS_IOCTL, &cmd);
-	if (ret && errno != ENODATA)
-		err(1, "failed to disconnect kernel driver");
-
-	ret = ioctl(this->fd, USBDEVFS_CLAIMINTERFACE, &intf);
-	if (ret < 0)
-		err(1, "failed to claim USB interface");
-
-	return 0;
+	return ret;
 }
 
 int Qdl::read(void* buf, size_t len, unsigned int timeout) {
@@ -327,8 +349,8 @@ int Qdl::write(const void* buf, size_t len, bool eot) {
 
 		n = ioctl(this->fd, USBDEVFS_BULK, &bulk);
 		if (n != 0) {
-			std::cerr << "ERROR: n = " << n << ", errno = " << errno << " ("
-					  << strerror(errno) << ")" << std::endl;
+			logger::error("ERROR: n = %d, errno = %d (%s)", n, errno,
+						  strerror(errno));
 			return -1;
 		}
 		return 0;
@@ -345,8 +367,8 @@ int Qdl::write(const void* buf, size_t len, bool eot) {
 
 		n = ioctl(this->fd, USBDEVFS_BULK, &bulk);
 		if (n != xfer) {
-			std::cerr << "ERROR: n = " << n << ", errno = " << errno << " ("
-					  << strerror(errno) << ")" << std::endl;
+			logger::error("ERROR: n = %d, errno = %d (%s)", n, errno,
+						  strerror(errno));
 			return -1;
 		}
 		count += xfer;
@@ -368,106 +390,133 @@ int Qdl::write(const void* buf, size_t len, bool eot) {
 	return count;
 }
 
-static void print_usage() {
-	extern const char* __progname;
-	std::cerr << __progname
-			  << " [--debug] [--firmware] [--storage <emmc|ufs>] "
-				 "[--finalize-provisioning] "
-				 "[--include <PATH>] <prog.mbn> [<program> <patch> ...]"
-			  << std::endl;
+/**
+ * disconnect() - let go of the device, keeping its name for reconnecting
+ */
+void Qdl::disconnect() {
+	if (fd >= 0)
+		close(fd);
+	fd = -1;
+}
+
+/* Whether the device node opened last is gone, e.g. as the device restarts */
+bool Qdl::gone() const {
+	return access(node, F_OK) < 0;
+}
+
+/**
+ * reconnect() - open the device again on the same port once it restarted
+ * @timeout:	ms to wait for it to go away and come back
+ */
+int Qdl::reconnect(unsigned timeout) {
+	char device[sizeof(name)];
+	unsigned waited = 0;
+
+	if (!name[0])
+		return -ENODEV;
+
+	snprintf(device, sizeof(device), "%s", name);
+	Qdl::disconnect();
+
+	/* Don't claim the old device again while it's going away */
+	while (!Qdl::gone() && waited < timeout) {
+		usleep(QDL_RECONNECT_POLL * 1000);
+		waited += QDL_RECONNECT_POLL;
+	}
+
+	return Qdl::open(device, nullptr, timeout - std::min(waited, timeout));
 }
 
-int main(int argc, char** argv) {
-	const char* ufs_str = "ufs";
-	char *prog_mbn, *storage = (char*)ufs_str;
-	char* incdir = NULL;
-	qdl_file type;
+/**
+ * recover() - clear the halt condition of both bulk endpoints, after a port
+ * reset if @reset
+ */
+int Qdl::recover(bool reset) {
+	unsigned int ep;
+	int saved_errno;
+	int intf;
 	int ret;
-	int opt;
-	bool qdl_finalize_provisioning = false;
-	std::shared_ptr<Sahara> qdl(new Sahara);
-
-	static struct option options[] = {
-		{"debug", no_argument, 0, 'd'},
-		{"include", required_argument, 0, 'i'},
-		{"finalize-provisioning", no_argument, 0, 'l'},
-		{"storage", required_argument, 0, 's'},
-		{"help", no_argument, 0, 'h'},
-		{"firmware", no_argument, 0, 'f'},
-		{0, 0, 0, 0}};
-
-	while ((opt = getopt_long(argc, argv, "fdi:", options, NULL)) != -1) {
-		switch (opt) {
-			case 'd':
-				qdl_debug = true;
-				break;
-			case 'i':
-				incdir = optarg;
-				break;
-			case 'l':
-				qdl_finalize_provisioning = true;
-				break;
-			case 's':
-				storage = optarg;
-				break;
-			case 'f':
-				fw_only = true;
-				break;
-			case 'h':
-				print_usage();
-				return 0;
-			default:
-				print_usage();
-				return 1;
+
+	/* The reset drops the claim: release it and claim again, as libusb */
+	if (reset) {
+		intf = this->intf;
+		ioctl(this->fd, USBDEVFS_RELEASEINTERFACE, &intf);
+
+		ret = ioctl(this->fd, USBDEVFS_RESET, NULL);
+		saved_errno = errno;
+
+		intf = this->intf;
+		if (ioctl(this->fd, USBDEVFS_CLAIMINTERFACE, &intf) < 0) {
+			ret = -errno;
+			logger::warn("%s: failed to claim USB interface after reset",
+						 this->name);
+			return ret;
 		}
-	}
 
-	/* at least 2 non optional args required */
-	if ((optind + 2) > argc) {
-		print_usage();
-		return 1;
+		if (ret < 0)
+			return -saved_errno;
 	}
 
-	prog_mbn = argv[optind++];
+	ep = this->in_ep;
+	if (ioctl(this->fd, USBDEVFS_CLEAR_HALT, &ep) < 0)
+		return -errno;
 
-	do {
-		type = detect_type(argv[optind]);
-		if (type == qdl_file::unknown)
-			errx(1, "failed to detect file type of %s\n", argv[optind]);
+	ep = this->out_ep;
+	if (ioctl(this->fd, USBDEVFS_CLEAR_HALT, &ep) < 0)
+		return -errno;
 
-		switch (type) {
-			case qdl_file::patch:
-				ret = patch::load(argv[optind]);
-				if (ret < 0)
-					errx(1, "patch_load %s failed", argv[optind]);
-				break;
-			case qdl_file::program:
-				ret = program::load(argv[optind]);
-				if (ret < 0)
-					errx(1, "program_load %s failed", argv[optind]);
-				break;
-			case qdl_file::ufs:
-				ret = ufs::load(argv[optind], qdl_finalize_provisioning);
-				if (ret < 0)
-					errx(1, "ufs_load %s failed", argv[optind]);
-				break;
-			default:
-				errx(1, "%s type not yet supported", argv[optind]);
-				break;
-		}
-	} while (++optind < argc);
+	return 0;
+}
 
-	ret = std::dynamic_pointer_cast<Qdl>(qdl)->usb_open();
-	if (ret)
-		return 1;
+/**
+ * submit() - queue a bulk transfer without waiting for it
+ * @urb:	request, must stay in place until reaped
+ * @in:		direction, true for device to host
+ * @eot:	end of an OUT transfer, terminated by a zero length packet if
+ *		needed
+ * @context:	returned with the urb by reap()
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int Qdl::submit(struct usbdevfs_urb* urb,
+				bool in,
+				void* buf,
+				size_t len,
+				bool eot,
+				void* context) {
+	memset(urb, 0, sizeof(*urb));
+	urb->type = USBDEVFS_URB_TYPE_BULK;
+	urb->endpoint = in ? this->in_ep : this->out_ep;
+	urb->buffer = buf;
+	urb->buffer_length = len;
+	urb->usercontext = context;
+	if (!in && eot && len % this->out_maxpktsize == 0)
+		urb->flags = USBDEVFS_URB_ZERO_PACKET;
+
+	if (ioctl(this->fd, USBDEVFS_SUBMITURB, urb) < 0)
+		return -errno;
 
-	ret = std::dynamic_pointer_cast<Sahara>(qdl)->run(prog_mbn);
-	if (ret < 0)
-		return 1;
+	return 0;
+}
+
+/**
+ * discard() - cancel a submitted transfer, it is still to be reaped
+ */
+int Qdl::discard(struct usbdevfs_urb* urb) {
+	if (ioctl(this->fd, USBDEVFS_DISCARDURB, urb) < 0)
+		return -errno;
+
+	return 0;
+}
 
-	ret = std::dynamic_pointer_cast<Firehose>(qdl)->run(incdir, storage);
-	if (ret < 0)
-		return 1;
+/**
+ * reap() - take one completed transfer, without waiting
+ *
+ * Returns 0 with @urb set, -EAGAIN if none completed, or negative errno.
+ */
+int Qdl::reap(struct usbdevfs_urb** urb) {
+	if (ioctl(this->fd, USBDEVFS_REAPURBNDELAY, urb) < 0)
+		return -errno;
 
 	return 0;
 }
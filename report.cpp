@@ -0,0 +1,22 @@
+#include "report.h"
+
+#include "logger.h"
+
+double Report::elapsed_ms() const {
+	return std::chrono::duration<double, std::milli>(clock::now() - start)
+		.count();
+}
+
+void Report::print() const {
+	logger::notice("[SESSION] programmer ready after %.0f ms", ready_ms);
+	logger::notice("[SESSION] first configure after %.0f ms", configure_ms);
+	logger::notice("[SESSION] flashed %u programs, %llu kB in %.0f ms",
+				   programs, (unsigned long long)bytes / 1024, elapsed_ms());
+	if (skipped)
+		logger::notice("[SESSION] skipped %u unchanged programs, %llu kB",
+					   skipped, (unsigned long long)skipped_bytes / 1024);
+	if (retries)
+		logger::notice("[SESSION] retried %u times after transfer errors, "
+					   "%.0f ms lost",
+					   retries, retry_ms);
+}
@@ -1,36 +1,34 @@
 #include "sahara.h"
 
-#include <dirent.h>
-#include <err.h>
-#include <fcntl.h>
 #include <inttypes.h>
-#include <poll.h>
 #include <sys/types.h>
-#include <termios.h>
 #include <unistd.h>
 
-#include <cassert>
-#include <cctype>
 #include <cerrno>
 #include <cstdbool>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <iostream>
-#include <memory>
-#include <sstream>
 
+#include "logger.h"
+#include "qdl.h"
 #include "scope_exit.h"
 
-void Sahara::hello(Sahara::Pkt& pkt) {
+#define SAHARA_MODE_IMAGE_TX_PENDING 0
+#define SAHARA_MODE_COMMAND 3
+
+#define SAHARA_EXEC_SERIAL_NUM_READ 0x01
+
+int Sahara::hello(Sahara::Pkt& pkt) {
 	Pkt resp;
+	int n;
 
-	assert(pkt.length == 0x30);
+	if (pkt.length != 0x30)
+		return -EPROTO;
 
-	std::cout << std::hex << "HELLO version: 0x" << pkt.hello_req.version
-			  << " compatible: 0x" << pkt.hello_req.compatible
-			  << " max_len: " << std::dec << pkt.hello_req.max_len
-			  << " mode: " << pkt.hello_req.mode << std::endl;
+	logger::info("HELLO version: 0x%x compatible: 0x%x max_len: %u mode: %u",
+				 pkt.hello_req.version, pkt.hello_req.compatible,
+				 pkt.hello_req.max_len, pkt.hello_req.mode);
 
 	resp.cmd = 2;
 	resp.length = 0x30;
@@ -39,134 +37,230 @@ void Sahara::hello(Sahara::Pkt& pkt) {
 	resp.hello_resp.status = 0;
 	resp.hello_resp.mode = pkt.hello_req.mode;
 
-	Qdl::write(&resp, resp.length, true);
+	/* Detour through command mode, the device says hello again after */
+	if (read_serial && !asked) {
+		resp.hello_resp.mode = SAHARA_MODE_COMMAND;
+		asked = true;
+	}
+
+	n = usb.write(&resp, resp.length, true);
+
+	return n < 0 ? -EIO : 0;
 }
 
-int Sahara::read_common(const char* mbn, off_t offset, size_t len) {
-	int progfd = -1;
-	ssize_t n;
-	std::shared_ptr<char[]> buf;
+int Sahara::command_ready() {
+	Pkt req;
+	int n;
 
-	progfd = open(mbn, O_RDONLY);
-	if (progfd < 0)
-		return -errno;
+	req.cmd = 0xd;
+	req.length = 0xc;
+	req.exec_req.command = SAHARA_EXEC_SERIAL_NUM_READ;
 
-	buf = std::shared_ptr<char[]>(new char[len]);
-	if (!buf)
-		return -ENOMEM;
+	n = usb.write(&req, req.length, true);
 
-	lseek(progfd, offset, SEEK_SET);
-	n = ::read(progfd, buf.get(), len);
-	if (n != len)
-		return -errno;
+	return n < 0 ? -EIO : 0;
+}
 
-	n = Qdl::write(buf.get(), n, true);
-	if (n != len)
-		err(1, "failed to write %zu bytes to sahara", len);
+int Sahara::execute(Sahara::Pkt& pkt) {
+	uint32_t command;
+	char buf[4096];
+	Pkt req;
+	int n;
 
-	close(progfd);
+	if (pkt.length != 0x10)
+		return -EPROTO;
+
+	command = pkt.exec_resp.command;
+	if (command != SAHARA_EXEC_SERIAL_NUM_READ ||
+		pkt.exec_resp.length > sizeof(buf))
+		return -EPROTO;
+
+	req.cmd = 0xf;
+	req.length = 0xc;
+	req.exec_req.command = command;
+	n = usb.write(&req, req.length, true);
+	if (n < 0)
+		return -EIO;
+
+	/* The data follows as a raw transfer */
+	n = usb.read(buf, sizeof(buf), 1000);
+	if (n >= (int)sizeof(serial)) {
+		memcpy(&serial, buf, sizeof(serial));
+		has_serial = true;
+		logger::info("[SAHARA] serial number: %08x", serial);
+	} else {
+		logger::warn("[SAHARA] no serial number in response");
+	}
+
+	req.cmd = 0xc;
+	req.length = 0xc;
+	req.switch_mode.mode = SAHARA_MODE_IMAGE_TX_PENDING;
+	n = usb.write(&req, req.length, true);
+
+	return n < 0 ? -EIO : 0;
+}
+
+int Sahara::read_common(image::Source& mbn, uint64_t offset, size_t len) {
+	const char* data;
+	ssize_t n;
+
+	n = mbn.read(offset, len, &data);
+	if (n < 0)
+		return n;
+	if ((size_t)n != len)
+		return -EIO;
+
+	n = usb.write(data, len, true);
+	if (n < 0 || (size_t)n != len) {
+		logger::error("failed to write %zu bytes to sahara", len);
+		return -EIO;
+	}
 
 	return 0;
 }
 
-void Sahara::read(Sahara::Pkt& pkt, const char* mbn) {
+int Sahara::read(Sahara::Pkt& pkt, image::Source& mbn) {
 	int ret;
 
-	assert(pkt.length == 0x14);
+	if (pkt.length != 0x14)
+		return -EPROTO;
 
-	std::cout << "READ image: " << pkt.read_req.image << " offset: 0x"
-			  << std::hex << pkt.read_req.offset << " length: 0x"
-			  << pkt.read_req.length << std::endl;
+	logger::info("READ image: %u offset: 0x%x length: 0x%x",
+				 pkt.read_req.image, pkt.read_req.offset, pkt.read_req.length);
 
 	ret = Sahara::read_common(mbn, pkt.read_req.offset, pkt.read_req.length);
 	if (ret < 0)
-		errx(1, "failed to read image chunk to sahara");
+		logger::error("failed to read image chunk to sahara");
+
+	return ret;
 }
 
-void Sahara::read64(Sahara::Pkt& pkt, const char* mbn) {
+int Sahara::read64(Sahara::Pkt& pkt, image::Source& mbn) {
 	int ret;
 
-	assert(pkt.length == 0x20);
+	if (pkt.length != 0x20)
+		return -EPROTO;
 
-	std::cout << "READ64 image: " << pkt.read64_req.image << std::hex
-			  << " offset: 0x%" << pkt.read64_req.offset << " length: 0x%"
-			  << pkt.read64_req.length << std::endl;
+	logger::info("READ64 image: %" PRIu64 " offset: 0x%" PRIx64
+				 " length: 0x%" PRIx64,
+				 pkt.read64_req.image, pkt.read64_req.offset,
+				 pkt.read64_req.length);
 
 	ret =
 		Sahara::read_common(mbn, pkt.read64_req.offset, pkt.read64_req.length);
 	if (ret < 0)
-		errx(1, "failed to read image chunk to sahara");
+		logger::error("failed to read image chunk to sahara");
+
+	return ret;
 }
 
-void Sahara::eoi(Sahara::Pkt& pkt) {
+int Sahara::eoi(Sahara::Pkt& pkt) {
 	Pkt done;
+	int n;
 
-	assert(pkt.length == 0x10);
+	if (pkt.length != 0x10)
+		return -EPROTO;
 
-	std::cout << "END OF IMAGE image: " << pkt.eoi.image
-			  << " status: " << pkt.eoi.status << std::endl;
+	logger::info("END OF IMAGE image: %u status: %u", pkt.eoi.image,
+				 pkt.eoi.status);
 
 	if (pkt.eoi.status != 0) {
-		std::cout << "received non-successful result" << std::endl;
-		return;
+		logger::error("received non-successful result");
+		return 0;
 	}
 
 	done.cmd = 5;
 	done.length = 0x8;
-	Qdl::write(&done, done.length, true);
+	n = usb.write(&done, done.length, true);
+
+	return n < 0 ? -EIO : 0;
 }
 
 int Sahara::done(Sahara::Pkt& pkt) {
-	assert(pkt.length == 0xc);
+	if (pkt.length != 0xc)
+		return -EPROTO;
 
-	std::cout << "DONE status: " << pkt.done_resp.status << std::endl;
+	logger::info("DONE status: %u", pkt.done_resp.status);
 
 	return pkt.done_resp.status;
 }
 
-int Sahara::run(char* prog_mbn) {
+/**
+ * run() - upload the programmer @mbn as requested by the Sahara protocol
+ *
+ * Returns 0 once the device reports the transfer done, negative errno on
+ * failure.
+ */
+/**
+ * run() - upload @mbn to the device
+ * @hello:	first packet, if already read from the device
+ * @len:	length of @hello
+ *
+ * Returns 0 once the device reports the transfer done, negative errno on
+ * failure.
+ */
+int Sahara::run(image::Source& mbn, const void* hello, size_t len) {
 	Pkt* pkt;
 	char buf[4096];
 	char tmp[32];
 	bool done = false;
+	int ret = 0;
 	int n;
 
+	if (len > sizeof(buf))
+		return -EINVAL;
+
 	while (!done) {
-		n = Qdl::read(buf, sizeof(buf), 1000);
+		if (hello) {
+			memcpy(buf, hello, len);
+			n = len;
+			hello = NULL;
+		} else {
+			n = usb.read(buf, sizeof(buf), 1000);
+		}
 		if (n < 0)
 			break;
 
 		pkt = (Sahara::Pkt*)buf;
-		if ((size_t)n != pkt->length) {
-			std::cerr << "length not matching";
+		if ((size_t)n < 2 * sizeof(uint32_t) || (size_t)n != pkt->length) {
+			logger::error("length not matching");
 			return -EINVAL;
 		}
 
 		switch (pkt->cmd) {
 			case 1:
-				Sahara::hello(*pkt);
+				ret = Sahara::hello(*pkt);
 				break;
 			case 3:
-				Sahara::read(*pkt, prog_mbn);
+				ret = Sahara::read(*pkt, mbn);
 				break;
 			case 4:
-				Sahara::eoi(*pkt);
+				ret = Sahara::eoi(*pkt);
 				break;
 			case 6:
 				Sahara::done(*pkt);
 				done = true;
 				break;
+			case 0xb:
+				ret = Sahara::command_ready();
+				break;
+			case 0xe:
+				ret = Sahara::execute(*pkt);
+				break;
 			case 0x12:
-				Sahara::read64(*pkt, prog_mbn);
+				ret = Sahara::read64(*pkt, mbn);
 				break;
 			default:
-				std::stringstream ss;
-				ss << "CMD" << std::hex << pkt->cmd;
-				strcpy(tmp, ss.str().c_str());
+				snprintf(tmp, sizeof(tmp), "CMD%x", pkt->cmd);
 				print_hex_dump(tmp, buf, n);
 				break;
 		}
+
+		if (ret == -EPROTO)
+			logger::error("malformed sahara packet 0x%x", pkt->cmd);
+		if (ret < 0)
+			return ret;
 	}
 
-	return done ? 0 : -1;
+	return done ? 0 : -ETIMEDOUT;
 }
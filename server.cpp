@@ -0,0 +1,622 @@
+#include "server.h"
+
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include "archive.h"
+#include "filter.h"
+#include "image.h"
+#include "logger.h"
+#include "lru.h"
+#include "manifest.h"
+#include "topology.h"
+
+namespace server {
+
+#define PLAN_CACHE_SIZE 16
+#define PROGRAMMER_CACHE_SIZE 8
+#define IMAGE_CACHE_SIZE 256
+
+/* A file a cached object was built from, or looked for and not found */
+struct Input {
+	std::string path;
+	bool present;
+	image::Stamp id;
+};
+
+struct CachedPlan {
+	std::shared_ptr<const plan::Plan> plan;
+	std::vector<Input> inputs;
+};
+
+struct CachedFile {
+	image::Stamp id;
+	std::shared_ptr<const std::vector<char>> data;
+};
+
+static Lru<std::string, CachedPlan> plans(PLAN_CACHE_SIZE);
+static Lru<std::string, CachedFile> programmers(PROGRAMMER_CACHE_SIZE);
+
+struct Job {
+	Options options;
+
+	std::string storage;
+	std::vector<std::string> incdirs;
+	std::string plan_file;
+	std::string device;
+	std::string programmer;
+	std::vector<std::string> manifests;
+	std::vector<std::string> only;
+	std::vector<std::string> skip;
+	std::string history_dir;
+	std::string personalize_file;
+	std::vector<std::string> vars;
+	std::string progress;
+	std::string digest_dir;
+	std::string capture;
+};
+
+static void record(std::vector<Input>& inputs, const char* path) {
+	Input input;
+
+	input.path = path;
+	input.present = image::stamp(path, input.id) == 0;
+	inputs.push_back(input);
+}
+
+static bool fresh(const std::vector<Input>& inputs) {
+	image::Stamp id;
+	bool present;
+
+	for (auto& input : inputs) {
+		present = image::stamp(input.path.c_str(), id) == 0;
+		if (present != input.present || (present && id != input.id))
+			return false;
+	}
+
+	return true;
+}
+
+static std::shared_ptr<const plan::Plan> get_plan(const Job& job, int* ret) {
+	std::vector<const char*> files;
+	const Options& options = job.options;
+	std::string key;
+
+	key = job.plan_file + '\n' + (options.finalize_provisioning ? "1" : "0");
+	for (auto& incdir : job.incdirs)
+		key += "\ninclude " + incdir;
+	for (auto& manifest : job.manifests) {
+		key += '\n' + manifest;
+		files.push_back(manifest.c_str());
+	}
+
+	auto cached = plans.get(key);
+	if (cached && fresh(cached->inputs))
+		return cached->plan;
+
+	auto entry = std::make_shared<CachedPlan>();
+	auto loaded = std::make_shared<plan::Plan>();
+
+	for (auto file : files)
+		record(entry->inputs, file);
+
+	if (options.plan_file) {
+		*ret = plan::load(*loaded, options.plan_file, files, options.incdirs,
+						  options.finalize_provisioning);
+		if (*ret < 0)
+			return nullptr;
+
+		/* The plan file tracks missing images, it is enough to watch it */
+		record(entry->inputs, options.plan_file);
+		for (auto& program : loaded->programs) {
+			if (program.path)
+				record(entry->inputs, program.path);
+		}
+	} else {
+		*ret = manifest::load(*loaded, files, options.finalize_provisioning);
+		if (*ret < 0)
+			return nullptr;
+
+		program::resolve(loaded->programs, loaded->strings, options.incdirs,
+						 [&](const char* path, const struct stat* sb) {
+							 record(entry->inputs, path);
+						 });
+	}
+
+	entry->plan = loaded;
+	plans.put(key, entry);
+
+	return loaded;
+}
+
+static std::shared_ptr<const std::vector<char>> get_programmer(
+	const char* path,
+	int* ret) {
+	std::shared_ptr<std::vector<char>> data;
+	image::Stamp id;
+	const char* chunk;
+	ssize_t n;
+
+	*ret = image::stamp(path, id);
+	if (*ret < 0)
+		return nullptr;
+
+	auto cached = programmers.get(path);
+	if (cached && cached->id == id)
+		return cached->data;
+
+	auto source = image::open(path, false);
+	if (!source) {
+		*ret = -errno;
+		return nullptr;
+	}
+
+	data = std::make_shared<std::vector<char>>(source->size());
+	n = source->read(0, data->size(), &chunk);
+	if (n < 0 || (size_t)n != data->size()) {
+		*ret = n < 0 ? n : -EIO;
+		return nullptr;
+	}
+	memcpy(data->data(), chunk, n);
+
+	auto entry = std::make_shared<CachedFile>();
+	entry->id = id;
+	entry->data = data;
+	programmers.put(path, entry);
+
+	return data;
+}
+
+/* Buffered reader of newline terminated lines */
+struct LineReader {
+	int fd;
+	std::string buf;
+
+	int next(std::string& line) {
+		char tmp[4096];
+		size_t pos;
+		ssize_t n;
+
+		while ((pos = buf.find('\n')) == std::string::npos) {
+			n = ::read(fd, tmp, sizeof(tmp));
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0)
+				return -errno;
+			if (n == 0)
+				return -EPIPE;
+			buf.append(tmp, n);
+		}
+
+		line = buf.substr(0, pos);
+		buf.erase(0, pos + 1);
+
+		return 0;
+	}
+};
+
+static void send_line(int fd, const char* fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void send_line(int fd, const char* fmt, ...) {
+	char line[512];
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+	va_end(ap);
+
+	len = std::min<int>(len, sizeof(line) - 2);
+	line[len++] = '\n';
+
+	/* A client going away must not take the server with it */
+	send(fd, line, len, MSG_NOSIGNAL);
+}
+
+static int parse_job(int fd, Job& job) {
+	LineReader reader = {fd, ""};
+	std::string line;
+	std::string key;
+	std::string value;
+	size_t sep;
+	int ret;
+
+	for (;;) {
+		ret = reader.next(line);
+		if (ret < 0)
+			return ret;
+
+		if (line == "run")
+			break;
+
+		sep = line.find(' ');
+		key = line.substr(0, sep);
+		value = sep == std::string::npos ? "" : line.substr(sep + 1);
+
+		if (key == "storage") {
+			job.storage = value;
+		} else if (key == "include") {
+			job.incdirs.push_back(value);
+		} else if (key == "plan") {
+			job.plan_file = value;
+		} else if (key == "device") {
+			job.device = value;
+		} else if (key == "programmer") {
+			job.programmer = value;
+		} else if (key == "manifest") {
+			job.manifests.push_back(value);
+		} else if (key == "prefetch-budget") {
+			job.options.prefetch_budget = strtoull(value.c_str(), NULL, 10);
+		} else if (key == "flag" && value == "finalize-provisioning") {
+			job.options.finalize_provisioning = true;
+		} else if (key == "flag" && value == "flash-after-provisioning") {
+			job.options.flash_after_provisioning = true;
+		} else if (key == "only") {
+			job.only.push_back(value);
+		} else if (key == "skip") {
+			job.skip.push_back(value);
+		} else if (key == "flag" && value == "firmware") {
+			job.skip.push_back(FILTER_FIRMWARE);
+		} else if (key == "flag" && value == "direct-io") {
+			job.options.direct_io = true;
+		} else if (key == "flag" && value == "no-reset") {
+			job.options.no_reset = true;
+		} else if (key == "flag" && value == "host-patch") {
+			job.options.host_patch = true;
+		} else if (key == "history") {
+			job.history_dir = value;
+		} else if (key == "personalize") {
+			job.personalize_file = value;
+		} else if (key == "var" && value.find('=') != std::string::npos) {
+			job.vars.push_back(value);
+		} else if (key == "flag" && value == "force") {
+			job.options.force = true;
+		} else if (key == "flag" && value == "verify-history") {
+			job.options.verify_history = true;
+		} else if (key == "flag" && value == "debug") {
+			job.options.debug = true;
+		} else if (key == "progress" && value[0] == '/') {
+			job.progress = value;
+		} else if (key == "digest-cache") {
+			job.digest_dir = value;
+		} else if (key == "capture") {
+			job.capture = value;
+		} else {
+			logger::warn("[SERVER] unknown job line \"%s\"", line.c_str());
+			return -EINVAL;
+		}
+	}
+
+	if (job.programmer.empty() ||
+		(job.manifests.empty() && job.plan_file.empty()))
+		return -EINVAL;
+
+	if (!job.storage.empty())
+		job.options.storage = job.storage.c_str();
+	for (auto& incdir : job.incdirs)
+		job.options.incdirs.push_back(incdir.c_str());
+	for (auto& spec : job.only)
+		job.options.only.push_back(spec.c_str());
+	for (auto& spec : job.skip)
+		job.options.skip.push_back(spec.c_str());
+	if (!job.plan_file.empty())
+		job.options.plan_file = job.plan_file.c_str();
+	if (!job.device.empty())
+		job.options.device = job.device.c_str();
+	if (!job.history_dir.empty())
+		job.options.history_dir = job.history_dir.c_str();
+	if (!job.personalize_file.empty())
+		job.options.personalize_file = job.personalize_file.c_str();
+	for (auto& var : job.vars)
+		job.options.vars.push_back(var.c_str());
+	if (!job.progress.empty())
+		job.options.progress = job.progress.c_str();
+	if (!job.digest_dir.empty())
+		job.options.digest_dir = job.digest_dir.c_str();
+	if (!job.capture.empty())
+		job.options.capture = job.capture.c_str();
+
+	return 0;
+}
+
+static int serve_job(int fd, Job& job) {
+	std::shared_ptr<const std::vector<char>> programmer;
+	std::shared_ptr<const plan::Plan> plan;
+	unsigned last_permille = UINT_MAX;
+	int ret = 0;
+
+	plan = get_plan(job, &ret);
+	if (!plan) {
+		logger::error("[SERVER] unable to load the plan for %s",
+					  job.manifests.empty() ? job.plan_file.c_str()
+											: job.manifests[0].c_str());
+		return ret;
+	}
+
+	programmer = get_programmer(job.programmer.c_str(), &ret);
+	if (!programmer) {
+		logger::error("[SERVER] unable to read %s", job.programmer.c_str());
+		return ret;
+	}
+
+	Session session(job.options);
+
+	session.on_progress = [&](const program::Program& program, uint64_t done,
+							  uint64_t total) {
+		unsigned permille = total ? done * 1000 / total : 1000;
+
+		if (permille == last_permille)
+			return;
+		last_permille = permille;
+
+		send_line(fd, "progress %" PRIu64 " %" PRIu64 " %s", done, total,
+				  program.label ? program.label : "");
+	};
+
+	ret = session.load(plan);
+	if (ret < 0)
+		return ret;
+
+	ret = session.open();
+	if (ret < 0)
+		return ret;
+
+	logger::set_prefix(session.device());
+	send_line(fd, "device %s", session.device());
+
+	image::Memory source(programmer);
+
+	return session.flash(source);
+}
+
+static void serve(int fd) {
+	Job job;
+	int ret;
+
+	ret = parse_job(fd, job);
+	if (ret == 0)
+		ret = serve_job(fd, job);
+	else
+		logger::warn("[SERVER] malformed job request");
+
+	if (topology::enabled())
+		topology::report();
+
+	send_line(fd, "done %d", ret);
+	close(fd);
+}
+
+/**
+ * run() - serve flash jobs on the Unix socket at @socket_path
+ *
+ * Returns negative errno if the socket can't be set up, otherwise it doesn't
+ * return.
+ */
+int run(const char* socket_path) {
+	struct sockaddr_un addr = {};
+	int ret;
+	int fd;
+	int c;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		logger::error("[SERVER] socket path %s too long", socket_path);
+		return -ENAMETOOLONG;
+	}
+
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	/* Replace the socket of a previous instance */
+	unlink(socket_path);
+
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+		listen(fd, 16) < 0) {
+		ret = -errno;
+		logger::error("[SERVER] unable to listen on %s: %s", socket_path,
+					  strerror(-ret));
+		close(fd);
+		return ret;
+	}
+
+	image::set_cache_size(IMAGE_CACHE_SIZE);
+
+	logger::notice("[SERVER] listening on %s", socket_path);
+
+	for (;;) {
+		c = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+		if (c < 0 && (errno == EINTR || errno == ECONNABORTED))
+			continue;
+		if (c < 0) {
+			ret = -errno;
+			logger::error("[SERVER] accept failed: %s", strerror(-ret));
+			close(fd);
+			return ret;
+		}
+
+		std::thread(serve, c).detach();
+	}
+}
+
+static std::string absolute(const char* path) {
+	char cwd[PATH_MAX];
+
+	if (path[0] == '/' || !getcwd(cwd, sizeof(cwd)))
+		return path;
+
+	return std::string(cwd) + "/" + path;
+}
+
+static bool send_value(int fd, const char* key, const std::string& value) {
+	if (value.find('\n') != std::string::npos) {
+		logger::error("%s \"%s\" can't be sent to the server", key,
+					  value.c_str());
+		return false;
+	}
+
+	send_line(fd, "%s %s", key, value.c_str());
+	return true;
+}
+
+/**
+ * submit() - have the server at @socket_path run a flash job
+ *
+ * Returns the result of the job, or negative errno if it couldn't be
+ * submitted. Relative paths are sent as seen from the current directory.
+ */
+int submit(const char* socket_path,
+		   const Options& options,
+		   const char* prog_mbn,
+		   const std::vector<const char*>& files) {
+	struct sockaddr_un addr = {};
+	unsigned last_percent = UINT_MAX;
+	std::string programmer;
+	std::string last_label;
+	std::string line;
+	LineReader reader;
+	bool ok = true;
+	int ret;
+	int fd;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		ret = -errno;
+		logger::error("unable to connect to %s: %s", socket_path,
+					  strerror(-ret));
+		close(fd);
+		return ret;
+	}
+
+	ok &= send_value(fd, "storage", options.storage);
+	for (auto incdir : options.incdirs)
+		ok &= send_value(fd, "include", absolute(incdir));
+	if (options.plan_file)
+		ok &= send_value(fd, "plan", absolute(options.plan_file));
+	if (options.device)
+		ok &= send_value(fd, "device", options.device);
+	/* The programmer may come from one of the archives */
+	if (access(prog_mbn, F_OK) < 0) {
+		programmer = archive::resolve(options.incdirs, prog_mbn);
+		if (!programmer.empty())
+			prog_mbn = programmer.c_str();
+	}
+	ok &= send_value(fd, "programmer", absolute(prog_mbn));
+	for (auto file : files)
+		ok &= send_value(fd, "manifest", absolute(file));
+	send_line(fd, "prefetch-budget %zu", options.prefetch_budget);
+	if (options.finalize_provisioning)
+		send_line(fd, "flag finalize-provisioning");
+	if (options.flash_after_provisioning)
+		send_line(fd, "flag flash-after-provisioning");
+	for (auto spec : options.only)
+		ok &= send_value(fd, "only", spec);
+	for (auto spec : options.skip)
+		ok &= send_value(fd, "skip", spec);
+	if (options.direct_io)
+		send_line(fd, "flag direct-io");
+	if (options.no_reset)
+		send_line(fd, "flag no-reset");
+	if (options.host_patch)
+		send_line(fd, "flag host-patch");
+	if (options.history_dir)
+		ok &= send_value(fd, "history", absolute(options.history_dir));
+	if (options.force)
+		send_line(fd, "flag force");
+	if (options.verify_history)
+		send_line(fd, "flag verify-history");
+	if (options.personalize_file)
+		ok &= send_value(fd, "personalize",
+						 absolute(options.personalize_file));
+	for (auto var : options.vars)
+		ok &= send_value(fd, "var", var);
+	if (options.debug)
+		send_line(fd, "flag debug");
+	/* The server connects to the progress socket itself */
+	if (options.progress && !strncmp(options.progress, "fd:", 3)) {
+		logger::error("--progress fd:N can't be passed to the server, "
+					  "give a socket");
+		ok = false;
+	} else if (options.progress) {
+		ok &= send_value(fd, "progress", absolute(options.progress));
+	}
+	if (options.digest_dir)
+		ok &= send_value(fd, "digest-cache", absolute(options.digest_dir));
+	if (options.capture)
+		ok &= send_value(fd, "capture", absolute(options.capture));
+
+	if (!ok) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	send_line(fd, "run");
+
+	reader.fd = fd;
+	for (;;) {
+		ret = reader.next(line);
+		if (ret < 0) {
+			logger::error("connection to %s lost", socket_path);
+			break;
+		}
+
+		if (!line.compare(0, 5, "done ")) {
+			ret = atoi(line.c_str() + 5);
+			break;
+		} else if (!line.compare(0, 7, "device ")) {
+			logger::notice("flashing %s", line.c_str() + 7);
+		} else if (!line.compare(0, 9, "progress ")) {
+			unsigned long long done;
+			unsigned long long total;
+			unsigned percent;
+			int label = 0;
+
+			if (sscanf(line.c_str() + 9, "%llu %llu %n", &done, &total,
+					   &label) != 2 ||
+				!total)
+				continue;
+
+			percent = done * 100 / total;
+			if (percent == last_percent &&
+				last_label == line.c_str() + 9 + label)
+				continue;
+			last_percent = percent;
+			last_label = line.c_str() + 9 + label;
+
+			logger::info("[PROGRESS] %s %u%%", last_label.c_str(), percent);
+		}
+	}
+
+	close(fd);
+
+	if (ret < 0)
+		logger::error("flash job failed: %s", strerror(-ret));
+
+	return ret;
+}
+
+}  // namespace server
@@ -0,0 +1,501 @@
+#include "session.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "archive.h"
+#include "digest.h"
+#include "filter.h"
+#include "firehose.h"
+#include "logger.h"
+#include "manifest.h"
+#include "sahara.h"
+#include "topology.h"
+
+Session::~Session() {
+	stopping = true;
+	if (hashing.joinable())
+		hashing.join();
+}
+
+/**
+ * compile() - compile the manifests in @files into the plan file
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int Session::compile(const std::vector<const char*>& files) {
+	auto compiled = std::make_shared<plan::Plan>();
+	int ret;
+
+	if (!options.plan_file)
+		return -EINVAL;
+
+	ret = plan::compile(*compiled, options.plan_file, files, options.incdirs,
+						options.finalize_provisioning);
+	if (ret < 0)
+		return ret;
+
+	plan = compiled;
+
+	return 0;
+}
+
+/**
+ * load() - load the plan from the manifests in @files or the plan file
+ *
+ * Returns 0 on success, negative errno on failure.
+ *
+ * Prefetching of the images starts right away, so it overlaps with waiting
+ * for the device and uploading the programmer.
+ */
+int Session::load(const std::vector<const char*>& files) {
+	auto loaded = std::make_shared<plan::Plan>();
+	int ret;
+
+	if (options.plan_file) {
+		ret = plan::load(*loaded, options.plan_file, files, options.incdirs,
+						 options.finalize_provisioning);
+		if (ret < 0)
+			return ret;
+	} else {
+		ret = manifest::load(*loaded, files, options.finalize_provisioning);
+		if (ret < 0)
+			return ret;
+
+		program::resolve(loaded->programs, loaded->strings, options.incdirs);
+	}
+
+	return Session::load(loaded);
+}
+
+/**
+ * load() - use an already loaded, possibly shared, @plan
+ */
+int Session::load(std::shared_ptr<const plan::Plan> plan) {
+	filter::Matcher matcher;
+	uint64_t sectors;
+	int ret;
+
+	if (this->plan)
+		return -EALREADY;
+
+	/* Filtered here rather than compiled in, so one plan serves all subsets */
+	ret = matcher.compile(options.only, options.skip);
+	if (ret < 0)
+		return ret;
+	if (!matcher.empty())
+		plan = filter::apply(matcher, plan);
+
+	/* Shared by all sessions, each may only use the one set up */
+	if (options.digest_dir && digest::dir() != options.digest_dir) {
+		logger::error("[DIGEST] %s isn't the digest cache in use",
+					  options.digest_dir);
+		return -EINVAL;
+	}
+
+	if (options.progress) {
+		ret = stream.open(options.progress);
+		if (ret < 0)
+			return ret;
+	}
+
+	if (options.personalize_file) {
+		ret = personal_template.load(options.personalize_file);
+		if (ret < 0)
+			return ret;
+	}
+
+	this->plan = plan;
+
+	/* As much as apply_program() will write */
+	for (auto& program : plan->programs) {
+		if (!program.path)
+			continue;
+
+		sectors = (program.image_size + program.sector_size - 1) /
+				  program.sector_size;
+		if (program.num_sectors && sectors > program.num_sectors)
+			sectors = program.num_sectors;
+		plan_bytes += sectors * program.sector_size;
+	}
+
+	/*
+	 * Prefetching would fill the page cache direct I/O is avoiding, and a
+	 * group's shared reads don't need one prefetcher per session
+	 */
+	if (!options.direct_io && !group)
+		prefetch.start(plan->programs, options.prefetch_budget);
+
+	/*
+	 * Hashing runs alongside flashing, mostly from the page cache, on few
+	 * enough threads to leave the CPUs to the sessions
+	 */
+	if (options.digest_dir) {
+		hashing = std::thread([this, plan] {
+			std::vector<const char*> paths;
+
+			for (auto& program : plan->programs)
+				if (program.path)
+					paths.push_back(program.path);
+
+			digest::fill(paths, DIGEST_BACKGROUND_WORKERS, options.direct_io,
+						 &stopping);
+		});
+	}
+
+	return 0;
+}
+
+/**
+ * share() - read the images together with the other sessions of @group
+ *
+ * To be called before load(), the group does the prefetching for all of its
+ * sessions, see Group::prefetch().
+ */
+void Session::share(std::shared_ptr<fanout::Group> group) {
+	this->group = std::move(group);
+	shared = this->group->join();
+}
+
+/**
+ * open() - open the device selected in the options, waiting for it if needed
+ */
+int Session::open() {
+	int ret;
+
+	if (topology::enabled())
+		ret = usb.open(options.device, topology::load);
+	else
+		ret = usb.open(options.device);
+	if (ret < 0)
+		return ret;
+
+	return Session::attach(usb);
+}
+
+/**
+ * open() - open the device selected in the options, for flashing from a
+ * coroutine of @engine
+ */
+int Session::open(engine::Engine& engine) {
+	int ret;
+
+	if (topology::enabled())
+		ret = usb.open(options.device, topology::load);
+	else
+		ret = usb.open(options.device);
+	if (ret < 0)
+		return ret;
+
+	async.reset(new engine::Usb(engine, usb));
+
+	return Session::attach(*async);
+}
+
+/**
+ * attach() - talk to the device through @transport instead of opening one
+ *
+ * Used for replaying captures; @transport must outlive the session. The
+ * traffic is captured if the options ask for it.
+ */
+int Session::attach(Transport& transport) {
+	topology::Location location;
+	int ret;
+
+	this->transport = &transport;
+	stream.set_device(usb.name[0] ? usb.name : options.device);
+
+	/* Share the controller with the other sessions, from a nearby CPU */
+	if (&transport == &usb && topology::enabled() &&
+		topology::locate(usb.name, location) == 0) {
+		seat.reset(new topology::Seat(transport, location));
+		this->transport = seat.get();
+
+		topology::pin(seat->cpu());
+		prefetch.pin(seat->cpu());
+
+		logger::info("[SCHED] %s: bus %u port %s, %u Mbit/s, cpu %d",
+					 usb.name, location.bus, location.port_path.c_str(),
+					 location.speed, seat->cpu());
+	}
+
+	/* Coroutines of an engine share its thread: yield rather than pin */
+	if (async && &transport == async.get() && topology::enabled() &&
+		topology::locate(usb.name, location) == 0) {
+		seat.reset(new topology::Seat(
+			transport, location,
+			[this](unsigned ms) { async->sleep(ms); }));
+		this->transport = seat.get();
+
+		logger::info("[SCHED] %s: bus %u port %s, %u Mbit/s", usb.name,
+					 location.bus, location.port_path.c_str(), location.speed);
+	}
+
+	if (options.capture) {
+		recorder.reset(new capture::Recorder(*this->transport));
+		ret = recorder->open(options.capture);
+		if (ret < 0)
+			return ret;
+
+		this->transport = recorder.get();
+	}
+
+	return 0;
+}
+
+/**
+ * flash() - upload @prog_mbn and flash the loaded plan to the device
+ *
+ * Returns 0 on success, negative errno on failure.
+ *
+ * If there's no file @prog_mbn, it's looked for in the archives among the
+ * include directories.
+ */
+int Session::flash(const char* prog_mbn) {
+	std::unique_ptr<image::Source> programmer;
+	std::string path;
+	int ret;
+
+	programmer = image::open(prog_mbn, false);
+	if (!programmer && errno == ENOENT) {
+		path = archive::resolve(options.incdirs, prog_mbn);
+		if (!path.empty())
+			programmer = image::open(path.c_str(), false);
+		else
+			errno = ENOENT;
+	}
+	if (!programmer) {
+		ret = -errno;
+		logger::error("unable to open %s", prog_mbn);
+		if (on_complete)
+			on_complete(ret, report);
+		return ret;
+	}
+
+	return Session::flash(*programmer);
+}
+
+/* Time for a device in EDL mode to present its Sahara hello */
+#define DETECT_TIMEOUT 500
+/* Time to wait for the hello before probing, as long as Sahara would wait */
+#define DETECT_HELLO_TIMEOUT 1000
+/* Time for a running programmer to answer a NOP */
+#define DETECT_PING_TIMEOUT 200
+/* Time for a device to restart into EDL mode after UFS provisioning */
+#define SESSION_RECONNECT_TIMEOUT 30000
+
+/**
+ * detect() - tell whether the device needs the programmer uploaded
+ * @hello:	receives the Sahara hello packet, if one was read
+ *
+ * A device entering EDL mode sends a Sahara hello right away, while a device
+ * left running a programmer by an earlier session (see --no-reset) is silent
+ * or sends Firehose logs, and answers a NOP. A NOP is garbage to Sahara, so
+ * it is only sent early when --no-reset says a programmer may be running,
+ * and otherwise once Sahara would have given up waiting for the hello.
+ *
+ * Returns 1 if a programmer is already running, 0 otherwise.
+ */
+int Session::detect(std::vector<char>& hello) {
+	unsigned timeout;
+	Sahara::Pkt* pkt;
+	char buf[4096];
+	int n;
+
+	timeout = options.no_reset ? DETECT_TIMEOUT : DETECT_HELLO_TIMEOUT;
+	n = transport->read(buf, sizeof(buf), timeout);
+	if (n >= (int)(2 * sizeof(uint32_t))) {
+		pkt = (Sahara::Pkt*)buf;
+		if (pkt->cmd == 1 && pkt->length == (uint32_t)n) {
+			hello.assign(buf, buf + n);
+			return 0;
+		}
+	}
+
+	if (n > 0 && memmem(buf, n, "<?xml", 5))
+		return 1;
+
+	if (n < 0) {
+		Firehose firehose(*transport, options, report);
+
+		if (firehose.ping(DETECT_PING_TIMEOUT) == 0)
+			return 1;
+	}
+
+	/* Let Sahara wait for the hello */
+	return 0;
+}
+
+/**
+ * build_personal() - build the contents of the programs personalized for
+ * the device described by @vars
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int Session::build_personal(const personalize::Vars& vars,
+							std::vector<personalize::Contents>& personal) {
+	std::vector<char> data;
+	int ret;
+	int n;
+
+	if (personal_template.empty() && !on_personalize)
+		return 0;
+
+	for (auto& program : plan->programs) {
+		ret = personal_template.build(program, vars, data);
+		if (ret >= 0 && on_personalize) {
+			if (!ret)
+				data.clear();
+			n = on_personalize(program, vars, data);
+			ret = n < 0 ? n : std::max(ret, n);
+		}
+		if (ret < 0) {
+			logger::error("[PERSONALIZE] unable to build %s", program.label);
+			return ret;
+		}
+		if (!ret)
+			continue;
+
+		logger::info("[PERSONALIZE] %s: %zu bytes built for the device",
+					 program.label, data.size());
+		personal.push_back(
+			{&program, std::make_shared<const std::vector<char>>(data)});
+	}
+
+	return 0;
+}
+
+/**
+ * flash() - upload the @programmer and flash the loaded plan to the device
+ *
+ * Returns 0 on success, negative errno on failure.
+ *
+ * If the device is already running a programmer, the upload is skipped.
+ * With flash_after_provisioning, a device that needs to restart to use its
+ * new UFS layout is found again and flashed in a second round.
+ */
+int Session::flash(image::Source& programmer) {
+	std::vector<personalize::Contents> personal;
+	const program::Program* current = NULL;
+	personalize::Vars vars;
+	std::vector<char> hello;
+	char serial[16];
+	bool provisioned = false;
+	uint64_t current_bytes = 0;
+	uint64_t done_bytes = 0;
+	int ret = 0;
+
+	if (!plan)
+		return -EINVAL;
+
+	report = Report();
+
+	phase_fn phase = [this](const char* name) {
+		stream.phase(name);
+		if (on_phase)
+			on_phase(name);
+	};
+
+	/* Turn per program progress into progress through the plan */
+	progress_fn progress = [&](const program::Program& program, uint64_t done,
+							   uint64_t total) {
+		if (&program != current) {
+			done_bytes += current_bytes;
+			current = &program;
+		}
+		current_bytes = total;
+
+		stream.update(program.label, done_bytes + done, plan_bytes);
+		if (on_progress)
+			on_progress(program, done, total);
+	};
+
+	history = history::History();
+
+	for (auto var : options.vars) {
+		const char* eq = strchr(var, '=');
+
+		if (eq)
+			vars[std::string(var, eq - var)] = eq + 1;
+	}
+	if (usb.name[0])
+		vars["device"] = usb.name;
+	else if (options.device)
+		vars["device"] = options.device;
+
+	/* A second round follows if the new UFS layout needs a restart */
+	for (;;) {
+		hello.clear();
+		personal.clear();
+
+		if (detect(hello) == 1) {
+			logger::info(
+				"[SAHARA] programmer already running, skipping upload");
+			if (options.history_dir)
+				logger::info(
+					"[HISTORY] serial number unknown, flashing everything");
+		} else {
+			Sahara sahara(*transport);
+
+			sahara.read_serial = options.history_dir ||
+								 options.personalize_file || on_personalize;
+
+			phase("sahara");
+			ret = sahara.run(programmer, hello.empty() ? NULL : hello.data(),
+							 hello.size());
+			if (!ret && sahara.has_serial) {
+				snprintf(serial, sizeof(serial), "%08x", sahara.serial);
+				vars["serial"] = serial;
+				if (options.history_dir)
+					history.open(options.history_dir, sahara.serial);
+			}
+		}
+
+		if (!ret)
+			ret = Session::build_personal(vars, personal);
+
+		if (!ret) {
+			Firehose firehose(*transport, options, report);
+
+			firehose.progress = progress;
+			firehose.phase = phase;
+			firehose.shared = shared.get();
+			firehose.history = history.active() ? &history : nullptr;
+			firehose.personal = std::move(personal);
+			firehose.provisioned = provisioned;
+			ret = firehose.run(*plan, &prefetch);
+
+			/* Whatever was acknowledged stays recorded, even on failure */
+			history.save();
+		}
+
+		if (ret != -ERESTART || provisioned)
+			break;
+
+		phase("reconnect");
+		ret = transport->reconnect(SESSION_RECONNECT_TIMEOUT);
+		if (ret < 0) {
+			logger::error("[UFS] device didn't come back: %s, power cycle it "
+						  "and flash it again",
+						  strerror(-ret));
+			break;
+		}
+		provisioned = true;
+	}
+
+	/* Firehose reports a NAK as a positive value */
+	if (ret > 0)
+		ret = -EIO;
+
+	/* Don't keep the other sessions of the group waiting */
+	shared.reset();
+
+	stream.finish(ret);
+
+	if (on_complete)
+		on_complete(ret, report);
+
+	return ret;
+}
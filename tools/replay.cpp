@@ -0,0 +1,130 @@
+/*
+ * qdl-replay: run a flashing session against a capture made with
+ * --capture, with the capture standing in for the device. Reports how long
+ * the host side took and whether it sent the same traffic as when the
+ * capture was made.
+ */
+#include <getopt.h>
+
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+#include "capture.h"
+#include "filter.h"
+#include "logger.h"
+#include "session.h"
+
+static void print_usage() {
+	extern const char* __progname;
+	fprintf(stderr,
+			"%s [--realtime] [--storage <emmc|ufs>] [--finalize-provisioning] "
+			"[--flash-after-provisioning] "
+			"[--firmware] [--only <FILTER>]... [--skip <FILTER>]... "
+			"[--plan <FILE>] [--include <PATH>]... <capture> <prog.mbn> "
+			"[<program> <patch> ...]\n",
+			__progname);
+}
+
+int main(int argc, char** argv) {
+	std::vector<const char*> files;
+	capture::Player player;
+	bool realtime = false;
+	Options options;
+	char* capture_file;
+	char* prog_mbn;
+	int ret;
+	int opt;
+
+	static struct option long_options[] = {
+		{"realtime", no_argument, 0, 'r'},
+		{"include", required_argument, 0, 'i'},
+		{"finalize-provisioning", no_argument, 0, 'l'},
+		{"flash-after-provisioning", no_argument, 0, 'A'},
+		{"storage", required_argument, 0, 's'},
+		{"firmware", no_argument, 0, 'f'},
+		{"only", required_argument, 0, 'O'},
+		{"skip", required_argument, 0, 'K'},
+		{"plan", required_argument, 0, 'p'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}};
+
+	while ((opt = getopt_long(argc, argv, "fri:", long_options, NULL)) !=
+		   -1) {
+		switch (opt) {
+			case 'r':
+				realtime = true;
+				break;
+			case 'i':
+				options.incdirs.push_back(optarg);
+				break;
+			case 'l':
+				options.finalize_provisioning = true;
+				break;
+			case 'A':
+				options.flash_after_provisioning = true;
+				break;
+			case 's':
+				options.storage = optarg;
+				break;
+			case 'f':
+				options.skip.push_back(FILTER_FIRMWARE);
+				break;
+			case 'O':
+				options.only.push_back(optarg);
+				break;
+			case 'K':
+				options.skip.push_back(optarg);
+				break;
+			case 'p':
+				options.plan_file = optarg;
+				break;
+			case 'h':
+				print_usage();
+				return 0;
+			default:
+				print_usage();
+				return 1;
+		}
+	}
+
+	if ((optind + (options.plan_file ? 2 : 3)) > argc) {
+		print_usage();
+		return 1;
+	}
+
+	capture_file = argv[optind++];
+	prog_mbn = argv[optind++];
+	files.assign(argv + optind, argv + argc);
+
+	logger::start(NULL);
+
+	ret = player.open(capture_file, realtime);
+	if (ret < 0)
+		return 1;
+
+	Session session(options);
+
+	ret = session.load(files);
+	if (ret < 0)
+		return 1;
+
+	session.attach(player);
+
+	auto t0 = std::chrono::steady_clock::now();
+	ret = session.flash(prog_mbn);
+	auto t1 = std::chrono::steady_clock::now();
+
+	logger::flush();
+
+	printf("replay: %s in %.3f s\n", ret < 0 ? "failed" : "done",
+		   std::chrono::duration<double>(t1 - t0).count());
+	if (player.mismatches)
+		printf("replay: %u transfers differ from the capture, first at "
+			   "record %zu\n",
+			   player.mismatches, player.first_mismatch);
+	if (player.remaining())
+		printf("replay: %zu records left unused\n", player.remaining());
+
+	return ret < 0 || player.mismatches ? 1 : 0;
+}
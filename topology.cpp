@@ -0,0 +1,309 @@
+#include "topology.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+
+#include "logger.h"
+
+/* Writes at least this large are bulk data, rather than commands */
+#define TOPOLOGY_BULK_MIN (64 * 1024)
+/* Interval of checking for a free transfer slot without blocking, ms */
+#define TOPOLOGY_POLL 1
+
+namespace topology {
+
+using clock = std::chrono::steady_clock;
+
+struct Controller {
+	std::string path;
+	std::vector<int> cpus;
+	unsigned next_cpu = 0;
+
+	std::mutex lock;
+	std::condition_variable cond;
+	unsigned sessions = 0;
+	unsigned active = 0;
+
+	uint64_t bytes = 0;
+	clock::time_point first;
+	clock::time_point busy_since;
+	clock::duration busy = clock::duration::zero();
+};
+
+static std::mutex lock;
+static unsigned limit;
+static std::map<std::string, std::shared_ptr<Controller>> controllers;
+static clock::time_point started;
+
+static std::string read_attr(const std::string& path) {
+	std::ifstream in(path);
+	std::string value;
+
+	std::getline(in, value);
+
+	return value;
+}
+
+/**
+ * locate() - find where the USB device @sysname sits in the USB topology
+ *
+ * Returns 0 on success, negative errno on failure.
+ */
+int locate(const char* sysname, Location& out) {
+	std::string dev = std::string("/sys/bus/usb/devices/") + sysname;
+	std::string value;
+	char* real;
+
+	value = read_attr(dev + "/busnum");
+	if (value.empty())
+		return -ENODEV;
+
+	out.bus = strtoul(value.c_str(), NULL, 10);
+	out.port_path = read_attr(dev + "/devpath");
+	out.speed = strtoul(read_attr(dev + "/speed").c_str(), NULL, 10);
+
+	/* USB 2 and USB 3 root hubs of one xHCI share its parent device */
+	real = realpath(
+		("/sys/bus/usb/devices/usb" + std::to_string(out.bus) + "/..").c_str(),
+		NULL);
+	out.controller = real ? real : "usb" + std::to_string(out.bus);
+	free(real);
+
+	return 0;
+}
+
+/**
+ * set_limit() - cap concurrent bulk transfers per host controller
+ * @transfers:	the cap, 0 to disable topology aware scheduling
+ */
+void set_limit(unsigned transfers) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	limit = transfers;
+}
+
+bool enabled() {
+	std::lock_guard<std::mutex> guard(lock);
+
+	return limit > 0;
+}
+
+static std::vector<int> parse_cpulist(const std::string& list) {
+	std::vector<int> cpus;
+	std::stringstream ss(list);
+	std::string range;
+	int first;
+	int last;
+
+	while (std::getline(ss, range, ',')) {
+		if (sscanf(range.c_str(), "%d-%d", &first, &last) != 2) {
+			if (sscanf(range.c_str(), "%d", &first) != 1)
+				continue;
+			last = first;
+		}
+
+		for (; first <= last; first++)
+			cpus.push_back(first);
+	}
+
+	return cpus;
+}
+
+static std::shared_ptr<Controller> get_controller(const std::string& path) {
+	std::shared_ptr<Controller> controller;
+	cpu_set_t allowed;
+	int cpu;
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	auto it = controllers.find(path);
+	if (it != controllers.end())
+		return it->second;
+
+	controller = std::make_shared<Controller>();
+	controller->path = path;
+
+	/* CPUs in the controller's NUMA node, among those we may run on */
+	sched_getaffinity(0, sizeof(allowed), &allowed);
+	for (auto id : parse_cpulist(read_attr(path + "/local_cpulist")))
+		if (id < CPU_SETSIZE && CPU_ISSET(id, &allowed))
+			controller->cpus.push_back(id);
+	if (controller->cpus.empty()) {
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &allowed))
+				controller->cpus.push_back(cpu);
+	}
+
+	controllers[path] = controller;
+
+	return controller;
+}
+
+/**
+ * load() - number of sessions on the controller of USB device @sysname
+ *
+ * Used to prefer devices on idle controllers.
+ */
+unsigned load(const char* sysname) {
+	std::shared_ptr<Controller> controller;
+	Location location;
+
+	if (locate(sysname, location) < 0)
+		return UINT_MAX;
+
+	controller = get_controller(location.controller);
+
+	std::lock_guard<std::mutex> guard(controller->lock);
+	return controller->sessions;
+}
+
+Seat::Seat(Transport& inner,
+		   const Location& location,
+		   std::function<void(unsigned)> sleep)
+	: inner(inner), sleep(std::move(sleep)) {
+	controller = get_controller(location.controller);
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		if (started == clock::time_point())
+			started = clock::now();
+	}
+
+	std::lock_guard<std::mutex> guard(controller->lock);
+	controller->sessions++;
+	if (!controller->cpus.empty())
+		cpu_ = controller->cpus[controller->next_cpu++ %
+								controller->cpus.size()];
+}
+
+Seat::~Seat() {
+	std::lock_guard<std::mutex> guard(controller->lock);
+
+	controller->sessions--;
+}
+
+int Seat::read(void* buf, size_t len, unsigned int timeout) {
+	return inner.read(buf, len, timeout);
+}
+
+int Seat::write(const void* buf, size_t len, bool eot) {
+	Controller* c = controller.get();
+	clock::time_point now;
+	unsigned max;
+	int saved_errno;
+	int n;
+
+	if (len < TOPOLOGY_BULK_MIN)
+		return inner.write(buf, len, eot);
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		max = limit;
+	}
+
+	{
+		std::unique_lock<std::mutex> guard(c->lock);
+
+		if (sleep) {
+			while (max && c->active >= max) {
+				guard.unlock();
+				sleep(TOPOLOGY_POLL);
+				guard.lock();
+			}
+		} else {
+			c->cond.wait(guard, [c, max] { return !max || c->active < max; });
+		}
+		if (!c->active++) {
+			c->busy_since = clock::now();
+			if (c->first == clock::time_point())
+				c->first = c->busy_since;
+		}
+	}
+
+	n = inner.write(buf, len, eot);
+	saved_errno = errno;
+
+	{
+		std::lock_guard<std::mutex> guard(c->lock);
+
+		if (n > 0)
+			c->bytes += n;
+		if (!--c->active) {
+			now = clock::now();
+			c->busy += now - c->busy_since;
+		}
+	}
+	c->cond.notify_one();
+
+	errno = saved_errno;
+	return n;
+}
+
+/**
+ * pin() - run the calling thread, and threads it starts later, on @cpu
+ */
+int pin(int cpu) {
+	cpu_set_t set;
+
+	if (cpu < 0)
+		return -EINVAL;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	return -pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/**
+ * report() - log throughput and utilization of each host controller
+ */
+void report() {
+	clock::time_point now = clock::now();
+	uint64_t total = 0;
+	double wall;
+	double busy;
+	double secs;
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (started == clock::time_point())
+		return;
+
+	for (auto& entry : controllers) {
+		Controller* c = entry.second.get();
+
+		std::lock_guard<std::mutex> cguard(c->lock);
+
+		if (c->first == clock::time_point())
+			continue;
+
+		busy = std::chrono::duration<double>(c->busy).count();
+		if (c->active)
+			busy += std::chrono::duration<double>(now - c->busy_since).count();
+		secs = std::chrono::duration<double>(now - c->first).count();
+
+		logger::notice("[SCHED] %s: %u sessions, %.1f MB/s, %.0f%% busy",
+					   c->path.c_str(), c->sessions,
+					   secs > 0 ? c->bytes / secs / 1e6 : 0,
+					   secs > 0 ? busy * 100 / secs : 0);
+		total += c->bytes;
+	}
+
+	wall = std::chrono::duration<double>(now - started).count();
+	logger::notice("[SCHED] aggregate %.1f MB/s over %.0f s",
+				   wall > 0 ? total / wall / 1e6 : 0, wall);
+}
+
+}  // namespace topology
@@ -28,9 +28,6 @@
  */
 #include "ufs.h"
 
-#include <libxml/parser.h>
-#include <libxml/tree.h>
-#include <libxml/xpath.h>
 #include <unistd.h>
 
 #include <cassert>
@@ -38,18 +35,13 @@
 #include <cstdbool>
 #include <cstdlib>
 #include <cstring>
-#include <iostream>
 
+#include "logger.h"
 #include "patch.h"
 #include "qdl.h"
 
 namespace ufs {
 
-std::shared_ptr<Common> ufs_common_p;
-std::shared_ptr<Epilogue> ufs_epilogue_p;
-std::shared_ptr<Body> ufs_body_p;
-std::shared_ptr<Body> ufs_body_last;
-
 static const char notice_bconfigdescrlock[] =
 	"\n"
 	"Please pay attention that UFS provisioning is irreversible (OTP) "
@@ -65,254 +57,209 @@ static const char notice_bconfigdescrlock[] =
 	"	and don't use command line parameter --finalize-provisioning.\n\n"
 	"In case of mismatch between CL and XML provisioning is not performed.\n\n";
 
-bool need_provisioning(void) {
-	return !!ufs_epilogue_p;
+bool need_provisioning(const Config& config) {
+	return !!config.epilogue;
 }
-static inline std::shared_ptr<Common> parse_common_params(
-	xmlNode* node,
-	bool finalize_provisioning) {
-	std::shared_ptr<Common> result(new Common);
+static inline int parse_common_params(xmlTextReaderPtr reader,
+									  Common& result) {
 	int errors;
 
 	errors = 0;
 
-	result->bNumberLU = attr_as_unsigned(node, "bNumberLU", &errors);
-	result->bBootEnable = !!attr_as_unsigned(node, "bBootEnable", &errors);
-	result->bDescrAccessEn =
-		!!attr_as_unsigned(node, "bDescrAccessEn", &errors);
-	result->bInitPowerMode = attr_as_unsigned(node, "bInitPowerMode", &errors);
-	result->bHighPriorityLUN =
-		attr_as_unsigned(node, "bHighPriorityLUN", &errors);
-	result->bSecureRemovalType =
-		attr_as_unsigned(node, "bSecureRemovalType", &errors);
-	result->bInitActiveICCLevel =
-		attr_as_unsigned(node, "bInitActiveICCLevel", &errors);
-	result->wPeriodicRTCUpdate =
-		attr_as_unsigned(node, "wPeriodicRTCUpdate", &errors);
-	result->bConfigDescrLock =
-		!!attr_as_unsigned(node, "bConfigDescrLock", &errors);
+	result.bNumberLU =
+		manifest::attr_as_unsigned(reader, "bNumberLU", &errors);
+	result.bBootEnable =
+		!!manifest::attr_as_unsigned(reader, "bBootEnable", &errors);
+	result.bDescrAccessEn =
+		!!manifest::attr_as_unsigned(reader, "bDescrAccessEn", &errors);
+	result.bInitPowerMode =
+		manifest::attr_as_unsigned(reader, "bInitPowerMode", &errors);
+	result.bHighPriorityLUN =
+		manifest::attr_as_unsigned(reader, "bHighPriorityLUN", &errors);
+	result.bSecureRemovalType =
+		manifest::attr_as_unsigned(reader, "bSecureRemovalType", &errors);
+	result.bInitActiveICCLevel =
+		manifest::attr_as_unsigned(reader, "bInitActiveICCLevel", &errors);
+	result.wPeriodicRTCUpdate =
+		manifest::attr_as_unsigned(reader, "wPeriodicRTCUpdate", &errors);
+	result.bConfigDescrLock =
+		!!manifest::attr_as_unsigned(reader, "bConfigDescrLock", &errors);
 
 	if (errors) {
-		std::cerr << "[UFS] errors while parsing common" << std::endl;
-
-		return {NULL};
+		logger::error("[UFS] errors while parsing common");
+		return -EINVAL;
 	}
 
-	return result;
+	return 0;
 }
-static inline std::shared_ptr<Body> parse_body(xmlNode* node) {
-	std::shared_ptr<Body> result(new Body);
+static inline int parse_body(xmlTextReaderPtr reader,
+							 manifest::Arena& strings,
+							 Body& result) {
 	int errors;
 
 	errors = 0;
 
-	result->LUNum = attr_as_unsigned(node, "LUNum", &errors);
-	result->bLUEnable = !!attr_as_unsigned(node, "bLUEnable", &errors);
-	result->bBootLunID = attr_as_unsigned(node, "bBootLunID", &errors);
-	result->size_in_kb = attr_as_unsigned(node, "size_in_kb", &errors);
-	result->bDataReliability =
-		attr_as_unsigned(node, "bDataReliability", &errors);
-	result->bLUWriteProtect =
-		attr_as_unsigned(node, "bLUWriteProtect", &errors);
-	result->bMemoryType = attr_as_unsigned(node, "bMemoryType", &errors);
-	result->bLogicalBlockSize =
-		attr_as_unsigned(node, "bLogicalBlockSize", &errors);
-	result->bProvisioningType =
-		attr_as_unsigned(node, "bProvisioningType", &errors);
-	result->wContextCapabilities =
-		attr_as_unsigned(node, "wContextCapabilities", &errors);
-	result->desc = attr_as_string(node, "desc", &errors);
+	result.LUNum = manifest::attr_as_unsigned(reader, "LUNum", &errors);
+	result.bLUEnable =
+		!!manifest::attr_as_unsigned(reader, "bLUEnable", &errors);
+	result.bBootLunID =
+		manifest::attr_as_unsigned(reader, "bBootLunID", &errors);
+	result.size_in_kb =
+		manifest::attr_as_unsigned(reader, "size_in_kb", &errors);
+	result.bDataReliability =
+		manifest::attr_as_unsigned(reader, "bDataReliability", &errors);
+	result.bLUWriteProtect =
+		manifest::attr_as_unsigned(reader, "bLUWriteProtect", &errors);
+	result.bMemoryType =
+		manifest::attr_as_unsigned(reader, "bMemoryType", &errors);
+	result.bLogicalBlockSize =
+		manifest::attr_as_unsigned(reader, "bLogicalBlockSize", &errors);
+	result.bProvisioningType =
+		manifest::attr_as_unsigned(reader, "bProvisioningType", &errors);
+	result.wContextCapabilities =
+		manifest::attr_as_unsigned(reader, "wContextCapabilities", &errors);
+	result.desc = manifest::attr_as_string(reader, "desc", &errors, strings);
 
 	if (errors) {
-		std::cerr << "[UFS] errors while parsing body" << std::endl;
-		return {NULL};
+		logger::error("[UFS] errors while parsing body");
+		return -EINVAL;
 	}
-	return result;
+	return 0;
 }
-static inline std::shared_ptr<Epilogue> parse_epilogue(xmlNode* node) {
-	std::shared_ptr<Epilogue> result(new Epilogue);
+static inline int parse_epilogue(xmlTextReaderPtr reader, Epilogue& result) {
 	int errors = 0;
 
-	result->LUNtoGrow = attr_as_unsigned(node, "LUNtoGrow", &errors);
+	result.LUNtoGrow =
+		manifest::attr_as_unsigned(reader, "LUNtoGrow", &errors);
 
 	if (errors) {
-		std::cerr << "[UFS] errors while parsing epilogue" << std::endl;
-		return {NULL};
+		logger::error("[UFS] errors while parsing epilogue");
+		return -EINVAL;
 	}
-	return result;
+	return 0;
 }
 
-int load(const char* ufs_file, bool finalize_provisioning) {
-	xmlNode* node;
-	xmlNode* root;
-	xmlDoc* doc;
-	int retval = 0;
-	std::shared_ptr<Body> ufs_body_tmp;
+int parse(xmlTextReaderPtr reader, manifest::Arena& strings, Config& config) {
+	const xmlChar* name;
 
-	if (ufs_common_p) {
-		std::cerr << "Only one UFS provisioning XML allowed, " << ufs_file
-				  << " ignored" << std::endl;
-		return -EEXIST;
-	}
-
-	doc = xmlReadFile(ufs_file, NULL, 0);
-	if (!doc) {
-		std::cerr << "[UFS] failed to parse " << ufs_file << std::endl;
-		return -EINVAL;
+	name = xmlTextReaderConstName(reader);
+	if (xmlStrcmp(name, (xmlChar*)"ufs")) {
+		logger::warn("[UFS] unrecognized tag \"%s\", ignoring", name);
+		return 0;
 	}
 
-	root = xmlDocGetRootElement(doc);
-
-	for (node = root->children; node; node = node->next) {
-		if (node->type != XML_ELEMENT_NODE)
-			continue;
-
-		if (xmlStrcmp(node->name, (xmlChar*)"ufs")) {
-			std::cerr << "[UFS] unrecognized tag \"" << node->name
-					  << "\", ignoring" << std::endl;
-			continue;
+	if (manifest::has_attr(reader, "bNumberLU")) {
+		if (config.common) {
+			logger::error("[UFS] Only one common tag is allowed");
+			logger::error("[UFS] provisioning aborted");
+			return -EINVAL;
 		}
 
-		if (xmlGetProp(node, (xmlChar*)"bNumberLU")) {
-			if (!ufs_common_p) {
-				ufs_common_p = parse_common_params(node, finalize_provisioning);
-			} else {
-				std::cerr << "[UFS] Only one common tag is allowed" << std::endl
-						  << "[UFS] provisioning aborted" << std::endl;
-				retval = -EINVAL;
-				break;
-			}
-
-			if (!ufs_common_p) {
-				std::cerr << "[UFS] Common tag corrupted" << std::endl
-						  << "[UFS] provisioning aborted" << std::endl;
-				retval = -EINVAL;
-				break;
-			}
-		} else if (xmlGetProp(node, (xmlChar*)"LUNum")) {
-			ufs_body_tmp = parse_body(node);
-			if (ufs_body_tmp) {
-				if (ufs_body_p) {
-					ufs_body_last->next = ufs_body_tmp;
-					ufs_body_last = ufs_body_tmp;
-				} else {
-					ufs_body_p = ufs_body_tmp;
-					ufs_body_last = ufs_body_tmp;
-				}
-			} else {
-				std::cerr << "[UFS] LU tag corrupted" << std::endl
-						  << "[UFS] provisioning aborted" << std::endl;
-				retval = -EINVAL;
-				break;
-			}
-		} else if (xmlGetProp(node, (xmlChar*)"commit")) {
-			if (!ufs_epilogue_p) {
-				ufs_epilogue_p = parse_epilogue(node);
-				if (ufs_epilogue_p)
-					continue;
-			} else {
-				std::cerr << "[UFS] Only one finalizing tag is allowed"
-						  << std::endl
-						  << "[UFS] provisioning aborted" << std::endl;
-				retval = -EINVAL;
-				break;
-			}
-
-			if (!ufs_epilogue_p) {
-				std::cerr << "[UFS] Finalizing tag corrupted" << std::endl
-						  << "[UFS] provisioning aborted" << std::endl;
-				retval = -EINVAL;
-				break;
-			}
-
-		} else {
-			std::cerr << "[UFS] Unknown tag or " << ufs_file << " corrupted"
-					  << std::endl
-					  << "[UFS] provisioning aborted" << std::endl;
+		config.common.emplace();
+		if (parse_common_params(reader, *config.common)) {
+			logger::error("[UFS] Common tag corrupted");
+			logger::error("[UFS] provisioning aborted");
+			return -EINVAL;
+		}
+	} else if (manifest::has_attr(reader, "LUNum")) {
+		config.bodies.emplace_back();
+		if (parse_body(reader, strings, config.bodies.back())) {
+			logger::error("[UFS] LU tag corrupted");
+			logger::error("[UFS] provisioning aborted");
+			return -EINVAL;
+		}
+	} else if (manifest::has_attr(reader, "commit")) {
+		if (config.epilogue) {
+			logger::error("[UFS] Only one finalizing tag is allowed");
+			logger::error("[UFS] provisioning aborted");
+			return -EINVAL;
+		}
 
-			retval = -EINVAL;
-			break;
+		config.epilogue.emplace();
+		if (parse_epilogue(reader, *config.epilogue)) {
+			logger::error("[UFS] Finalizing tag corrupted");
+			logger::error("[UFS] provisioning aborted");
+			return -EINVAL;
 		}
+	} else {
+		logger::error("[UFS] Unknown tag or file corrupted");
+		logger::error("[UFS] provisioning aborted");
+		return -EINVAL;
 	}
 
-	xmlFreeDoc(doc);
+	return 0;
+}
 
-	if (!retval && (!ufs_common_p || !ufs_body_p || !ufs_epilogue_p)) {
-		std::cerr << "[UFS] " << ufs_file << " seems to be incomplete"
-				  << std::endl
-				  << "[UFS] provisioning aborted" << std::endl;
-		retval = -EINVAL;
+int install(Config& dst,
+			Config& config,
+			const char* ufs_file,
+			bool finalize_provisioning) {
+	if (dst.common) {
+		logger::error("Only one UFS provisioning XML allowed, %s ignored",
+					  ufs_file);
+		return -EEXIST;
 	}
 
-	if (retval) {
-		if (ufs_common_p) {
-			ufs_common_p.reset();
-		}
-		if (ufs_body_p) {
-			ufs_body_p.reset();
-		}
-		if (ufs_epilogue_p) {
-			ufs_epilogue_p.reset();
-		}
-		std::cerr << "[UFS] " << ufs_file << " seems to be corrupted, ignore"
-				  << std::endl;
-		return retval;
+	if (!config.common || config.bodies.empty() || !config.epilogue) {
+		logger::error("[UFS] %s seems to be incomplete", ufs_file);
+		logger::error("[UFS] provisioning aborted");
+		logger::error("[UFS] %s seems to be corrupted, ignore", ufs_file);
+		return -EINVAL;
 	}
-	if (!finalize_provisioning != !ufs_common_p->bConfigDescrLock) {
-		std::cerr << "[UFS] Value bConfigDescrLock "
-				  << ufs_common_p->bConfigDescrLock << " in file " << ufs_file
-				  << " don't match "
-					 "command line parameter --finalize-provisioning "
-				  << finalize_provisioning << std::endl
-				  << "[UFS] provisioning aborted" << std::endl;
-		std::cerr << notice_bconfigdescrlock;
+
+	if (!finalize_provisioning != !config.common->bConfigDescrLock) {
+		logger::error(
+			"[UFS] Value bConfigDescrLock %d in file %s don't match command "
+			"line parameter --finalize-provisioning %d",
+			config.common->bConfigDescrLock, ufs_file, finalize_provisioning);
+		logger::error("[UFS] provisioning aborted");
+		logger::error("%s", notice_bconfigdescrlock);
 		return -EINVAL;
 	}
+
+	dst = std::move(config);
+
 	return 0;
 }
 
-int provisioning_execute(ufs_apply* prov) {
+int provisioning_execute(const Config& config, ufs_apply* prov) {
 	int ret;
-	std::shared_ptr<Body> body;
 
-	if (ufs_common_p->bConfigDescrLock) {
+	if (config.common->bConfigDescrLock) {
 		int i;
-		std::cout << "Attention!" << std::endl
-				  << "Irreversible provisioning will start in 5 s" << std::endl;
+		logger::info("Attention!");
 		for (i = 5; i > 0; i--) {
-			std::cout << ".\a";
+			logger::info("Irreversible provisioning will start in %d s\a", i);
 			sleep(1);
 		}
-		std::cout << std::endl;
 	}
 
 	// Just ask a target to check the XML w/o real provisioning
-	ret = prov->apply_ufs_common(ufs_common_p);
+	ret = prov->apply_ufs_common(*config.common);
 	if (ret)
 		return ret;
-	for (body = ufs_body_p; body; body = body->next) {
+	for (auto& body : config.bodies) {
 		ret = prov->apply_ufs_body(body);
 		if (ret)
 			return ret;
 	}
-	ret = prov->apply_ufs_epilogue(ufs_epilogue_p, false);
+	ret = prov->apply_ufs_epilogue(*config.epilogue, false);
 	if (ret) {
-		std::cerr
-			<< "UFS provisioning impossible, provisioning XML may be corrupted"
-			<< std::endl;
+		logger::error(
+			"UFS provisioning impossible, provisioning XML may be corrupted");
 		return ret;
 	}
 
 	// Real provisioning -- target didn't refuse a given XML
-	ret = prov->apply_ufs_common(ufs_common_p);
+	ret = prov->apply_ufs_common(*config.common);
 	if (ret)
 		return ret;
-	for (body = ufs_body_p; body; body = body->next) {
+	for (auto& body : config.bodies) {
 		ret = prov->apply_ufs_body(body);
 		if (ret)
 			return ret;
 	}
-	return prov->apply_ufs_epilogue(ufs_epilogue_p, true);
+	return prov->apply_ufs_epilogue(*config.epilogue, true);
 }
 
 }  // namespace ufs
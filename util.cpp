@@ -37,6 +37,8 @@
 #include <cstring>
 #include <iostream>
 
+#include "logger.h"
+
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 
 static uint8_t to_hex(uint8_t ch) {
@@ -76,11 +78,12 @@ void print_hex_dump(const char* prefix, const void* buf, size_t len) {
 
 		line[li] = '\0';
 
-		printf("%s %04x: %s\n", prefix, (int)i, line);
+		logger::info("%s %04x: %s", prefix, (int)i, line);
 	}
 }
 
 unsigned attr_as_unsigned(xmlNode* node, const char* attr, int* errors) {
+	unsigned int ret;
 	xmlChar* value;
 
 	value = xmlGetProp(node, (xmlChar*)attr);
@@ -89,11 +92,15 @@ unsigned attr_as_unsigned(xmlNode* node, const char* attr, int* errors) {
 		return 0;
 	}
 
-	return (unsigned int)strtoul((char*)value, NULL, 10);
+	ret = (unsigned int)strtoul((char*)value, NULL, 10);
+	xmlFree(value);
+
+	return ret;
 }
 
 const char* attr_as_string(xmlNode* node, const char* attr, int* errors) {
 	xmlChar* value;
+	char* ret = NULL;
 
 	value = xmlGetProp(node, (xmlChar*)attr);
 	if (!value) {
@@ -101,8 +108,64 @@ const char* attr_as_string(xmlNode* node, const char* attr, int* errors) {
 		return NULL;
 	}
 
-	if (value[0] == '\0')
-		return NULL;
+	if (value[0] != '\0')
+		ret = strdup((char*)value);
+	xmlFree(value);
+
+	return ret;
+}
+
+/* CRC-32 (IEEE 802.3, as used by GPT), eight table lookups per 8 bytes */
+static uint32_t crc32_table[8][256];
+
+static void crc32_init() {
+	uint32_t crc;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+		crc32_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++) {
+		crc = crc32_table[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = crc32_table[0][crc & 0xff] ^ (crc >> 8);
+			crc32_table[j][i] = crc;
+		}
+	}
+}
+
+/**
+ * crc32() - CRC-32 of @len bytes at @buf, continuing from @crc
+ *
+ * Pass 0 as @crc for the first block.
+ */
+uint32_t crc32(uint32_t crc, const void* buf, size_t len) {
+	static const bool initialized = (crc32_init(), true);
+	const uint8_t* ptr = (const uint8_t*)buf;
+	uint32_t lo;
+	uint32_t hi;
+
+	(void)initialized;
+
+	crc = ~crc;
+
+	for (; len >= 8; ptr += 8, len -= 8) {
+		memcpy(&lo, ptr, 4);
+		memcpy(&hi, ptr + 4, 4);
+		lo ^= crc;
+
+		crc = crc32_table[7][lo & 0xff] ^ crc32_table[6][(lo >> 8) & 0xff] ^
+			  crc32_table[5][(lo >> 16) & 0xff] ^ crc32_table[4][lo >> 24] ^
+			  crc32_table[3][hi & 0xff] ^ crc32_table[2][(hi >> 8) & 0xff] ^
+			  crc32_table[1][(hi >> 16) & 0xff] ^ crc32_table[0][hi >> 24];
+	}
+
+	while (len--)
+		crc = crc32_table[0][(crc ^ *ptr++) & 0xff] ^ (crc >> 8);
 
-	return strdup((char*)value);
+	return ~crc;
 }